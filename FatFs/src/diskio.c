@@ -14,6 +14,29 @@
 #include "diskio.h"
 #include "ff_gen_drv.h"
 
+#include <string.h>
+
+#if DISK_STATS == 1 && !defined(DISK_STATS_CYCLES)
+/* Latency is measured with the Cortex-M DWT cycle counter. Hosted builds
+   can supply their own DISK_STATS_CYCLES()/DISK_STATS_CYCLES_INIT(). */
+#include "stm32f4xx.h"
+#define DISK_STATS_CYCLES_INIT() do { \
+          CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk; \
+          DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk; \
+        } while (0)
+#define DISK_STATS_CYCLES()      (DWT->CYCCNT)
+#endif
+
+#if DISK_STATS == 1 && _FS_REENTRANT
+/* Stats are also read, reset and fed by tasks outside the volume lock */
+#include "task.h"
+#define DISK_STATS_LOCK()        taskENTER_CRITICAL()
+#define DISK_STATS_UNLOCK()      taskEXIT_CRITICAL()
+#else
+#define DISK_STATS_LOCK()
+#define DISK_STATS_UNLOCK()
+#endif
+
 #if defined ( __GNUC__ )
 #ifndef __weak
 #define __weak __attribute__((weak))
@@ -21,13 +44,236 @@
 #endif
 
 /* Private typedef -----------------------------------------------------------*/
+#if READAHEAD_SECTORS > 1
+typedef struct
+{
+  DWORD   start;                  /* First sector held in the buffer */
+  UINT    count;                  /* Sectors held, 0 if empty */
+  UINT    used;                   /* Sectors of the buffer handed out so far */
+  UINT    depth;                  /* Sectors to prefetch next time */
+  DWORD   next;                   /* Sector a sequential reader asks for next */
+  uint32_t data[READAHEAD_SECTORS][_MAX_SS / 4];
+
+}ReadAhead_TypeDef;
+#endif /* READAHEAD_SECTORS > 1 */
+
 /* Private define ------------------------------------------------------------*/
 /* Private variables ---------------------------------------------------------*/
 extern Disk_drvTypeDef  disk;
 
+#if READAHEAD_SECTORS > 1
+/* One buffer per drive, like the statistics. With _FS_REENTRANT each volume
+   has its own lock, so a drive's buffer is only used under that lock and
+   never holds another drive's sectors. */
+static ReadAhead_TypeDef ra[_VOLUMES];
+#endif /* READAHEAD_SECTORS > 1 */
+
 /* Private function prototypes -----------------------------------------------*/
 /* Private functions ---------------------------------------------------------*/
 
+#if DISK_STATS == 1
+/**
+  * @brief  Accounts one read or write that reached the device driver
+  * @param  pdrv: Physical drive number (0..)
+  * @param  write: 1 for a write, 0 for a read
+  * @param  count: Number of sectors transferred
+  * @param  cycles: Duration of the call in CPU cycles
+  * @param  res: Result of the call
+  * @retval None
+  */
+static void DiskStats_Account(BYTE pdrv, BYTE write, UINT count, uint32_t cycles, DRESULT res)
+{
+  DISK_StatsTypeDef *st = &disk.stats[pdrv];
+  UINT bucket = (cycles != 0) ? 31 - __builtin_clz(cycles) : 0;
+
+  DISK_STATS_LOCK();
+  if (write)
+  {
+    st->writes++;
+    st->write_sectors += count;
+    st->write_bytes += (uint64_t)count * _MAX_SS;
+    st->write_hist[bucket]++;
+  }
+  else
+  {
+    st->reads++;
+    st->read_sectors += count;
+    st->read_bytes += (uint64_t)count * _MAX_SS;
+    st->read_hist[bucket]++;
+  }
+  if (res != RES_OK)
+  {
+    st->errors++;
+  }
+  DISK_STATS_UNLOCK();
+}
+
+/**
+  * @brief  Handles the DISK_* statistics control codes
+  * @param  pdrv: Physical drive number (0..)
+  * @param  cmd: Control code
+  * @param  *buff: Buffer to send/receive control data
+  * @retval DRESULT: Operation result
+  */
+static DRESULT DiskStats_Ioctl(BYTE pdrv, BYTE cmd, void *buff)
+{
+  DISK_StatsTypeDef *st = &disk.stats[pdrv];
+  DRESULT res = RES_OK;
+
+  DISK_STATS_LOCK();
+  switch (cmd)
+  {
+  case DISK_GET_STATS:
+    st->write_amp_x100 = (st->logical_bytes != 0) ?
+        (uint32_t)(st->write_bytes * 100 / st->logical_bytes) : 0;
+    *(DISK_StatsTypeDef *)buff = *st;
+    break;
+
+  case DISK_ADD_LOGICAL:
+    st->logical_bytes += *(DWORD *)buff;
+    break;
+
+  case DISK_RESET_STATS:
+    memset(st, 0, sizeof(*st));
+    break;
+
+  default:
+    res = RES_PARERR;
+    break;
+  }
+  DISK_STATS_UNLOCK();
+  return res;
+}
+#endif /* DISK_STATS == 1 */
+
+/**
+  * @brief  Reads from the drive's device driver, accounting the call unless
+  *         a caching layer linked in front of it does so itself
+  * @param  pdrv: Physical drive number (0..)
+  * @param  *buff: Data buffer to store read data
+  * @param  sector: Sector address (LBA)
+  * @param  count: Number of sectors to read
+  * @retval DRESULT: Operation result
+  */
+static DRESULT Disk_Read(BYTE pdrv, BYTE *buff, DWORD sector, UINT count)
+{
+#if DISK_STATS == 1
+  if (!disk.layered[pdrv])
+  {
+    return disk_device_read(pdrv, disk.drv[pdrv], disk.lun[pdrv], buff, sector, count);
+  }
+#endif /* DISK_STATS == 1 */
+  return disk.drv[pdrv]->disk_read(disk.lun[pdrv], buff, sector, count);
+}
+
+#if _USE_WRITE == 1
+/**
+  * @brief  Writes through the drive's device driver, accounting the call
+  *         unless a caching layer linked in front of it does so itself
+  * @param  pdrv: Physical drive number (0..)
+  * @param  *buff: Data to be written
+  * @param  sector: Sector address (LBA)
+  * @param  count: Number of sectors to write
+  * @retval DRESULT: Operation result
+  */
+static DRESULT Disk_Write(BYTE pdrv, const BYTE *buff, DWORD sector, UINT count)
+{
+#if DISK_STATS == 1
+  if (!disk.layered[pdrv])
+  {
+    return disk_device_write(pdrv, disk.drv[pdrv], disk.lun[pdrv], buff, sector, count);
+  }
+#endif /* DISK_STATS == 1 */
+  return disk.drv[pdrv]->disk_write(disk.lun[pdrv], buff, sector, count);
+}
+#endif /* _USE_WRITE == 1 */
+
+#if READAHEAD_SECTORS > 1
+/**
+  * @brief  Drops a drive's read-ahead buffer and adapts the depth to how
+  *         much of it was actually read: double it when every prefetched
+  *         sector was used, halve it when less than half were.
+  * @param  r: Read-ahead state of the drive
+  * @retval None
+  */
+static void ReadAhead_Retire(ReadAhead_TypeDef *r)
+{
+  if (r->count != 0)
+  {
+    if (r->used >= r->count && r->depth < READAHEAD_SECTORS)
+    {
+      r->depth *= 2;
+      if (r->depth > READAHEAD_SECTORS) r->depth = READAHEAD_SECTORS;
+    }
+    else if (r->used * 2 < r->count && r->depth > 2)
+    {
+      r->depth /= 2;
+    }
+  }
+  r->count = 0;
+  r->used = 0;
+}
+
+/**
+  * @brief  Drops a drive's read-ahead buffer if it overlaps a sector range
+  *         that is being written or trimmed
+  * @param  pdrv: Physical drive number (0..)
+  * @param  sector: First sector of the range
+  * @param  count: Number of sectors in the range
+  * @retval None
+  */
+static void ReadAhead_Invalidate(BYTE pdrv, DWORD sector, DWORD count)
+{
+  ReadAhead_TypeDef *r = &ra[pdrv];
+
+  if (r->count != 0 &&
+      sector < r->start + r->count && r->start < sector + count)
+  {
+    r->count = 0;
+    r->used = 0;
+  }
+}
+
+/**
+  * @brief  Serves a single sector read from the read-ahead buffer, filling
+  *         it with one multi-block read when the access is sequential
+  * @param  pdrv: Physical drive number (0..)
+  * @param  *buff: Data buffer to store read data
+  * @param  sector: Sector address (LBA)
+  * @retval DRESULT: Operation result, RES_PARERR if the read was not
+  *         served and has to go to the driver as is
+  */
+static DRESULT ReadAhead_Read(BYTE pdrv, BYTE *buff, DWORD sector)
+{
+  ReadAhead_TypeDef *r = &ra[pdrv];
+  DWORD next = r->next;
+
+  r->next = sector + 1;
+
+  if (r->count == 0 || sector < r->start || sector >= r->start + r->count)
+  {
+    if (sector != next)
+    {
+      return RES_PARERR;
+    }
+    /* Sequential miss: refill. A prefetch running past the end of the
+       medium fails; fall back to a plain read and start over shallow. */
+    ReadAhead_Retire(r);
+    if (Disk_Read(pdrv, (BYTE *)r->data, sector, r->depth) != RES_OK)
+    {
+      r->depth = 2;
+      return RES_PARERR;
+    }
+    r->start = sector;
+    r->count = r->depth;
+  }
+
+  memcpy(buff, r->data[sector - r->start], _MAX_SS);
+  r->used++;
+  return RES_OK;
+}
+#endif /* READAHEAD_SECTORS > 1 */
+
 /**
   * @brief  Gets Disk Status
   * @param  pdrv: Physical drive number (0..)
@@ -56,6 +302,15 @@ DSTATUS disk_initialize (
 
   if(disk.is_initialized[pdrv] == 0)
   {
+#if DISK_STATS == 1
+    DISK_STATS_CYCLES_INIT();
+#endif /* DISK_STATS == 1 */
+#if READAHEAD_SECTORS > 1
+    /* A new or re-initialised medium starts with an empty, shallow buffer */
+    ra[pdrv].count = 0;
+    ra[pdrv].used = 0;
+    ra[pdrv].depth = 2;
+#endif /* READAHEAD_SECTORS > 1 */
     stat = disk.drv[pdrv]->disk_initialize(disk.lun[pdrv]);
     if(stat == RES_OK)
     {
@@ -82,7 +337,23 @@ DRESULT disk_read (
 {
   DRESULT res;
 
-  res = disk.drv[pdrv]->disk_read(disk.lun[pdrv], buff, sector, count);
+#if READAHEAD_SECTORS > 1
+  if (count == 1)
+  {
+    res = ReadAhead_Read(pdrv, buff, sector);
+    if (res != RES_PARERR)
+    {
+      return res;
+    }
+  }
+  else
+  {
+    /* Multi-sector reads are already efficient; just track the stream */
+    ra[pdrv].next = sector + count;
+  }
+#endif /* READAHEAD_SECTORS > 1 */
+
+  res = Disk_Read(pdrv, buff, sector, count);
   return res;
 }
 
@@ -104,7 +375,11 @@ DRESULT disk_write (
 {
   DRESULT res;
 
-  res = disk.drv[pdrv]->disk_write(disk.lun[pdrv], buff, sector, count);
+#if READAHEAD_SECTORS > 1
+  ReadAhead_Invalidate(pdrv, sector, count);
+#endif /* READAHEAD_SECTORS > 1 */
+
+  res = Disk_Write(pdrv, buff, sector, count);
   return res;
 }
 #endif /* _USE_WRITE == 1 */
@@ -125,11 +400,85 @@ DRESULT disk_ioctl (
 {
   DRESULT res;
 
+#if DISK_STATS == 1
+  if (cmd >= DISK_GET_STATS && cmd <= DISK_RESET_STATS)
+  {
+    return DiskStats_Ioctl(pdrv, cmd, buff);
+  }
+#endif /* DISK_STATS == 1 */
+
+#if READAHEAD_SECTORS > 1
+  if (cmd == CTRL_TRIM)
+  {
+    ReadAhead_Invalidate(pdrv, ((DWORD *)buff)[0],
+                         ((DWORD *)buff)[1] - ((DWORD *)buff)[0] + 1);
+  }
+#endif /* READAHEAD_SECTORS > 1 */
+
   res = disk.drv[pdrv]->disk_ioctl(disk.lun[pdrv], cmd, buff);
   return res;
 }
 #endif /* _USE_IOCTL == 1 */
 
+/**
+  * @brief  Reads sectors from a device driver and accounts the transfer to
+  *         the drive's statistics. Caching layers issue their backend reads
+  *         through here, so the statistics describe device I/O.
+  * @param  pdrv: Physical drive number (0..) the transfer is accounted to
+  * @param  drv: Device driver
+  * @param  lun: Logical unit passed through to the driver
+  * @param  *buff: Data buffer to store read data
+  * @param  sector: Sector address (LBA)
+  * @param  count: Number of sectors to read
+  * @retval DRESULT: Operation result
+  */
+DRESULT disk_device_read(BYTE pdrv, const Diskio_drvTypeDef *drv, BYTE lun,
+                         BYTE *buff, DWORD sector, UINT count)
+{
+  DRESULT res;
+#if DISK_STATS == 1
+  uint32_t t0 = DISK_STATS_CYCLES();
+#endif /* DISK_STATS == 1 */
+
+  res = drv->disk_read(lun, buff, sector, count);
+#if DISK_STATS == 1
+  DiskStats_Account(pdrv, 0, count, DISK_STATS_CYCLES() - t0, res);
+#else
+  (void)pdrv;
+#endif /* DISK_STATS == 1 */
+  return res;
+}
+
+#if _USE_WRITE == 1
+/**
+  * @brief  Writes sectors through a device driver and accounts the transfer
+  *         to the drive's statistics, as disk_device_read()
+  * @param  pdrv: Physical drive number (0..) the transfer is accounted to
+  * @param  drv: Device driver
+  * @param  lun: Logical unit passed through to the driver
+  * @param  *buff: Data to be written
+  * @param  sector: Sector address (LBA)
+  * @param  count: Number of sectors to write
+  * @retval DRESULT: Operation result
+  */
+DRESULT disk_device_write(BYTE pdrv, const Diskio_drvTypeDef *drv, BYTE lun,
+                          const BYTE *buff, DWORD sector, UINT count)
+{
+  DRESULT res;
+#if DISK_STATS == 1
+  uint32_t t0 = DISK_STATS_CYCLES();
+#endif /* DISK_STATS == 1 */
+
+  res = drv->disk_write(lun, buff, sector, count);
+#if DISK_STATS == 1
+  DiskStats_Account(pdrv, 1, count, DISK_STATS_CYCLES() - t0, res);
+#else
+  (void)pdrv;
+#endif /* DISK_STATS == 1 */
+  return res;
+}
+#endif /* _USE_WRITE == 1 */
+
 /**
   * @brief  Gets Time from RTC
   * @param  None
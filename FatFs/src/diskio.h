@@ -67,6 +67,12 @@ DWORD get_fattime (void);
 #define MMC_GET_CID			12	/* Get CID */
 #define MMC_GET_OCR			13	/* Get OCR */
 #define MMC_GET_SDSTAT		14	/* Get SD status */
+#define MMC_GET_CLOCK		15	/* Get SPI clock frequency in Hz */
+
+/* Block device statistics, handled by diskio.c itself (needs DISK_STATS) */
+#define DISK_GET_STATS		16	/* Get DISK_StatsTypeDef counters of the drive */
+#define DISK_ADD_LOGICAL	17	/* Add DWORD bytes of payload appended by the application */
+#define DISK_RESET_STATS	18	/* Clear the counters */
 
 /* ATA/CF specific ioctl command */
 #define ATA_GET_REV			20	/* Get F/W revision */
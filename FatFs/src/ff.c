@@ -500,6 +500,23 @@
 #endif
 
 
+/* Window cache */
+#if _FS_WINCACHE && _FS_TINY
+#error _FS_WINCACHE cannot be used at tiny configuration
+#endif
+
+
+/* Free cluster map */
+#if _USE_FREEMAP
+#if _FS_READONLY
+#error _USE_FREEMAP must be 0 at read-only configuration
+#endif
+#define FMAP_BLK(fs, clst)	((clst) >> (fs)->fmap_shift)				/* Map block of a cluster */
+#define FMAP_CLST(fs, blk)	((blk) << (fs)->fmap_shift)				/* First cluster of a map block */
+#define FMAP_TEST(fs, blk)	((fs)->fmap[(blk) / 8] & (1 << ((blk) % 8)))	/* Block may have a free cluster? */
+#endif
+
+
 /* File lock controls */
 #if _FS_LOCK != 0
 #if _FS_READONLY
@@ -879,33 +896,137 @@ void clear_lock (	/* Clear lock entries of the volume */
 /* Move/Flush disk access window in the file system object               */
 /*-----------------------------------------------------------------------*/
 #if !_FS_READONLY
+static
+FRESULT flush_sector (	/* Returns FR_OK or FR_DISK_ERROR */
+	FATFS* fs,			/* File system object */
+	const BYTE* buff,	/* Window data to be written */
+	DWORD wsect			/* Sector number of the window */
+)
+{
+	UINT nf;
+
+
+	if (disk_write(fs->drv, buff, wsect, 1) != RES_OK) return FR_DISK_ERR;
+	if (wsect - fs->fatbase < fs->fsize) {		/* Is it in the FAT area? */
+		for (nf = fs->n_fats; nf >= 2; nf--) {	/* Reflect the change to all FAT copies */
+			wsect += fs->fsize;
+			disk_write(fs->drv, buff, wsect, 1);
+		}
+	}
+	return FR_OK;
+}
+
+
 static
 FRESULT sync_window (	/* Returns FR_OK or FR_DISK_ERROR */
 	FATFS* fs			/* File system object */
 )
 {
-	DWORD wsect;
-	UINT nf;
 	FRESULT res = FR_OK;
 
 
 	if (fs->wflag) {	/* Write back the sector if it is dirty */
-		wsect = fs->winsect;	/* Current sector number */
-		if (disk_write(fs->drv, fs->win, wsect, 1) != RES_OK) {
-			res = FR_DISK_ERR;
-		} else {
-			fs->wflag = 0;
-			if (wsect - fs->fatbase < fs->fsize) {		/* Is it in the FAT area? */
-				for (nf = fs->n_fats; nf >= 2; nf--) {	/* Reflect the change to all FAT copies */
-					wsect += fs->fsize;
-					disk_write(fs->drv, fs->win, wsect, 1);
-				}
-			}
+		res = flush_sector(fs, fs->win, fs->winsect);
+		if (res == FR_OK) fs->wflag = 0;
+	}
+	return res;
+}
+
+
+static
+FRESULT sync_fat (	/* Returns FR_OK or FR_DISK_ERROR */
+	FATFS* fs		/* File system object */
+)
+{
+	FRESULT res = FR_OK;
+#if _FS_WINCACHE
+	UINT w;
+#endif
+
+
+	if (fs->winsect - fs->fatbase < fs->fsize) {	/* Write back FAT sectors only */
+		res = sync_window(fs);
+	}
+#if _FS_WINCACHE
+	for (w = 0; w < _FS_WINCACHE && res == FR_OK; w++) {
+		if (fs->wdirty[w] && fs->wsect[w] - fs->fatbase < fs->fsize) {
+			res = flush_sector(fs, fs->wbuf[w], fs->wsect[w]);
+			if (res == FR_OK) fs->wdirty[w] = 0;
+		}
+	}
+#endif
+	return res;
+}
+#endif
+
+
+#if _FS_WINCACHE
+/* With the window cache, a sector leaving fs->win[] is moved into the least
+/  recently used way of fs->wbuf[] and swapped back in when it is needed
+/  again. The window itself stays in place, so pointers into it are kept. */
+
+static
+void reset_ways (
+	FATFS* fs		/* File system object */
+)
+{
+	UINT w;
+
+
+	for (w = 0; w < _FS_WINCACHE; w++) {
+		fs->wsect[w] = 0xFFFFFFFF;
+		fs->wdirty[w] = 0;
+		fs->wuse[w] = 0;
+	}
+	fs->wclock = 0;
+	fs->wflag = 0; fs->winsect = 0xFFFFFFFF;
+}
+
+
+#if !_FS_READONLY
+static
+FRESULT sync_ways (	/* Returns FR_OK or FR_DISK_ERROR */
+	FATFS* fs		/* File system object */
+)
+{
+	UINT w;
+	FRESULT res;
+
+
+	res = sync_fat(fs);		/* FAT sectors first, so that no directory entry reaches the disk before its cluster chain */
+	if (res == FR_OK) res = sync_window(fs);
+	for (w = 0; w < _FS_WINCACHE && res == FR_OK; w++) {
+		if (fs->wdirty[w]) {
+			res = flush_sector(fs, fs->wbuf[w], fs->wsect[w]);
+			if (res == FR_OK) fs->wdirty[w] = 0;
 		}
 	}
 	return res;
 }
+
+
+static
+void discard_ways (
+	FATFS* fs,		/* File system object */
+	DWORD sect,		/* First sector of the area */
+	UINT n			/* Number of sectors */
+)
+{
+	UINT w;
+
+
+	if (fs->winsect - sect < n) {
+		fs->wflag = 0; fs->winsect = 0xFFFFFFFF;
+	}
+	for (w = 0; w < _FS_WINCACHE; w++) {
+		if (fs->wsect[w] - sect < n) {	/* A stale copy of a removed directory must never be written back */
+			fs->wsect[w] = 0xFFFFFFFF;
+			fs->wdirty[w] = 0;
+		}
+	}
+}
 #endif
+#endif	/* _FS_WINCACHE */
 
 
 static
@@ -915,9 +1036,46 @@ FRESULT move_window (	/* Returns FR_OK or FR_DISK_ERROR */
 )
 {
 	FRESULT res = FR_OK;
+#if _FS_WINCACHE
+	UINT w, i;
+	BYTE t;
+#endif
 
 
 	if (sector != fs->winsect) {	/* Window offset changed? */
+#if _FS_WINCACHE
+		for (w = 0; w < _FS_WINCACHE && fs->wsect[w] != sector; w++) ;	/* Is the sector in a way? */
+		if (w < _FS_WINCACHE) {		/* Swap it with the window */
+			for (i = 0; i < SS(fs); i++) {
+				t = fs->win[i]; fs->win[i] = fs->wbuf[w][i]; fs->wbuf[w][i] = t;
+			}
+			fs->wsect[w] = fs->winsect; fs->winsect = sector;
+			t = fs->wflag; fs->wflag = fs->wdirty[w]; fs->wdirty[w] = t;
+			fs->wuse[w] = ++fs->wclock;
+		} else {
+			if (fs->winsect != 0xFFFFFFFF) {	/* Move the window to the least recently used way */
+				for (w = 0, i = 1; i < _FS_WINCACHE; i++) {
+					if (fs->wuse[i] < fs->wuse[w]) w = i;
+				}
+#if !_FS_READONLY
+				if (fs->wdirty[w]) {	/* Write-back changes */
+					if (flush_sector(fs, fs->wbuf[w], fs->wsect[w]) != FR_OK) return FR_DISK_ERR;
+					fs->wdirty[w] = 0;
+				}
+#endif
+				mem_cpy(fs->wbuf[w], fs->win, SS(fs));
+				fs->wsect[w] = fs->winsect;
+				fs->wdirty[w] = fs->wflag;
+				fs->wuse[w] = ++fs->wclock;
+			}
+			fs->wflag = 0;
+			if (disk_read(fs->drv, fs->win, sector, 1) != RES_OK) {	/* Fill sector window with new data */
+				sector = 0xFFFFFFFF;	/* Invalidate window if data is not reliable */
+				res = FR_DISK_ERR;
+			}
+			fs->winsect = sector;
+		}
+#else
 #if !_FS_READONLY
 		res = sync_window(fs);		/* Write-back changes */
 #endif
@@ -928,6 +1086,7 @@ FRESULT move_window (	/* Returns FR_OK or FR_DISK_ERROR */
 			}
 			fs->winsect = sector;
 		}
+#endif
 	}
 	return res;
 }
@@ -948,10 +1107,17 @@ FRESULT sync_fs (	/* FR_OK:succeeded, !=0:error */
 	FRESULT res;
 
 
+#if _FS_WINCACHE
+	res = sync_ways(fs);
+#else
 	res = sync_window(fs);
+#endif
 	if (res == FR_OK) {
 		/* Update FSInfo sector if needed */
 		if (fs->fs_type == FS_FAT32 && fs->fsi_flag == 1) {
+#if _FS_WINCACHE
+			discard_ways(fs, fs->volbase + 1, 1);	/* The window is about to take over the FSInfo sector */
+#endif
 			/* Create FSInfo structure */
 			mem_set(fs->win, 0, SS(fs));
 			st_word(fs->win + BS_55AA, 0xAA55);
@@ -1124,6 +1290,12 @@ FRESULT put_fat (	/* FR_OK(0):succeeded, !=0:error */
 			fs->wflag = 1;
 			break;
 		}
+#if _USE_FREEMAP
+		if (res == FR_OK && fs->fmap_shift && (val & 0x0FFFFFFF) == 0) {	/* Freed cluster: its block has a free cluster again */
+			bc = (UINT)FMAP_BLK(fs, clst);
+			fs->fmap[bc / 8] |= (BYTE)(1 << (bc % 8));
+		}
+#endif
 	}
 	return res;
 }
@@ -1263,6 +1435,109 @@ FRESULT fill_last_frag (
 
 
 
+#if _USE_FREEMAP
+/*-----------------------------------------------------------------------*/
+/* FAT handling - Free cluster map                                       */
+/*-----------------------------------------------------------------------*/
+/* Each bit of fs->fmap[] covers a block of 1 << fs->fmap_shift FAT entries.
+/  A cleared bit means the block is known to be full, so allocation skips it
+/  without reading the FAT. A bit is set when a cluster in the block is freed
+/  and cleared when a scan finds no free cluster in the whole block. */
+
+/*-------------------------------------------*/
+/* Build the map and count free clusters     */
+/*-------------------------------------------*/
+
+static
+FRESULT build_fmap (	/* FR_OK(0):succeeded, !=0:error */
+	FATFS* fs,		/* File system object */
+	BYTE fmt		/* FAT sub-type of the volume being mounted */
+)
+{
+	DWORD clst, sect, nfree, val;
+	UINT i, sh, esz;
+	BYTE *p;
+	FRESULT res;
+
+
+	fs->fmap_shift = 0;
+	if (fmt != FS_FAT16 && fmt != FS_FAT32) return FR_OK;	/* FAT12 entries are not sector aligned */
+
+	esz = (fmt == FS_FAT16) ? 2 : 4;	/* Size of an FAT entry */
+	for (sh = 0; (1U << sh) < SS(fs) / esz; sh++) ;	/* One FAT sector per bit... */
+	while ((fs->n_fatent - 1) >> sh >= (DWORD)_USE_FREEMAP * 8) sh++;	/* ...or more if the FAT does not fit */
+	mem_set(fs->fmap, 0, _USE_FREEMAP);
+
+	nfree = 0; clst = 0; sect = fs->fatbase;
+	i = 0; p = 0;
+	do {
+		if (i == 0) {
+			res = move_window(fs, sect++);
+			if (res != FR_OK) return res;
+			p = fs->win;
+			i = SS(fs);
+		}
+		val = (fmt == FS_FAT16) ? ld_word(p) : ld_dword(p) & 0x0FFFFFFF;
+		if (val == 0 && clst >= 2) {
+			nfree++;
+			fs->fmap[(clst >> sh) / 8] |= (BYTE)(1 << ((clst >> sh) % 8));
+		}
+		p += esz; i -= esz;
+	} while (++clst < fs->n_fatent);
+
+	fs->fmap_shift = (BYTE)sh;
+	if (fs->free_clst != nfree) {	/* The scan gives the exact free cluster count */
+		fs->free_clst = nfree;
+		fs->fsi_flag |= 1;
+	}
+	return FR_OK;
+}
+
+
+/*-------------------------------------------*/
+/* Find a free cluster                       */
+/*-------------------------------------------*/
+
+static
+DWORD find_fmap (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:Disk error, >=2:Free cluster# */
+	_FDID* obj,		/* Object whose FAT is searched */
+	DWORD scl		/* Search from the cluster after this one, and wrap around to it */
+)
+{
+	FATFS *fs = obj->fs;
+	DWORD ncl, ecl, bcl, blk;
+	UINT pass, whole;
+
+
+	for (pass = 0; pass < 2; pass++) {
+		ncl = pass ? 2 : scl + 1;					/* scl+1..n_fatent-1, then 2..scl */
+		ecl = pass ? scl + 1 : fs->n_fatent;
+		while (ncl < ecl) {
+			blk = FMAP_BLK(fs, ncl);
+			bcl = FMAP_CLST(fs, blk + 1);			/* End of the block */
+			if (FMAP_TEST(fs, blk)) {
+				whole = (ncl == FMAP_CLST(fs, blk) && (bcl <= ecl || ecl == fs->n_fatent));	/* Will the whole block be scanned? */
+				if (bcl > ecl) bcl = ecl;
+				for ( ; ncl < bcl; ncl++) {
+					switch (get_fat(obj, ncl)) {
+					case 0 :			return ncl;		/* Found a free cluster */
+					case 1 :			return 1;
+					case 0xFFFFFFFF :	return 0xFFFFFFFF;
+					}
+				}
+				if (whole) fs->fmap[blk / 8] &= (BYTE)~(1 << (blk % 8));	/* The block is full */
+			}
+			ncl = bcl;
+		}
+	}
+	return 0;
+}
+
+#endif /* _USE_FREEMAP */
+
+
+
+
 #if !_FS_READONLY
 /*-----------------------------------------------------------------------*/
 /* FAT handling - Remove a cluster chain                                 */
@@ -1302,6 +1577,9 @@ FRESULT remove_chain (	/* FR_OK(0):succeeded, !=0:error */
 			res = put_fat(fs, clst, 0);		/* Mark the cluster 'free' on the FAT */
 			if (res != FR_OK) return res;
 		}
+#if _FS_WINCACHE
+		discard_ways(fs, clust2sect(fs, clst), fs->csize);	/* Drop cached sectors of the freed cluster */
+#endif
 		if (fs->free_clst < fs->n_fatent - 2) {	/* Update FSINFO */
 			fs->free_clst++;
 			fs->fsi_flag |= 1;
@@ -1397,17 +1675,25 @@ DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:Disk err
 	} else
 #endif
 	{	/* On the FAT12/16/32 volume */
-		ncl = scl;	/* Start cluster */
-		for (;;) {
-			ncl++;							/* Next cluster */
-			if (ncl >= fs->n_fatent) {		/* Check wrap-around */
-				ncl = 2;
-				if (ncl > scl) return 0;	/* No free cluster */
+#if _USE_FREEMAP
+		if (fs->fmap_shift) {
+			ncl = find_fmap(obj, scl);				/* Find a free cluster with the map */
+			if (ncl < 2 || ncl == 0xFFFFFFFF) return ncl;	/* No free cluster or an error occurred */
+		} else
+#endif
+		{
+			ncl = scl;	/* Start cluster */
+			for (;;) {
+				ncl++;							/* Next cluster */
+				if (ncl >= fs->n_fatent) {		/* Check wrap-around */
+					ncl = 2;
+					if (ncl > scl) return 0;	/* No free cluster */
+				}
+				cs = get_fat(obj, ncl);			/* Get the cluster status */
+				if (cs == 0) break;				/* Found a free cluster */
+				if (cs == 1 || cs == 0xFFFFFFFF) return cs;	/* An error occurred */
+				if (ncl == scl) return 0;		/* No free cluster */
 			}
-			cs = get_fat(obj, ncl);			/* Get the cluster status */
-			if (cs == 0) break;				/* Found a free cluster */
-			if (cs == 1 || cs == 0xFFFFFFFF) return cs;	/* An error occurred */
-			if (ncl == scl) return 0;		/* No free cluster */
 		}
 		res = put_fat(fs, ncl, 0xFFFFFFFF);	/* Mark the new cluster 'EOC' */
 		if (res == FR_OK && clst != 0) {
@@ -2967,7 +3253,11 @@ BYTE check_fs (	/* 0:FAT, 1:exFAT, 2:Valid BS but not FAT, 3:Not a BS, 4:Disk er
 	DWORD sect	/* Sector# (lba) to load and check if it is an FAT-VBR or not */
 )
 {
+#if _FS_WINCACHE
+	reset_ways(fs);									/* Invalidate window and ways */
+#else
 	fs->wflag = 0; fs->winsect = 0xFFFFFFFF;		/* Invaidate window */
+#endif
 	if (move_window(fs, sect) != FR_OK) return 4;	/* Load boot record */
 
 	if (ld_word(fs->win + BS_55AA) != 0xAA55) return 3;	/* Check boot record signature (always placed here even if the sector size is >512) */
@@ -3185,6 +3475,9 @@ FRESULT find_volume (	/* FR_OK(0): successful, !=0: any error occurred */
 			}
 		}
 #endif	/* (_FS_NOFSINFO & 3) != 3 */
+#if _USE_FREEMAP
+		if (build_fmap(fs, fmt) != FR_OK) return FR_DISK_ERR;	/* Scan the FAT for free clusters */
+#endif
 #endif	/* !_FS_READONLY */
 	}
 
@@ -3224,7 +3517,8 @@ FRESULT validate (	/* Returns FR_OK or FR_INVALID_OBJECT */
 	if (obj && obj->fs && obj->fs->fs_type && obj->id == obj->fs->id) {	/* Test if the object is valid */
 #if _FS_REENTRANT
 		if (lock_fs(obj->fs)) {	/* Obtain the filesystem object */
-			if (!(disk_status(obj->fs->drv) & STA_NOINIT)) { /* Test if the phsical drive is kept initialized */
+			if (obj->fs->fs_type && obj->id == obj->fs->id &&	/* Test again, the volume may have been unmounted while waiting */
+				!(disk_status(obj->fs->drv) & STA_NOINIT)) { /* Test if the phsical drive is kept initialized */
 				res = FR_OK;
 			} else {
 				unlock_fs(obj->fs, FR_OK);
@@ -3275,13 +3569,17 @@ FRESULT f_mount (
 	cfs = FatFs[vol];					/* Pointer to fs object */
 
 	if (cfs) {
+#if _FS_REENTRANT						/* Wait for the operation in progress on the volume */
+		if (!lock_fs(cfs)) return FR_TIMEOUT;
+#endif
 #if _FS_LOCK != 0
 		clear_lock(cfs);
 #endif
+		cfs->fs_type = 0;				/* Clear old fs object */
 #if _FS_REENTRANT						/* Discard sync object of the current volume */
+		unlock_fs(cfs, FR_OK);
 		if (!ff_del_syncobj(cfs->sobj)) return FR_INT_ERR;
 #endif
-		cfs->fs_type = 0;				/* Clear old fs object */
 	}
 
 	if (fs) {
@@ -3697,10 +3995,12 @@ FRESULT f_write (
 				fs->winsect = sect;
 			}
 #else
-			if (fp->sect != sect && 		/* Fill sector cache with file data */
-				fp->fptr < fp->obj.objsize &&
-				disk_read(fs->drv, fp->buf, sect, 1) != RES_OK) {
-					ABORT(fs, FR_DISK_ERR);
+			if (fp->sect != sect) {
+				if (fp->fptr < fp->obj.objsize) {	/* Fill sector cache with file data */
+					if (disk_read(fs->drv, fp->buf, sect, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);
+				} else {						/* On the growing edge, pad with zeros rather than the previous sector */
+					mem_set(fp->buf, 0, SS(fs));
+				}
 			}
 #endif
 			fp->sect = sect;
@@ -3801,6 +4101,52 @@ FRESULT f_sync (
 	LEAVE_FF(fs, res);
 }
 
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Synchronize the File Data                                             */
+/*-----------------------------------------------------------------------*/
+/* Like f_sync() but the directory entry (size, time) is left as it is
+/  until the next f_sync() or f_close(). Only the file data and the FAT
+/  reach the disk, so data written past the recorded size survives a power
+/  loss and can be taken back into the file with f_recover(). */
+
+FRESULT f_datasync (
+	FIL* fp		/* Pointer to the file object */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+
+
+	res = validate(&fp->obj, &fs);	/* Check validity of the file object */
+	if (res == FR_OK) {
+		if (_FS_EXFAT && fs->fs_type == FS_EXFAT) LEAVE_FF(fs, FR_DENIED);	/* The chain may not be on the FAT */
+		if (fp->flag & FA_MODIFIED) {	/* Is there any change to the file? */
+#if !_FS_TINY
+			if (fp->flag & FA_DIRTY) {	/* Write-back cached data if needed */
+				if (disk_write(fs->drv, fp->buf, fp->sect, 1) != RES_OK) LEAVE_FF(fs, FR_DISK_ERR);
+				fp->flag &= (BYTE)~FA_DIRTY;
+			}
+#endif
+			res = move_window(fs, fp->dir_sect);
+			if (res == FR_OK) {
+				if (ld_clust(fs, fp->dir_ptr) != fp->obj.sclust) {	/* The entry has to lead to the data even with an old size */
+					st_clust(fs, fp->dir_ptr, fp->obj.sclust);
+					fs->wflag = 1;
+					res = sync_fs(fs);
+				} else {
+					res = sync_fat(fs);			/* Flush the cluster chain, not the directory */
+					if (res == FR_OK && disk_ioctl(fs->drv, CTRL_SYNC, 0) != RES_OK) res = FR_DISK_ERR;
+				}
+			}
+		}
+	}
+
+	LEAVE_FF(fs, res);
+}
+
 #endif /* !_FS_READONLY */
 
 
@@ -4485,9 +4831,9 @@ FRESULT f_truncate (
 	if (res != FR_OK || (res = (FRESULT)fp->err) != FR_OK) LEAVE_FF(fs, res);
 	if (!(fp->flag & FA_WRITE)) LEAVE_FF(fs, FR_DENIED);	/* Check access mode */
 
-	if (fp->fptr < fp->obj.objsize) {	/* Process when fptr is not on the eof */
+	if (fp->fptr <= fp->obj.objsize) {	/* Process when fptr is not beyond the eof (at the eof, clusters preallocated by f_expand are released) */
 		if (fp->fptr == 0) {	/* When set file size to zero, remove entire cluster chain */
-			res = remove_chain(&fp->obj, fp->obj.sclust, 0);
+			if (fp->obj.sclust) res = remove_chain(&fp->obj, fp->obj.sclust, 0);
 			fp->obj.sclust = 0;
 		} else {				/* When truncate a part of the file, remove remaining clusters */
 			ncl = get_fat(&fp->obj, fp->clust);
@@ -5139,24 +5485,50 @@ FRESULT f_setlabel (
 
 FRESULT f_expand (
 	FIL* fp,		/* Pointer to the file object */
-	FSIZE_t fsz,	/* File size to be expanded to */
-	BYTE opt		/* Operation mode 0:Find and prepare or 1:Find and allocate */
+	FSIZE_t fsz,	/* File size to be expanded to, or with opt 2, bytes to append to the allocation */
+	BYTE opt		/* Operation mode 0:Find and prepare, 1:Find and allocate or 2:Allocate after the chain, keeping the file size */
 )
 {
 	FRESULT res;
 	FATFS *fs;
-	DWORD n, clst, stcl, scl, ncl, tcl, lclst;
+	DWORD n, clst, stcl, scl, ncl, tcl, lclst, ecl;
+#if _USE_TRIM
+	DWORD rt[2];
+#endif
 
 
 	res = validate(&fp->obj, &fs);		/* Check validity of the file object */
 	if (res != FR_OK || (res = (FRESULT)fp->err) != FR_OK) LEAVE_FF(fs, res);
-	if (fsz == 0 || fp->obj.objsize != 0 || !(fp->flag & FA_WRITE)) LEAVE_FF(fs, FR_DENIED);
+	if (fsz == 0 || (fp->obj.objsize != 0 && opt != 2) || !(fp->flag & FA_WRITE)) LEAVE_FF(fs, FR_DENIED);
 #if _FS_EXFAT
+	if (fs->fs_type == FS_EXFAT && opt == 2) LEAVE_FF(fs, FR_DENIED);	/* Preallocation is FAT only */
 	if (fs->fs_type != FS_EXFAT && fsz >= 0x100000000) LEAVE_FF(fs, FR_DENIED);	/* Check if in size limit */
 #endif
 	n = (DWORD)fs->csize * SS(fs);	/* Cluster size */
 	tcl = (DWORD)(fsz / n) + ((fsz & (n - 1)) ? 1 : 0);	/* Number of clusters required */
-	stcl = fs->last_clst; lclst = 0;
+	stcl = fs->last_clst; lclst = 0; ecl = 0;
+	if (opt == 2 && fp->obj.sclust != 0) {	/* Find the last cluster of the chain to continue it */
+#if _USE_FASTSEEK
+		if (fp->cltbl) {					/* The link map has the last fragment */
+			DWORD *tbl = fp->cltbl + 1;
+			while (tbl[0]) {
+				ecl = tbl[1] + tbl[0] - 1; tbl += 2;
+			}
+		} else
+#endif
+		{
+			clst = fp->obj.sclust;
+			for (;;) {
+				n = get_fat(&fp->obj, clst);
+				if (n == 1) { res = FR_INT_ERR; break; }
+				if (n == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }
+				if (n >= fs->n_fatent) { ecl = clst; break; }
+				clst = n;
+			}
+			if (res != FR_OK) LEAVE_FF(fs, res);
+		}
+		stcl = ecl + 1;						/* Right behind it if possible */
+	}
 	if (stcl < 2 || stcl >= fs->n_fatent) stcl = 2;
 
 #if _FS_EXFAT
@@ -5177,6 +5549,16 @@ FRESULT f_expand (
 	{
 		scl = clst = stcl; ncl = 0;
 		for (;;) {	/* Find a contiguous cluster block */
+#if _USE_FREEMAP
+			if (fs->fmap_shift && !FMAP_TEST(fs, FMAP_BLK(fs, clst))) {	/* Skip a block known to be full */
+				n = FMAP_CLST(fs, FMAP_BLK(fs, clst) + 1);
+				if (clst < stcl && n >= stcl) { res = FR_DENIED; break; }	/* Searched all around? */
+				clst = (n >= fs->n_fatent) ? 2 : n;
+				scl = clst; ncl = 0;
+				if (clst == stcl) { res = FR_DENIED; break; }
+				continue;
+			}
+#endif
 			n = get_fat(&fp->obj, clst);
 			if (++clst >= fs->n_fatent) clst = 2;
 			if (n == 1) { res = FR_INT_ERR; break; }
@@ -5190,11 +5572,21 @@ FRESULT f_expand (
 		}
 		if (res == FR_OK) {	/* A contiguous free area is found */
 			if (opt) {		/* Allocate it now */
-				for (clst = scl, n = tcl; n; clst++, n--) {	/* Create a cluster chain on the FAT */
+#if _USE_TRIM
+				if (opt == 2) {	/* f_recover() needs the appended clusters to read back erased */
+					rt[0] = clust2sect(fs, scl);
+					rt[1] = rt[0] + tcl * fs->csize - 1;
+					if (disk_ioctl(fs->drv, CTRL_TRIM, rt) != RES_OK) res = FR_DENIED;
+				}
+#endif
+				for (clst = scl, n = tcl; n && res == FR_OK; clst++, n--) {	/* Create a cluster chain on the FAT */
 					res = put_fat(fs, clst, (n == 1) ? 0xFFFFFFFF : clst + 1);
 					if (res != FR_OK) break;
 					lclst = clst;
 				}
+				if (res == FR_OK && ecl != 0) {	/* Link it to the end of the file's chain */
+					res = put_fat(fs, ecl, scl);
+				}
 			} else {		/* Set it as suggested point for next allocation */
 				lclst = scl - 1;
 			}
@@ -5204,20 +5596,116 @@ FRESULT f_expand (
 	if (res == FR_OK) {
 		fs->last_clst = lclst;		/* Set suggested start cluster to start next */
 		if (opt) {	/* Is it allocated now? */
-			fp->obj.sclust = scl;		/* Update object allocation information */
-			fp->obj.objsize = fsz;
-			if (_FS_EXFAT) fp->obj.stat = 2;	/* Set status 'contiguous chain' */
+			if (opt == 1 || fp->obj.sclust == 0) {
+				fp->obj.sclust = scl;	/* Update object allocation information */
+			}
+			if (opt == 1) {
+				fp->obj.objsize = fsz;
+				if (_FS_EXFAT) fp->obj.stat = 2;	/* Set status 'contiguous chain' */
+			}
 			fp->flag |= FA_MODIFIED;
 			if (fs->free_clst <= fs->n_fatent - 2) {	/* Update FSINFO */
 				fs->free_clst -= tcl;
 				fs->fsi_flag |= 1;
 			}
+#if _USE_TRIM
+			if (opt == 1) {	/* Discard the old content, so the new clusters read back as erased */
+				rt[0] = clust2sect(fs, scl);
+				rt[1] = rt[0] + tcl * fs->csize - 1;
+				disk_ioctl(fs->drv, CTRL_TRIM, rt);
+			}
+#endif
 		}
 	}
 
 	LEAVE_FF(fs, res);
 }
 
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Recover Data Written Past the File Size                               */
+/*-----------------------------------------------------------------------*/
+/* For a file that only grows by appending with f_datasync(), into clusters
+/  allocated with f_expand() opt 2. Data written after the last f_sync()
+/  lies past the recorded size, followed by the zero padding of its last
+/  sector and then erased clusters. This scans the allocated clusters from
+/  the file size up to the first byte of 0x00 or 0xFF and takes that as the
+/  new file size, so the file data must not contain those bytes. Clusters
+/  that were not erased for the file read back as data too, so the caller
+/  has to know the file was written this way and should check what was
+/  recovered. The file pointer is not moved, and the directory entry is
+/  updated on the next f_sync() or f_close(). */
+
+FRESULT f_recover (
+	FIL* fp,		/* Pointer to the file object */
+	FSIZE_t* nrec	/* Pointer to return the number of bytes recovered */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DWORD clst, sect, bcs;
+	FSIZE_t ofs;
+	UINT i;
+	BYTE *buf;
+
+
+	*nrec = 0;
+	res = validate(&fp->obj, &fs);		/* Check validity of the file object */
+	if (res != FR_OK || (res = (FRESULT)fp->err) != FR_OK) LEAVE_FF(fs, res);
+	if (!(fp->flag & FA_WRITE) || (_FS_EXFAT && fs->fs_type == FS_EXFAT)) LEAVE_FF(fs, FR_DENIED);
+	if (fp->obj.sclust == 0) LEAVE_FF(fs, FR_OK);	/* No cluster, nothing to recover */
+#if !_FS_TINY
+	if (fp->flag & FA_DIRTY) {			/* Write-back cached data, fp->buf is used for the scan */
+		if (disk_write(fs->drv, fp->buf, fp->sect, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);
+		fp->flag &= (BYTE)~FA_DIRTY;
+	}
+#endif
+
+	/* Find the cluster holding the end of file */
+	bcs = (DWORD)fs->csize * SS(fs);	/* Cluster size */
+	ofs = fp->obj.objsize;
+	clst = fp->obj.sclust;
+	for (i = (UINT)(ofs / bcs); i && clst < fs->n_fatent; i--) {
+		clst = get_fat(&fp->obj, clst);
+		if (clst == 0xFFFFFFFF) ABORT(fs, FR_DISK_ERR);
+		if (clst <= 1) ABORT(fs, FR_INT_ERR);
+	}
+
+	/* Scan forward to the first erased byte or the end of the chain */
+	while (clst < fs->n_fatent) {
+		sect = clust2sect(fs, clst);
+		if (sect == 0) ABORT(fs, FR_INT_ERR);
+		sect += (DWORD)(ofs / SS(fs)) & (fs->csize - 1);
+#if _FS_TINY
+		if (move_window(fs, sect) != FR_OK) ABORT(fs, FR_DISK_ERR);
+		buf = fs->win;
+#else
+		if (disk_read(fs->drv, fp->buf, sect, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);
+		buf = fp->buf;
+#endif
+		for (i = (UINT)(ofs % SS(fs)); i < SS(fs) && buf[i] != 0x00 && buf[i] != 0xFF; i++) ofs++;
+		if (i < SS(fs)) break;			/* Found the end of data */
+		if (ofs % bcs == 0) {			/* Next cluster */
+			clst = get_fat(&fp->obj, clst);
+			if (clst == 0xFFFFFFFF) ABORT(fs, FR_DISK_ERR);
+			if (clst <= 1) ABORT(fs, FR_INT_ERR);
+		}
+	}
+
+#if !_FS_TINY
+	if (fp->sect != 0 && disk_read(fs->drv, fp->buf, fp->sect, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);	/* Restore sector cache */
+#endif
+	if (ofs > fp->obj.objsize) {
+		*nrec = ofs - fp->obj.objsize;
+		fp->obj.objsize = ofs;
+		fp->flag |= FA_MODIFIED;
+	}
+
+	LEAVE_FF(fs, FR_OK);
+}
+
 #endif /* _USE_EXPAND && !_FS_READONLY */
 
 
@@ -106,6 +106,10 @@ typedef struct {
 #if !_FS_READONLY
 	DWORD	last_clst;		/* Last allocated cluster */
 	DWORD	free_clst;		/* Number of free clusters */
+#if _USE_FREEMAP
+	BYTE	fmap_shift;		/* log2 of FAT entries per fmap[] bit (0:map not in use) */
+	BYTE	fmap[_USE_FREEMAP];	/* Free cluster map (1:block may have a free cluster, 0:block is full) */
+#endif
 #endif
 #if _FS_RPATH != 0
 	DWORD	cdir;			/* Current directory start cluster (0:root) */
@@ -122,6 +126,13 @@ typedef struct {
 	DWORD	dirbase;		/* Root directory base sector/cluster */
 	DWORD	database;		/* Data base sector */
 	DWORD	winsect;		/* Current sector appearing in the win[] */
+#if _FS_WINCACHE
+	DWORD	wsect[_FS_WINCACHE];	/* Sector held by each way (0xFFFFFFFF:empty) */
+	DWORD	wuse[_FS_WINCACHE];		/* Last use of each way for LRU replacement */
+	DWORD	wclock;			/* Way use counter */
+	BYTE	wdirty[_FS_WINCACHE];	/* Dirty flag of each way */
+	BYTE	wbuf[_FS_WINCACHE][_MAX_SS];	/* Sectors recently moved out of the window */
+#endif
 	BYTE	win[_MAX_SS];	/* Disk access window for Directory, FAT (and file data at tiny cfg) */
 } FATFS;
 
@@ -246,6 +257,7 @@ FRESULT f_write (FIL* fp, const void* buff, UINT btw, UINT* bw);	/* Write data t
 FRESULT f_lseek (FIL* fp, FSIZE_t ofs);								/* Move file pointer of the file object */
 FRESULT f_truncate (FIL* fp);										/* Truncate the file */
 FRESULT f_sync (FIL* fp);											/* Flush cached data of the writing file */
+FRESULT f_datasync (FIL* fp);										/* Flush cached data of the writing file, leaving its directory entry */
 FRESULT f_opendir (DIR* dp, const TCHAR* path);						/* Open a directory */
 FRESULT f_closedir (DIR* dp);										/* Close an open directory */
 FRESULT f_readdir (DIR* dp, FILINFO* fno);							/* Read a directory item */
@@ -265,6 +277,7 @@ FRESULT f_getlabel (const TCHAR* path, TCHAR* label, DWORD* vsn);	/* Get volume
 FRESULT f_setlabel (const TCHAR* label);							/* Set volume label */
 FRESULT f_forward (FIL* fp, UINT(*func)(const BYTE*,UINT), UINT btf, UINT* bf);	/* Forward data to the stream */
 FRESULT f_expand (FIL* fp, FSIZE_t szf, BYTE opt);					/* Allocate a contiguous block to the file */
+FRESULT f_recover (FIL* fp, FSIZE_t* nrec);							/* Take data written past the file size back into the file */
 FRESULT f_mount (FATFS* fs, const TCHAR* path, BYTE opt);			/* Mount/Unmount a logical drive */
 FRESULT f_mkfs (const TCHAR* path, BYTE opt, DWORD au, void* work, UINT len);	/* Create a FAT volume */
 FRESULT f_fdisk (BYTE pdrv, const DWORD* szt, void* work);			/* Divide a physical drive into some partitions */
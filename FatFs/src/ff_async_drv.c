@@ -0,0 +1,276 @@
+/**
+  ******************************************************************************
+  * @file    ff_async_drv.c
+  * @brief   Asynchronous block I/O: one task owns the disk driver and
+  *          services requests queued by other tasks.
+  ******************************************************************************
+  * @attention
+  *
+  * ASYNC_Init() starts the I/O task in front of a diskio driver. From then
+  * on only the I/O task calls that driver, so it alone drives SPI1 and
+  * waits out the card.
+  *
+  * Two ways in:
+  *  - ASYNC_Driver is a Diskio_drvTypeDef whose functions submit a request
+  *    and block until it completes, so FatFs (directly or through the
+  *    sector cache) keeps its synchronous view of the disk.
+  *  - ASYNC_Submit()/ASYNC_Wait() queue raw sector requests and return at
+  *    once; the submitter prepares its next buffer while the I/O task
+  *    writes the current one, and learns of completion through a task
+  *    notification, a callback, or by polling req->done. These requests
+  *    bypass any layer above ASYNC_Driver, such as the sector cache.
+  *
+  * Requests are serviced in submission order.
+  *
+  ******************************************************************************
+**/
+/* Includes ------------------------------------------------------------------*/
+#include "ff_async_drv.h"
+
+#include "queue.h"
+
+/* Private typedef -----------------------------------------------------------*/
+/* Private define ------------------------------------------------------------*/
+/* Private variables ---------------------------------------------------------*/
+static const Diskio_drvTypeDef *backend = 0;
+static QueueHandle_t xRequestQueue = NULL;
+static TaskHandle_t xIOTask = NULL;
+
+/* Private function prototypes -----------------------------------------------*/
+static portTASK_FUNCTION_PROTO(vAsyncIOTask, pvParameters);
+static DSTATUS ASYNC_initialize(BYTE lun);
+static DSTATUS ASYNC_status(BYTE lun);
+static DRESULT ASYNC_read(BYTE lun, BYTE *buff, DWORD sector, UINT count);
+#if _USE_WRITE == 1
+static DRESULT ASYNC_write(BYTE lun, const BYTE *buff, DWORD sector, UINT count);
+#endif /* _USE_WRITE == 1 */
+#if _USE_IOCTL == 1
+static DRESULT ASYNC_ioctl(BYTE lun, BYTE cmd, void *buff);
+#endif /* _USE_IOCTL == 1 */
+
+const Diskio_drvTypeDef ASYNC_Driver =
+{
+  ASYNC_initialize,
+  ASYNC_status,
+  ASYNC_read,
+#if _USE_WRITE == 1
+  ASYNC_write,
+#endif /* _USE_WRITE == 1 */
+#if _USE_IOCTL == 1
+  ASYNC_ioctl,
+#endif /* _USE_IOCTL == 1 */
+};
+
+/* Private functions ---------------------------------------------------------*/
+
+/**
+  * @brief  Runs one request against the backend
+  * @param  req: request
+  * @retval DRESULT: Operation result
+  */
+static DRESULT ASYNC_Execute(ASYNC_RequestTypeDef *req)
+{
+  switch (req->op)
+  {
+  case ASYNC_OP_INIT:
+    return (backend->disk_initialize(req->lun) & STA_NOINIT) ? RES_NOTRDY : RES_OK;
+
+  case ASYNC_OP_READ:
+    return backend->disk_read(req->lun, req->buff, req->sector, req->count);
+
+#if _USE_WRITE == 1
+  case ASYNC_OP_WRITE:
+    return backend->disk_write(req->lun, req->buff, req->sector, req->count);
+#endif /* _USE_WRITE == 1 */
+
+#if _USE_IOCTL == 1
+  case ASYNC_OP_IOCTL:
+    return backend->disk_ioctl(req->lun, req->cmd, req->buff);
+#endif /* _USE_IOCTL == 1 */
+
+  default:
+    return RES_PARERR;
+  }
+}
+
+/**
+  * @brief  Services the request queue
+  * @param  pvParameters: unused
+  * @retval None
+  */
+static portTASK_FUNCTION(vAsyncIOTask, pvParameters)
+{
+  ASYNC_RequestTypeDef *req;
+  TaskHandle_t notify;
+
+  (void)pvParameters;
+
+  for (;;)
+  {
+    if (xQueueReceive(xRequestQueue, &req, portMAX_DELAY) != pdPASS)
+    {
+      continue;
+    }
+    req->result = ASYNC_Execute(req);
+
+    /* The submitter may reuse the request as soon as done is set */
+    notify = req->notify;
+    if (req->complete != NULL)
+    {
+      req->complete(req);
+    }
+    req->done = 1;
+    if (notify != NULL)
+    {
+      xTaskNotifyGive(notify);
+    }
+  }
+}
+
+/**
+  * @brief  Runs a request on behalf of the ASYNC_Driver entry points and
+  *         blocks until it completes. Before the scheduler starts, and from
+  *         the I/O task itself (completion callbacks), the backend is called
+  *         directly instead.
+  * @param  req: request, on the caller's stack
+  * @retval DRESULT: Operation result
+  */
+static DRESULT ASYNC_Blocking(ASYNC_RequestTypeDef *req)
+{
+  if (xIOTask == NULL ||
+      xTaskGetSchedulerState() != taskSCHEDULER_RUNNING ||
+      xTaskGetCurrentTaskHandle() == xIOTask)
+  {
+    return ASYNC_Execute(req);
+  }
+
+  req->notify = xTaskGetCurrentTaskHandle();
+  req->complete = NULL;
+  if (ASYNC_Submit(req, portMAX_DELAY) != pdPASS)
+  {
+    return RES_ERROR;
+  }
+  return ASYNC_Wait(req, portMAX_DELAY);
+}
+
+static DSTATUS ASYNC_initialize(BYTE lun)
+{
+  ASYNC_RequestTypeDef req = {0};
+
+  req.op = ASYNC_OP_INIT;
+  req.lun = lun;
+  /* The status of the initialisation that ran, not a later flag read */
+  return (ASYNC_Blocking(&req) == RES_OK) ? 0 : STA_NOINIT;
+}
+
+static DSTATUS ASYNC_status(BYTE lun)
+{
+  /* Status is a flag read, no bus traffic */
+  return backend->disk_status(lun);
+}
+
+static DRESULT ASYNC_read(BYTE lun, BYTE *buff, DWORD sector, UINT count)
+{
+  ASYNC_RequestTypeDef req = {0};
+
+  req.op = ASYNC_OP_READ;
+  req.lun = lun;
+  req.buff = buff;
+  req.sector = sector;
+  req.count = count;
+  return ASYNC_Blocking(&req);
+}
+
+#if _USE_WRITE == 1
+static DRESULT ASYNC_write(BYTE lun, const BYTE *buff, DWORD sector, UINT count)
+{
+  ASYNC_RequestTypeDef req = {0};
+
+  req.op = ASYNC_OP_WRITE;
+  req.lun = lun;
+  req.buff = (BYTE *)buff;
+  req.sector = sector;
+  req.count = count;
+  return ASYNC_Blocking(&req);
+}
+#endif /* _USE_WRITE == 1 */
+
+#if _USE_IOCTL == 1
+static DRESULT ASYNC_ioctl(BYTE lun, BYTE cmd, void *buff)
+{
+  ASYNC_RequestTypeDef req = {0};
+
+  req.op = ASYNC_OP_IOCTL;
+  req.lun = lun;
+  req.cmd = cmd;
+  req.buff = buff;
+  return ASYNC_Blocking(&req);
+}
+#endif /* _USE_IOCTL == 1 */
+
+/**
+  * @brief  Creates the request queue and the I/O task in front of a driver
+  * @param  drv: pointer to the disk IO Driver the I/O task calls
+  * @param  uxPriority: priority of the I/O task
+  * @retval Returns 0 in case of success, otherwise 1.
+  */
+uint8_t ASYNC_Init(const Diskio_drvTypeDef *drv, UBaseType_t uxPriority)
+{
+  backend = drv;
+  if (xRequestQueue == NULL)
+  {
+    xRequestQueue = xQueueCreate(ASYNC_QUEUE_LENGTH, sizeof(ASYNC_RequestTypeDef *));
+    if (xRequestQueue == NULL)
+    {
+      return 1;
+    }
+  }
+  if (xIOTask == NULL &&
+      xTaskCreate(vAsyncIOTask, "DiskIO", ASYNC_STACK_SIZE, NULL,
+                  uxPriority, &xIOTask) != pdPASS)
+  {
+    xIOTask = NULL;
+    return 1;
+  }
+  return 0;
+}
+
+/**
+  * @brief  Queues a request for the I/O task
+  * @param  req: request; op, lun, buff, sector, count (or cmd), notify and
+  *         complete must be filled in
+  * @param  xTicksToWait: how long to wait for room in the queue
+  * @retval pdPASS if queued, errQUEUE_FULL otherwise
+  */
+BaseType_t ASYNC_Submit(ASYNC_RequestTypeDef *req, TickType_t xTicksToWait)
+{
+  req->done = 0;
+  req->result = RES_NOTRDY;
+  return xQueueSend(xRequestQueue, &req, xTicksToWait);
+}
+
+/**
+  * @brief  Waits for a request submitted with notify set to the calling task
+  * @note   Waiting is driven by req->done; notifications only wake the task,
+  *         so completions of other requests in between do no harm.
+  * @param  req: request
+  * @param  xTicksToWait: how long to wait for completion
+  * @retval DRESULT: result of the request, RES_NOTRDY if it is still pending
+  */
+DRESULT ASYNC_Wait(ASYNC_RequestTypeDef *req, TickType_t xTicksToWait)
+{
+  TickType_t xStart = xTaskGetTickCount();
+
+  while (!req->done)
+  {
+    TickType_t xElapsed = xTaskGetTickCount() - xStart;
+
+    if (xTicksToWait != portMAX_DELAY && xElapsed >= xTicksToWait)
+    {
+      return RES_NOTRDY;
+    }
+    ulTaskNotifyTake(pdFALSE, (xTicksToWait == portMAX_DELAY) ?
+                     portMAX_DELAY : xTicksToWait - xElapsed);
+  }
+  return req->result;
+}
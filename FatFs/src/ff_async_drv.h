@@ -0,0 +1,78 @@
+/**
+  ******************************************************************************
+  * @file    ff_async_drv.h
+  * @brief   Header for ff_async_drv.c module.
+  ******************************************************************************
+**/
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __FF_ASYNC_DRV_H
+#define __FF_ASYNC_DRV_H
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include "ff_gen_drv.h"
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+/* Exported constants --------------------------------------------------------*/
+
+/**
+  * @brief  Requests the I/O task can have queued
+  */
+#ifndef ASYNC_QUEUE_LENGTH
+#define ASYNC_QUEUE_LENGTH 8
+#endif
+
+/**
+  * @brief  Stack of the I/O task, in words
+  */
+#ifndef ASYNC_STACK_SIZE
+#define ASYNC_STACK_SIZE ((unsigned short) 512)
+#endif
+
+#define ASYNC_OP_INIT   0
+#define ASYNC_OP_READ   1
+#define ASYNC_OP_WRITE  2
+#define ASYNC_OP_IOCTL  3
+
+/* Exported types ------------------------------------------------------------*/
+
+/**
+  * @brief  Block I/O request. The request and its buffer belong to the I/O
+  *         task from ASYNC_Submit() until the request is done.
+  */
+typedef struct ASYNC_Request
+{
+  uint8_t          op;        /*!< ASYNC_OP_xxx                                */
+  BYTE             lun;       /*!< Logical unit passed through to the backend  */
+  BYTE             cmd;       /*!< Control code for ASYNC_OP_IOCTL             */
+  BYTE            *buff;      /*!< Data, or ioctl argument                     */
+  DWORD            sector;    /*!< Sector address (LBA)                        */
+  UINT             count;     /*!< Number of sectors                           */
+  TaskHandle_t     notify;    /*!< Task notified on completion, or NULL        */
+  void           (*complete)(struct ASYNC_Request *req); /*!< Called by the I/O
+                                   task on completion, or NULL                 */
+  void            *context;   /*!< Free for the submitter                      */
+  volatile DRESULT result;    /*!< Result, valid once done is set              */
+  volatile uint8_t done;      /*!< Set by the I/O task when finished           */
+
+}ASYNC_RequestTypeDef;
+
+/* Exported variables --------------------------------------------------------*/
+extern const Diskio_drvTypeDef ASYNC_Driver;
+
+/* Exported functions ------------------------------------------------------- */
+uint8_t ASYNC_Init(const Diskio_drvTypeDef *drv, UBaseType_t uxPriority);
+BaseType_t ASYNC_Submit(ASYNC_RequestTypeDef *req, TickType_t xTicksToWait);
+DRESULT ASYNC_Wait(ASYNC_RequestTypeDef *req, TickType_t xTicksToWait);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __FF_ASYNC_DRV_H */
@@ -0,0 +1,380 @@
+/**
+  ******************************************************************************
+  * @file    ff_cache_drv.c
+  * @brief   Write-back LRU sector cache layered over another diskio driver.
+  ******************************************************************************
+  * @attention
+  *
+  * The cache is itself a Diskio_drvTypeDef. CACHE_LinkDriver() records the
+  * driver it sits on and links the cache with FATFS_LinkDriver(), so FatFs
+  * only ever talks to the cache.
+  *
+  * Single sector writes (FAT, directory and partial data sectors) are kept
+  * dirty in the cache until CTRL_SYNC or until their line is evicted. Dirty
+  * lines are then written back in sector order, with runs of consecutive
+  * sectors coalesced into one multi-sector write. Multi-sector transfers
+  * (the direct paths of f_read/f_write) bypass the cache so that bulk data
+  * does not flush out the hot metadata sectors.
+  *
+  ******************************************************************************
+**/
+/* Includes ------------------------------------------------------------------*/
+#include "ff_cache_drv.h"
+
+#include <string.h>
+
+/* Private typedef -----------------------------------------------------------*/
+typedef struct
+{
+  DWORD    sector;
+  uint32_t stamp;                 /* Last access, for LRU */
+  uint8_t  valid;
+  uint8_t  dirty;
+  uint32_t data[_MAX_SS / 4];     /* Word aligned for the backend (DMA) */
+
+}CACHE_LineTypeDef;
+
+/* Private define ------------------------------------------------------------*/
+/* Private variables ---------------------------------------------------------*/
+static const Diskio_drvTypeDef *backend = 0;
+static BYTE pdrv = 0;                  /* Drive the cache is linked as */
+static CACHE_LineTypeDef lines[CACHE_SECTORS];
+static uint32_t tick = 0;
+static CACHE_StatsTypeDef stats = {0};
+extern Disk_drvTypeDef disk;
+
+/* Private function prototypes -----------------------------------------------*/
+static DSTATUS CACHE_initialize(BYTE lun);
+static DSTATUS CACHE_status(BYTE lun);
+static DRESULT CACHE_read(BYTE lun, BYTE *buff, DWORD sector, UINT count);
+#if _USE_WRITE == 1
+static DRESULT CACHE_write(BYTE lun, const BYTE *buff, DWORD sector, UINT count);
+#endif /* _USE_WRITE == 1 */
+#if _USE_IOCTL == 1
+static DRESULT CACHE_ioctl(BYTE lun, BYTE cmd, void *buff);
+#endif /* _USE_IOCTL == 1 */
+
+const Diskio_drvTypeDef CACHE_Driver =
+{
+  CACHE_initialize,
+  CACHE_status,
+  CACHE_read,
+#if _USE_WRITE == 1
+  CACHE_write,
+#endif /* _USE_WRITE == 1 */
+#if _USE_IOCTL == 1
+  CACHE_ioctl,
+#endif /* _USE_IOCTL == 1 */
+};
+
+/* Private functions ---------------------------------------------------------*/
+
+/**
+  * @brief  Finds the line holding a sector
+  * @param  sector: Sector address (LBA)
+  * @retval Line, or NULL if the sector is not cached
+  */
+static CACHE_LineTypeDef *CACHE_Find(DWORD sector)
+{
+  UINT i;
+
+  for (i = 0; i < CACHE_SECTORS; i++)
+  {
+    if (lines[i].valid && lines[i].sector == sector)
+    {
+      return &lines[i];
+    }
+  }
+  return 0;
+}
+
+/**
+  * @brief  Writes back every dirty line
+  * @note   Dirty sectors go out in ascending order; each run of consecutive
+  *         sectors is gathered into one buffer and written with a single
+  *         multi-sector backend write.
+  * @param  lun: Logical unit passed through to the backend
+  * @retval DRESULT: Operation result
+  */
+static DRESULT CACHE_Flush(BYTE lun)
+{
+  static uint32_t staging[CACHE_SECTORS][_MAX_SS / 4];
+  CACHE_LineTypeDef *run[CACHE_SECTORS];
+  CACHE_LineTypeDef *line;
+  UINT i, n;
+
+  for (;;)
+  {
+    /* Lowest dirty sector starts the next run; N is small */
+    line = 0;
+    for (i = 0; i < CACHE_SECTORS; i++)
+    {
+      if (lines[i].valid && lines[i].dirty &&
+          (line == 0 || lines[i].sector < line->sector))
+      {
+        line = &lines[i];
+      }
+    }
+    if (line == 0) break;
+
+    n = 0;
+    do
+    {
+      memcpy(staging[n], line->data, _MAX_SS);
+      run[n++] = line;
+      line = CACHE_Find(run[0]->sector + n);
+    } while (line != 0 && line->dirty);
+
+    if (disk_device_write(pdrv, backend, lun, (BYTE *)staging, run[0]->sector, n) != RES_OK)
+    {
+      return RES_ERROR;
+    }
+    for (i = 0; i < n; i++)
+    {
+      run[i]->dirty = 0;
+    }
+    stats.flushes++;
+    stats.flushed += n;
+  }
+
+  return RES_OK;
+}
+
+/**
+  * @brief  Picks a line for a new sector: an unused one, else the least
+  *         recently used. Dirty data is written back first.
+  * @param  lun: Logical unit passed through to the backend
+  * @retval Line, or NULL if the write-back failed
+  */
+static CACHE_LineTypeDef *CACHE_Alloc(BYTE lun)
+{
+  CACHE_LineTypeDef *victim = &lines[0];
+  UINT i;
+
+  for (i = 0; i < CACHE_SECTORS; i++)
+  {
+    if (!lines[i].valid)
+    {
+      return &lines[i];
+    }
+    if (lines[i].stamp < victim->stamp)
+    {
+      victim = &lines[i];
+    }
+  }
+
+  stats.evictions++;
+  /* Writing back everything, not just the victim, lets neighbouring
+     dirty sectors share one backend write */
+  if (victim->dirty && CACHE_Flush(lun) != RES_OK)
+  {
+    return 0;
+  }
+  victim->valid = 0;
+  return victim;
+}
+
+/**
+  * @brief  Initializes the backend and empties the cache
+  * @param  lun: Logical unit passed through to the backend
+  * @retval DSTATUS: Operation status
+  */
+static DSTATUS CACHE_initialize(BYTE lun)
+{
+  memset(lines, 0, sizeof(lines));
+  tick = 0;
+  return backend->disk_initialize(lun);
+}
+
+/**
+  * @brief  Gets backend status
+  * @param  lun: Logical unit passed through to the backend
+  * @retval DSTATUS: Operation status
+  */
+static DSTATUS CACHE_status(BYTE lun)
+{
+  return backend->disk_status(lun);
+}
+
+/**
+  * @brief  Reads Sector(s)
+  * @param  lun: Logical unit passed through to the backend
+  * @param  *buff: Data buffer to store read data
+  * @param  sector: Sector address (LBA)
+  * @param  count: Number of sectors to read (1..128)
+  * @retval DRESULT: Operation result
+  */
+static DRESULT CACHE_read(BYTE lun, BYTE *buff, DWORD sector, UINT count)
+{
+  CACHE_LineTypeDef *line;
+  UINT i;
+
+  if (count > 1)
+  {
+    /* Bulk read straight from the backend, then overlay newer data */
+    if (disk_device_read(pdrv, backend, lun, buff, sector, count) != RES_OK)
+    {
+      return RES_ERROR;
+    }
+    for (i = 0; i < CACHE_SECTORS; i++)
+    {
+      if (lines[i].valid && lines[i].dirty &&
+          lines[i].sector >= sector && lines[i].sector < sector + count)
+      {
+        memcpy(buff + (lines[i].sector - sector) * _MAX_SS, lines[i].data, _MAX_SS);
+      }
+    }
+    return RES_OK;
+  }
+
+  line = CACHE_Find(sector);
+  if (line != 0)
+  {
+    stats.hits++;
+  }
+  else
+  {
+    stats.misses++;
+    line = CACHE_Alloc(lun);
+    if (line == 0) return RES_ERROR;
+    if (disk_device_read(pdrv, backend, lun, (BYTE *)line->data, sector, 1) != RES_OK)
+    {
+      return RES_ERROR;
+    }
+    line->sector = sector;
+    line->dirty = 0;
+    line->valid = 1;
+  }
+  line->stamp = ++tick;
+  memcpy(buff, line->data, _MAX_SS);
+
+  return RES_OK;
+}
+
+/**
+  * @brief  Writes Sector(s)
+  * @param  lun: Logical unit passed through to the backend
+  * @param  *buff: Data to be written
+  * @param  sector: Sector address (LBA)
+  * @param  count: Number of sectors to write (1..128)
+  * @retval DRESULT: Operation result
+  */
+#if _USE_WRITE == 1
+static DRESULT CACHE_write(BYTE lun, const BYTE *buff, DWORD sector, UINT count)
+{
+  CACHE_LineTypeDef *line;
+  UINT i;
+
+  if (count > 1)
+  {
+    /* Bulk write straight through; cached copies become clean and current */
+    if (disk_device_write(pdrv, backend, lun, buff, sector, count) != RES_OK)
+    {
+      return RES_ERROR;
+    }
+    for (i = 0; i < CACHE_SECTORS; i++)
+    {
+      if (lines[i].valid &&
+          lines[i].sector >= sector && lines[i].sector < sector + count)
+      {
+        memcpy(lines[i].data, buff + (lines[i].sector - sector) * _MAX_SS, _MAX_SS);
+        lines[i].dirty = 0;
+      }
+    }
+    return RES_OK;
+  }
+
+  line = CACHE_Find(sector);
+  if (line != 0)
+  {
+    stats.hits++;
+  }
+  else
+  {
+    line = CACHE_Alloc(lun);
+    if (line == 0) return RES_ERROR;
+    line->sector = sector;
+    line->valid = 1;
+  }
+  memcpy(line->data, buff, _MAX_SS);
+  line->dirty = 1;
+  line->stamp = ++tick;
+
+  return RES_OK;
+}
+#endif /* _USE_WRITE == 1 */
+
+/**
+  * @brief  I/O control operation
+  * @param  lun: Logical unit passed through to the backend
+  * @param  cmd: Control code
+  * @param  *buff: Buffer to send/receive control data
+  * @retval DRESULT: Operation result
+  */
+#if _USE_IOCTL == 1
+static DRESULT CACHE_ioctl(BYTE lun, BYTE cmd, void *buff)
+{
+  UINT i;
+
+  switch (cmd)
+  {
+  case CTRL_SYNC:
+    if (CACHE_Flush(lun) != RES_OK)
+    {
+      return RES_ERROR;
+    }
+    break;
+
+  case CTRL_TRIM:
+    /* Trimmed sectors are free: drop them without writing them back */
+    for (i = 0; i < CACHE_SECTORS; i++)
+    {
+      if (lines[i].valid &&
+          lines[i].sector >= ((DWORD *)buff)[0] &&
+          lines[i].sector <= ((DWORD *)buff)[1])
+      {
+        lines[i].valid = 0;
+        lines[i].dirty = 0;
+      }
+    }
+    break;
+
+  default:
+    break;
+  }
+
+  return backend->disk_ioctl(lun, cmd, buff);
+}
+#endif /* _USE_IOCTL == 1 */
+
+/**
+  * @brief  Links the cache in front of a diskio driver
+  * @param  drv: pointer to the disk IO Driver the cache writes back to
+  * @param  path: pointer to the logical drive path
+  * @retval Returns 0 in case of success, otherwise 1.
+  */
+uint8_t CACHE_LinkDriver(const Diskio_drvTypeDef *drv, char *path)
+{
+  backend = drv;
+  if (FATFS_LinkDriver(&CACHE_Driver, path) != 0)
+  {
+    return 1;
+  }
+  /* Backend transfers are what reaches the device: account those, not
+     the requests the cache absorbs */
+  pdrv = path[0] - '0';
+#if DISK_STATS == 1
+  disk.layered[pdrv] = 1;
+#endif /* DISK_STATS == 1 */
+  return 0;
+}
+
+/**
+  * @brief  Copies the cache counters
+  * @param  out: destination
+  * @retval None
+  */
+void CACHE_GetStats(CACHE_StatsTypeDef *out)
+{
+  *out = stats;
+}
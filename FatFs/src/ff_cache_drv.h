@@ -0,0 +1,54 @@
+/**
+  ******************************************************************************
+  * @file    ff_cache_drv.h
+  * @brief   Header for ff_cache_drv.c module.
+  ******************************************************************************
+**/
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __FF_CACHE_DRV_H
+#define __FF_CACHE_DRV_H
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include "ff_gen_drv.h"
+
+/* Exported constants --------------------------------------------------------*/
+
+/**
+  * @brief  Number of sectors held by the write-back cache
+  */
+#ifndef CACHE_SECTORS
+#define CACHE_SECTORS 8
+#endif
+
+/* Exported types ------------------------------------------------------------*/
+
+/**
+  * @brief  Write-back cache counters
+  */
+typedef struct
+{
+  uint32_t hits;          /*!< Single sector reads/writes served by the cache  */
+  uint32_t misses;        /*!< Single sector reads that went to the backend    */
+  uint32_t evictions;     /*!< Lines reused while still holding a sector       */
+  uint32_t flushes;       /*!< Backend writes issued to write back dirty lines */
+  uint32_t flushed;       /*!< Sectors written back by those writes            */
+
+}CACHE_StatsTypeDef;
+
+/* Exported variables --------------------------------------------------------*/
+extern const Diskio_drvTypeDef CACHE_Driver;
+
+/* Exported functions ------------------------------------------------------- */
+uint8_t CACHE_LinkDriver(const Diskio_drvTypeDef *drv, char *path);
+void CACHE_GetStats(CACHE_StatsTypeDef *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __FF_CACHE_DRV_H */
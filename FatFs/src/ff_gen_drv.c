@@ -21,7 +21,11 @@
 /* Private typedef -----------------------------------------------------------*/
 /* Private define ------------------------------------------------------------*/
 /* Private variables ---------------------------------------------------------*/
-Disk_drvTypeDef disk = {{0},{0},{0},0};
+Disk_drvTypeDef disk = {{0},{0},{0},0
+#if DISK_STATS == 1
+  ,{{0}},{0}
+#endif /* DISK_STATS == 1 */
+};
 
 /* Private function prototypes -----------------------------------------------*/
 /* Private functions ---------------------------------------------------------*/
@@ -46,6 +50,9 @@ uint8_t FATFS_LinkDriverEx(const Diskio_drvTypeDef *drv, char *path, uint8_t lun
     disk.is_initialized[disk.nbr] = 0;
     disk.drv[disk.nbr] = drv;
     disk.lun[disk.nbr] = lun;
+#if DISK_STATS == 1
+    disk.layered[disk.nbr] = 0;
+#endif /* DISK_STATS == 1 */
     DiskNum = disk.nbr++;
     path[0] = DiskNum + '0';
     path[1] = ':';
@@ -32,6 +32,33 @@
 
 /* Exported types ------------------------------------------------------------*/
 
+/**
+  * @brief  Per-drive statistics kept by diskio.c when DISK_STATS is 1
+  */
+#ifndef DISK_STATS
+#define DISK_STATS 1
+#endif
+
+#define DISK_STATS_BUCKETS 32
+
+typedef struct
+{
+  uint32_t reads;                           /*!< Reads issued to the device driver         */
+  uint32_t writes;                          /*!< Writes issued to the device driver        */
+  uint32_t read_sectors;                    /*!< Sectors read from the device              */
+  uint32_t write_sectors;                   /*!< Sectors written to the device             */
+  uint64_t read_bytes;                      /*!< read_sectors in bytes                     */
+  uint64_t write_bytes;                     /*!< write_sectors in bytes                    */
+  uint32_t errors;                          /*!< Device calls that did not return RES_OK   */
+  uint64_t logical_bytes;                   /*!< Payload reported with DISK_ADD_LOGICAL    */
+  uint32_t write_amp_x100;                  /*!< write_bytes / logical_bytes, times 100,
+                                                 computed by DISK_GET_STATS               */
+  uint32_t read_hist[DISK_STATS_BUCKETS];   /*!< Device read latency: bucket n counts calls
+                                                 taking 2^n to 2^(n+1)-1 CPU cycles       */
+  uint32_t write_hist[DISK_STATS_BUCKETS];  /*!< Device write latency, same buckets        */
+
+}DISK_StatsTypeDef;
+
 /**
   * @brief  Disk IO Driver structure definition
   */
@@ -58,10 +85,24 @@ typedef struct
   const Diskio_drvTypeDef *drv[_VOLUMES];
   uint8_t                 lun[_VOLUMES];
   volatile uint8_t        nbr;
+#if DISK_STATS == 1
+  DISK_StatsTypeDef       stats[_VOLUMES];
+  uint8_t                 layered[_VOLUMES];  /* The linked driver is a layer (the sector
+                                                 cache) that accounts its own device I/O */
+#endif /* DISK_STATS == 1 */
 
 }Disk_drvTypeDef;
 
 /* Exported constants --------------------------------------------------------*/
+
+/**
+  * @brief  Largest read-ahead depth in sectors used by disk_read() on
+  *         sequential single sector reads. 0 disables read-ahead.
+  */
+#ifndef READAHEAD_SECTORS
+#define READAHEAD_SECTORS 8
+#endif
+
 /* Exported macro ------------------------------------------------------------*/
 /* Exported functions ------------------------------------------------------- */
 uint8_t FATFS_LinkDriver(const Diskio_drvTypeDef *drv, char *path);
@@ -69,6 +110,12 @@ uint8_t FATFS_UnLinkDriver(char *path);
 uint8_t FATFS_LinkDriverEx(const Diskio_drvTypeDef *drv, char *path, BYTE lun);
 uint8_t FATFS_UnLinkDriverEx(char *path, BYTE lun);
 uint8_t FATFS_GetAttachedDriversNbr(void);
+DRESULT disk_device_read(BYTE pdrv, const Diskio_drvTypeDef *drv, BYTE lun,
+                         BYTE *buff, DWORD sector, UINT count);
+#if _USE_WRITE == 1
+DRESULT disk_device_write(BYTE pdrv, const Diskio_drvTypeDef *drv, BYTE lun,
+                          const BYTE *buff, DWORD sector, UINT count);
+#endif /* _USE_WRITE == 1 */
 
 #ifdef __cplusplus
 }
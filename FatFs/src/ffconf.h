@@ -68,10 +68,18 @@
 /* This option switches fast seek function. (0:Disable or 1:Enable) */
 
 
-#define	_USE_EXPAND		0
+#define	_USE_EXPAND		1
 /* This option switches f_expand function. (0:Disable or 1:Enable) */
 
 
+#define	_USE_FREEMAP	512
+/* This option sets the size in bytes of the free cluster map kept in each FATFS
+/  object (0:Disable). The map is built with a full FAT scan when the volume is
+/  mounted and lets cluster allocation skip FAT sectors known to be full. Each
+/  bit covers one FAT sector, or more when the FAT does not fit in the map.
+/  FAT16/32 volumes only. Also _FS_READONLY needs to be 0 to enable this option. */
+
+
 #define _USE_CHMOD		0
 /* This option switches attribute manipulation functions, f_chmod() and f_utime().
 /  (0:Disable or 1:Enable) Also _FS_READONLY needs to be 0 to enable this option. */
@@ -119,7 +127,7 @@
 */
 
 
-#define	_USE_LFN	1
+#define	_USE_LFN	3
 #define	_MAX_LFN	255
 /* The _USE_LFN switches the support of long file name (LFN).
 /
@@ -200,7 +208,7 @@
 /  disk_ioctl() function. */
 
 
-#define	_USE_TRIM	0
+#define	_USE_TRIM	1
 /* This option switches support of ATA-TRIM. (0:Disable or 1:Enable)
 /  To enable Trim function, also CTRL_TRIM command should be implemented to the
 /  disk_ioctl() function. */
@@ -230,6 +238,15 @@
 /  buffer in the file system object (FATFS) is used for the file data transfer. */
 
 
+#define	_FS_WINCACHE	3
+/* This option sets the number of sector buffers (ways) kept behind the disk
+/  access window of each FATFS object (0:Disable). Sectors leaving the window
+/  move into the least recently used way, so the hot FAT and directory sectors
+/  stay resident. A dirty way is written back when it is evicted or when the
+/  volume is synced, FAT sectors first. Each way takes _MAX_SS bytes of RAM.
+/  Cannot be used with _FS_TINY. */
+
+
 #define _FS_EXFAT	0
 /* This option switches support of exFAT file system. (0:Disable or 1:Enable)
 /  When enable exFAT, also LFN needs to be enabled. (_USE_LFN >= 1)
@@ -261,7 +278,7 @@
 /      can be opened simultaneously under file lock control. Note that the file
 /      lock control is independent of re-entrancy. */
 
-#define _FS_REENTRANT	0
+#define _FS_REENTRANT	1
 #define _USE_MUTEX	0
 /* Use CMSIS-OS mutexes as _SYNC_t object instead of Semaphores */
 
@@ -269,7 +286,11 @@
 
 #include "FreeRTOS.h"
 #include "semphr.h"
-#define _FS_TIMEOUT		1000
+/* Ticks a file function waits for the volume before failing with FR_TIMEOUT.
+/  The mount FAT scan, f_expand searches and the f_recover scan hold the volume
+/  for far longer than a second on a large card, so waiters block until it is
+/  released. */
+#define _FS_TIMEOUT		portMAX_DELAY
 
 #if _USE_MUTEX
 
@@ -306,25 +327,10 @@
 
 #if _USE_LFN == 3
 
+/* The working buffers come from the FreeRTOS heap, as _FS_REENTRANT rules
+/  out the static buffer and the callers' stacks are small */
 #if !defined(ff_malloc) || !defined(ff_free)
-#include <stdlib.h>
-#endif
-
-#if !defined(ff_malloc)
-#define ff_malloc malloc
-#endif
-
-#if !defined(ff_free)
-#define ff_free free
-#endif
-
-/* by default the system malloc/free are used, but when the FreeRTOS is enabled
-/ the macros pvPortMalloc()/vportFree() to be used thus uncomment the code below
-/
-*/
-/*
-#if !defined(ff_malloc) || !defined(ff_free)
-#include "cmsis_os.h"
+#include "FreeRTOS.h"
 #endif
 
 #if !defined(ff_malloc)
@@ -334,6 +340,5 @@
 #if !defined(ff_free)
 #define ff_free vPortFree
 #endif
-*/
 #endif
 /*--- End of configuration options ---*/
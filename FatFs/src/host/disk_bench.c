@@ -0,0 +1,614 @@
+/**
+  ******************************************************************************
+  * @file    disk_bench.c
+  * @brief   FatFs workloads on a host disk, counting the sector I/O each one
+  *          costs through the diskio statistics.
+  ******************************************************************************
+  * @attention
+  *
+  * Built by "make host".
+  *
+  *     disk_bench [-c] [-f image] [-l us] [-t threads] workload
+  *
+  *     -c  link the disk through the sector cache
+  *     -f  run on a disk image file instead of a RAM disk
+  *     -l  latency added to every disk read, write and CTRL_SYNC
+  *     -t  most threads for contend (default _FS_LOCK, or 4 without it)
+  *
+  * Every run formats a fresh 128 MiB FAT32 volume. Workloads:
+  *     sync      records with f_sync: one log, two logs in two directories,
+  *               and rotating logs; device writes and reads per f_sync
+  *     prealloc  10000 records with f_sync into f_expand extents behind a
+  *               cluster link map; device writes per record
+  *     datasync  records into preallocated extents with f_sync, then with
+  *               f_datasync and the entry synced every 100th record; then a
+  *               power cut 250 records after an entry update and f_recover
+  *     freemap   a volume full but for the last 200 clusters, allocation hint
+  *               lost; sectors read by mount, f_getfree, appending 100
+  *               clusters and f_expand of 150 clusters
+  *     contend   1, 2, 4 ... threads, each appending 1000 records with f_sync
+  *               to its own file on the one volume; throughput and the
+  *               spread of per-record latency, which includes waiting for
+  *               the volume mutex
+  *
+  * Device operations are counted below the cache, and each measured phase
+  * also prints its wall time.
+  *
+  * The counts depend on ffconf.h: _FS_WINCACHE for sync, _USE_FREEMAP for
+  * freemap. Set them to 0 there for the numbers without the feature.
+  *
+  ******************************************************************************
+**/
+
+#include "host_diskio.h"
+#include "ff_cache_drv.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_SECTORS   262144      /* 128 MiB */
+#define BENCH_EXTENT    (256 * 1024)
+#define BENCH_CLMT      64
+#define BENCH_RECORDS   1000        /* Per contend thread */
+
+static FATFS fs;
+static FIL fil;
+static FIL fil2;
+static char path[4];
+static char file_path[24];
+static DWORD clmt[BENCH_CLMT];
+static DISK_StatsTypeDef mark;
+static struct timespec mark_time;
+static const char *image = NULL;
+static int cache = 0;
+static HOST_DelayTypeDef delay = {0, 0, 0};
+static int threads = 0;             /* contend: 0 for as many as _FS_LOCK */
+
+/* One appending thread of contend */
+typedef struct
+{
+    pthread_t thread;
+    int id;
+    uint32_t lat_us[BENCH_RECORDS];
+    int err;
+} Bench_WorkerTypeDef;
+
+static const char rec[] = "1234,45123,2250,101325,56000\n";
+#define REC_LEN (sizeof(rec) - 1)
+static const char line[] = "hello,world,1234\n";
+#define LINE_LEN (sizeof(line) - 1)
+
+/* Full path of a file on the volume */
+static const char *Bench_Path(const char *file)
+{
+    snprintf(file_path, sizeof(file_path), "%s%s", path, file);
+    return file_path;
+}
+
+static void Bench_Mark(void)
+{
+    disk_ioctl(0, DISK_GET_STATS, &mark);
+    clock_gettime(CLOCK_MONOTONIC, &mark_time);
+}
+
+/* Wall time since the last Bench_Mark */
+static double Bench_Ms(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (t.tv_sec - mark_time.tv_sec) * 1e3 +
+           (t.tv_nsec - mark_time.tv_nsec) / 1e6;
+}
+
+/* Counters since the last Bench_Mark */
+static DISK_StatsTypeDef Bench_Since(void)
+{
+    DISK_StatsTypeDef now;
+
+    disk_ioctl(0, DISK_GET_STATS, &now);
+    now.reads -= mark.reads;
+    now.writes -= mark.writes;
+    now.read_sectors -= mark.read_sectors;
+    now.write_sectors -= mark.write_sectors;
+    return now;
+}
+
+static void Bench_PerOp(const char *name, uint32_t ops)
+{
+    double ms = Bench_Ms();
+    DISK_StatsTypeDef d = Bench_Since();
+
+    printf("%-34s writes %.3f  reads %.3f  %8.1f ms\n", name,
+           (double)d.writes / ops, (double)d.reads / ops, ms);
+}
+
+/* Links the disk, through the cache with -c */
+static int Bench_Link(void)
+{
+    const Diskio_drvTypeDef *drv = image ? &FILE_DISK_Driver : &RAM_DISK_Driver;
+
+    if(cache)
+    {
+        return CACHE_LinkDriver(drv, path) != 0;
+    }
+    return FATFS_LinkDriver(drv, path) != 0;
+}
+
+/* Links the disk and formats it with clusters of au bytes (0: default).
+   With an image file the image is reused and only the volume is
+   recreated. */
+static int Bench_Open(DWORD au)
+{
+    BYTE work[_MAX_SS];
+
+    if(image != NULL)
+    {
+        if(FILE_DISK_Open(image, BENCH_SECTORS, 0) != 0)
+        {
+            return 1;
+        }
+        FILE_DISK_SetDelay(&delay);
+    }
+    else
+    {
+        if(RAM_DISK_Create(BENCH_SECTORS) != 0)
+        {
+            return 1;
+        }
+        RAM_DISK_SetDelay(&delay);
+    }
+    if(Bench_Link() != 0 ||
+       f_mkfs(path, FM_FAT32, au, work, sizeof(work)) != FR_OK ||
+       f_mount(&fs, path, 1) != FR_OK)
+    {
+        return 1;
+    }
+    return 0;
+}
+
+/* Drops the mount without syncing, as a power cut would, and mounts again */
+static int Bench_Remount(void)
+{
+    f_mount(NULL, path, 0);
+    FATFS_UnLinkDriver(path);
+    if(Bench_Link() != 0)
+    {
+        return 1;
+    }
+    return f_mount(&fs, path, 1) != FR_OK;
+}
+
+static int Bench_Sync(void)
+{
+    static const char ev[] = "event,1234\n";
+    char name[16];
+    uint32_t syncs = 0;
+    UINT bw;
+    int err = 0;
+
+    printf("cluster %u bytes\n", fs.csize * _MAX_SS);
+    err |= f_open(&fil, Bench_Path("a.csv"), FA_CREATE_ALWAYS | FA_WRITE);
+    Bench_Mark();
+    for(int i = 0; i < 5000; i++)
+    {
+        err |= f_write(&fil, line, LINE_LEN, &bw);
+        err |= f_sync(&fil);
+    }
+    Bench_PerOp("one log, record + f_sync", 5000);
+    err |= f_close(&fil);
+
+    err |= f_mkdir(Bench_Path("ev"));
+    err |= f_open(&fil, Bench_Path("b.csv"), FA_CREATE_ALWAYS | FA_WRITE);
+    err |= f_open(&fil2, Bench_Path("ev/b.log"), FA_CREATE_ALWAYS | FA_WRITE);
+    Bench_Mark();
+    for(int i = 0; i < 5000; i++)
+    {
+        err |= f_write(&fil, line, LINE_LEN, &bw);
+        err |= f_sync(&fil);
+        err |= f_write(&fil2, ev, sizeof(ev) - 1, &bw);
+        err |= f_sync(&fil2);
+    }
+    Bench_PerOp("two logs in two directories", 10000);
+    err |= f_close(&fil);
+    err |= f_close(&fil2);
+
+    /* A new file every 50 records, the oldest removed, 20 files kept */
+    Bench_Mark();
+    for(int i = 0; i < 200; i++)
+    {
+        snprintf(name, sizeof(name), "log%05d.csv", i);
+        err |= f_open(&fil, Bench_Path(name), FA_CREATE_ALWAYS | FA_WRITE);
+        for(int r = 0; r < 50; r++)
+        {
+            err |= f_write(&fil, line, LINE_LEN, &bw);
+            err |= f_sync(&fil);
+        }
+        err |= f_close(&fil);
+        syncs += 51;
+        if(i >= 20)
+        {
+            snprintf(name, sizeof(name), "log%05d.csv", i - 20);
+            err |= f_unlink(Bench_Path(name));
+        }
+    }
+    Bench_PerOp("rotating logs (create/unlink)", syncs);
+    return err != 0;
+}
+
+/* Grows the allocation by an extent when the next record would cross its
+   end, as the SD card task does, and maps the chain again */
+static int Bench_Reserve(FSIZE_t *end, UINT len)
+{
+    if(f_tell(&fil) + len <= *end)
+    {
+        return 0;
+    }
+    fil.cltbl = NULL;
+    if(f_expand(&fil, BENCH_EXTENT, 2) != FR_OK)
+    {
+        return 1;
+    }
+    *end += BENCH_EXTENT;
+    clmt[0] = BENCH_CLMT;
+    fil.cltbl = clmt;
+    return f_lseek(&fil, CREATE_LINKMAP) != FR_OK;
+}
+
+/* Appends n copies of r into preallocated extents. With every != 0 each
+   record ends in f_datasync and every every-th one in f_sync. */
+static int Bench_Log(const char *r, uint32_t n, uint32_t every)
+{
+    UINT len = (UINT)strlen(r);
+    DWORD csize = (DWORD)fs.csize * _MAX_SS;
+    FSIZE_t end;
+    UINT bw;
+    int err = 0;
+
+    err |= f_open(&fil, Bench_Path("data.csv"), FA_OPEN_APPEND | FA_WRITE);
+    err |= f_truncate(&fil);
+    err |= f_sync(&fil);
+    end = (f_size(&fil) + csize - 1) / csize * csize;
+    clmt[0] = BENCH_CLMT;
+    fil.cltbl = clmt;
+    err |= f_lseek(&fil, CREATE_LINKMAP);
+    Bench_Mark();
+    for(uint32_t i = 0; i < n && err == 0; i++)
+    {
+        err |= Bench_Reserve(&end, len);
+        err |= f_write(&fil, r, len, &bw);
+        if(every != 0 && (i + 1) % every != 0)
+        {
+            err |= f_datasync(&fil);
+        }
+        else
+        {
+            err |= f_sync(&fil);
+        }
+    }
+    return err != 0;
+}
+
+/* Cuts the log back to its size and closes it */
+static int Bench_Close(void)
+{
+    int err;
+
+    fil.cltbl = NULL;
+    err = f_truncate(&fil);
+    err |= f_close(&fil);
+    return err != 0;
+}
+
+static int Bench_Prealloc(void)
+{
+    DWORD before, after;
+    FATFS *pfs;
+    char back[sizeof(line)] = {0};
+    UINT br;
+    int err = 0;
+
+    err |= f_getfree(path, &before, &pfs);
+    err |= Bench_Log(line, 10000, 0);
+    Bench_PerOp("10000 records, f_sync, extents", 10000);
+    err |= Bench_Close();
+    err |= f_getfree(path, &after, &pfs);
+    printf("clusters kept %lu, needed %lu\n", (unsigned long)(before - after),
+           (unsigned long)((10000 * LINE_LEN + fs.csize * _MAX_SS - 1) /
+                           (fs.csize * _MAX_SS)));
+
+    err |= f_open(&fil, Bench_Path("data.csv"), FA_READ);
+    err |= f_lseek(&fil, (FSIZE_t)LINE_LEN * 9999);
+    err |= f_read(&fil, back, LINE_LEN, &br);
+    err |= f_close(&fil);
+    if(err != 0 || strcmp(back, line) != 0)
+    {
+        printf("prealloc: read back failed\n");
+        return 1;
+    }
+    return 0;
+}
+
+static int Bench_Datasync(void)
+{
+    FSIZE_t written, recorded, got, size;
+    char *all;
+    UINT br;
+    uint32_t bad = 0;
+    int err = 0;
+
+    err |= Bench_Log(rec, 3000, 0);
+    Bench_PerOp("f_sync every record", 3000);
+    err |= Bench_Close();
+    err |= Bench_Log(rec, 3000, 100);
+    Bench_PerOp("f_datasync, entry every 100", 3000);
+    err |= Bench_Close();
+
+    /* Power cut 250 records after the last entry update */
+    err |= Bench_Log(rec, 1250, 1000);
+    written = f_size(&fil);
+    if(err != 0 || Bench_Remount() != 0)
+    {
+        printf("datasync: remount failed\n");
+        return 1;
+    }
+    err |= f_open(&fil, Bench_Path("data.csv"), FA_OPEN_APPEND | FA_WRITE);
+    recorded = f_size(&fil);
+    err |= f_recover(&fil, &got);
+    size = f_size(&fil);
+    err |= f_lseek(&fil, size);
+    err |= Bench_Close();
+
+    err |= f_open(&fil, Bench_Path("data.csv"), FA_READ);
+    all = malloc(f_size(&fil) + 1);
+    if(all == NULL)
+    {
+        return 1;
+    }
+    err |= f_read(&fil, all, f_size(&fil), &br);
+    err |= f_close(&fil);
+    for(UINT i = 0; i < br; i++)
+    {
+        if(all[i] != rec[i % REC_LEN]) bad++;
+    }
+    free(all);
+    printf("power cut: size recorded %lu, recovered %lu, written %lu, bad bytes %u\n",
+           (unsigned long)recorded, (unsigned long)size, (unsigned long)written,
+           bad);
+    return err != 0 || size != written || bad != 0;
+}
+
+static int Bench_Freemap(void)
+{
+    static BYTE buf[64 * 512];
+    DWORD fre;
+    FATFS *pfs;
+    UINT bw;
+    int err = 0;
+
+    err |= f_getfree(path, &fre, &pfs);
+    printf("csize %u, clusters %lu, FAT sectors %lu\n", fs.csize,
+           (unsigned long)(fs.n_fatent - 2), (unsigned long)fs.fsize);
+    err |= f_open(&fil, Bench_Path("big"), FA_CREATE_ALWAYS | FA_WRITE);
+    err |= f_expand(&fil, (FSIZE_t)(fre - 200) * fs.csize * _MAX_SS, 1);
+    err |= f_close(&fil);
+    if(err != 0 || (UINT)fs.csize * _MAX_SS > sizeof(buf))
+    {
+        printf("freemap: fill failed\n");
+        return 1;
+    }
+    f_mount(NULL, path, 0);
+
+    Bench_Mark();
+    err |= f_mount(&fs, path, 1);
+    printf("%-34s sectors read %u\n", "mount", Bench_Since().read_sectors);
+
+    fs.last_clst = 0xFFFFFFFF;      /* Allocation hint lost */
+    Bench_Mark();
+    err |= f_getfree(path, &fre, &pfs);
+    printf("%-34s sectors read %u\n", "f_getfree", Bench_Since().read_sectors);
+
+    err |= f_open(&fil, Bench_Path("log"), FA_CREATE_ALWAYS | FA_WRITE);
+    Bench_Mark();
+    for(int i = 0; i < 100; i++)
+    {
+        err |= f_write(&fil, buf, fs.csize * _MAX_SS, &bw);
+        err |= f_sync(&fil);
+    }
+    printf("%-34s sectors read %u\n", "append 100 clusters", Bench_Since().read_sectors);
+    err |= f_close(&fil);
+    err |= f_unlink(Bench_Path("log"));
+
+    fs.last_clst = 0xFFFFFFFF;
+    err |= f_open(&fil, Bench_Path("log2"), FA_CREATE_ALWAYS | FA_WRITE);
+    Bench_Mark();
+    err |= f_expand(&fil, (FSIZE_t)150 * fs.csize * _MAX_SS, 1);
+    printf("%-34s sectors read %u\n", "f_expand 150 clusters", Bench_Since().read_sectors);
+    err |= f_close(&fil);
+    return err != 0;
+}
+
+static void Bench_Usage(void);
+
+static uint64_t Bench_Us(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+static void *Bench_Appender(void *arg)
+{
+    Bench_WorkerTypeDef *w = arg;
+    char name[16];
+    char file[24];
+    FIL f;
+    UINT bw;
+    uint64_t t0;
+
+    snprintf(name, sizeof(name), "t%d.csv", w->id);
+    snprintf(file, sizeof(file), "%s%s", path, name);
+    w->err = f_open(&f, file, FA_CREATE_ALWAYS | FA_WRITE);
+    for(uint32_t i = 0; i < BENCH_RECORDS && w->err == 0; i++)
+    {
+        t0 = Bench_Us();
+        w->err |= f_write(&f, line, LINE_LEN, &bw);
+        w->err |= f_sync(&f);
+        w->lat_us[i] = (uint32_t)(Bench_Us() - t0);
+    }
+    w->err |= f_close(&f);
+    return NULL;
+}
+
+static int Bench_CompareU32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Runs n appenders at once and checks every file afterwards */
+static int Bench_ContendRun(Bench_WorkerTypeDef *w, int n)
+{
+    static uint32_t lat[BENCH_RECORDS * 64];
+    uint32_t count = 0;
+    double ms;
+    FILINFO fno;
+    char name[16];
+    int err = 0;
+
+    Bench_Mark();
+    for(int i = 0; i < n; i++)
+    {
+        w[i].id = i;
+        if(pthread_create(&w[i].thread, NULL, Bench_Appender, &w[i]) != 0)
+        {
+            return 1;
+        }
+    }
+    for(int i = 0; i < n; i++)
+    {
+        pthread_join(w[i].thread, NULL);
+        err |= w[i].err;
+        memcpy(&lat[count], w[i].lat_us, sizeof(w[i].lat_us));
+        count += BENCH_RECORDS;
+    }
+    ms = Bench_Ms();
+    qsort(lat, count, sizeof(lat[0]), Bench_CompareU32);
+    printf("%2d threads  %8.1f ms  %7.0f records/s  writes %.3f"
+           "  latency p50 %u  p99 %u  max %u us\n", n, ms, count * 1e3 / ms,
+           (double)Bench_Since().writes / count, lat[count / 2],
+           lat[count * 99 / 100], lat[count - 1]);
+
+    for(int i = 0; i < n; i++)
+    {
+        snprintf(name, sizeof(name), "t%d.csv", i);
+        if(f_stat(Bench_Path(name), &fno) != FR_OK ||
+           fno.fsize != (FSIZE_t)BENCH_RECORDS * LINE_LEN)
+        {
+            err = 1;
+        }
+    }
+    return err;
+}
+
+static int Bench_Contend(void)
+{
+    Bench_WorkerTypeDef *w;
+    int err = 0;
+
+    if(threads == 0)
+    {
+        threads = _FS_LOCK ? _FS_LOCK : 4;
+    }
+    if(threads < 1 || threads > 64)
+    {
+        Bench_Usage();
+    }
+#if _FS_LOCK
+    /* Each thread keeps a file open */
+    if(threads > _FS_LOCK)
+    {
+        printf("_FS_LOCK allows %d open files, running up to %d threads\n",
+               _FS_LOCK, _FS_LOCK);
+        threads = _FS_LOCK;
+    }
+#endif
+    w = calloc(threads, sizeof(*w));
+    if(w == NULL)
+    {
+        return 1;
+    }
+    for(int n = 1; n <= threads && err == 0; n *= 2)
+    {
+        err |= Bench_ContendRun(w, n);
+    }
+    free(w);
+    if(err != 0)
+    {
+        printf("contend: a thread failed or a file came out wrong\n");
+    }
+    return err;
+}
+
+static void Bench_Usage(void)
+{
+    fprintf(stderr, "usage: disk_bench [-c] [-f image] [-l us] [-t threads]"
+                    " sync|prealloc|datasync|freemap|contend\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+
+    while((opt = getopt(argc, argv, "cf:l:t:")) != -1)
+    {
+        switch(opt)
+        {
+        case 'c': cache = 1; break;
+        case 'f': image = optarg; break;
+        case 'l': delay.op_us = delay.sync_us = strtoul(optarg, NULL, 0); break;
+        case 't': threads = atoi(optarg); break;
+        default:  Bench_Usage();
+        }
+    }
+    if(optind != argc - 1)
+    {
+        Bench_Usage();
+    }
+    /* The sync counts were taken with 1 KiB clusters */
+    if(Bench_Open(strcmp(argv[optind], "sync") == 0 ? 1024 : 0) != 0)
+    {
+        printf("mkfs failed\n");
+        return 1;
+    }
+
+    if(strcmp(argv[optind], "sync") == 0)
+    {
+        return Bench_Sync();
+    }
+    if(strcmp(argv[optind], "prealloc") == 0)
+    {
+        return Bench_Prealloc();
+    }
+    if(strcmp(argv[optind], "datasync") == 0)
+    {
+        return Bench_Datasync();
+    }
+    if(strcmp(argv[optind], "freemap") == 0)
+    {
+        return Bench_Freemap();
+    }
+    if(strcmp(argv[optind], "contend") == 0)
+    {
+        return Bench_Contend();
+    }
+    Bench_Usage();
+    return 2;
+}
@@ -0,0 +1,312 @@
+/**
+  ******************************************************************************
+  * @file    emu_bench.c
+  * @brief   Workloads for the SD card emulator: FatFs, diskio and sd_spi.c
+  *          running unmodified on Linux against an emulated card.
+  ******************************************************************************
+  * @attention
+  *
+  * Built by "make host" with the sd_spi.h switches given in HOST_SD.
+  *
+  *     emu_bench [-c] [-d] [-g blocks] [-n count] [-p us] [-r] workload
+  *
+  *     -c  link the card through the sector cache
+  *     -d  link DMA streams to the SPI handle (SD_USE_DMA builds)
+  *     -g  blocks written between GC stalls, 0 for none (default 2048)
+  *     -n  size of the workload
+  *     -p  busy time of a block announced by ACMD23 (default 350)
+ *     -r  the card rejects ACMD23 as an illegal command
+  *
+  * Workloads:
+  *     log   appends n 27 byte records (default 2000), each followed by
+  *           f_sync, then reads the last one back
+  *     bulk  writes an n block file (default 2048) in 16 KiB f_write calls,
+  *           reporting the write histogram and the spread of f_write
+  *           latencies, then reads it back
+  *
+  * Each phase reports simulated time, the CPU share left busy (time not
+  * spent sleeping or waiting on DMA), throughput, the emulator counters
+  * and the busy cycles per block at cpu_hz.
+  * Everything is simulated time from the emulator's model, not a
+  * measurement of the target.
+  *
+  ******************************************************************************
+**/
+
+#include "sd_emu.h"
+#include "sd_spi.h"
+#include "host_diskio.h"
+#include "ff_cache_drv.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BENCH_SECTORS   262144      /* 128 MiB card */
+#define BENCH_CHUNK     16384
+
+extern Diskio_drvTypeDef SD_SPI_Driver;
+
+static SPI_HandleTypeDef hspi;
+static DMA_HandleTypeDef hdma_rx;
+static DMA_HandleTypeDef hdma_tx;
+static SD_EMU_ConfigTypeDef cfg;
+
+static FATFS fs;
+static FIL fil;
+static char path[4];
+static char file_path[16];
+static BYTE chunk[BENCH_CHUNK];
+
+/* Full path of a file on the card */
+static const char *Bench_Path(const char *file)
+{
+    snprintf(file_path, sizeof(file_path), "%s%s", path, file);
+    return file_path;
+}
+
+static void Bench_Phase(const char *name, uint64_t bytes)
+{
+    SD_EMU_StatsTypeDef s;
+    uint64_t busy;
+
+    SD_EMU_GetStats(&s);
+    busy = s.sim_ns - s.sleep_ns - s.dma_ns;
+    printf("%-6s %10.1f ms  cpu %5.1f%%  sleep %9.1f ms  dma %9.1f ms",
+           name, s.sim_ns / 1e6, s.sim_ns ? 100.0 * busy / s.sim_ns : 0.0,
+           s.sleep_ns / 1e6, s.dma_ns / 1e6);
+    if(bytes != 0 && s.sim_ns != 0)
+    {
+        printf("  %8.1f kB/s", bytes * 1e6 / s.sim_ns);
+    }
+    printf("\n       bus %llu B (%llu busy)  hal %u  reg %u  dma %u  cmd %u"
+           "  blk r %u w %u  gc %u  crc err %u  ovr %u\n",
+           (unsigned long long)s.bytes_clocked, (unsigned long long)s.busy_bytes,
+           s.hal_calls, s.reg_accesses, s.dma_transfers, s.commands,
+           s.blocks_read, s.blocks_written, s.gc_stalls, s.crc_errors,
+           s.overruns);
+    if(s.blocks_read + s.blocks_written != 0)
+    {
+        /* Busy CPU cycles at cpu_hz, spread over the blocks moved */
+        printf("       per block: %.0f busy cycles, %.0f register accesses\n",
+               (double)busy * cfg.cpu_hz / 1e9 / (s.blocks_read + s.blocks_written),
+               (double)s.reg_accesses / (s.blocks_read + s.blocks_written));
+    }
+}
+
+/* Device latency histogram in simulated microseconds */
+static void Bench_Histogram(const char *name, const uint32_t *hist)
+{
+    double us_per_cycle = 1e6 / cfg.cpu_hz;
+
+    printf("%-6s", name);
+    for(int i = 0; i < DISK_STATS_BUCKETS; i++)
+    {
+        if(hist[i] != 0)
+        {
+            printf("  >=%.0fus:%u", (double)(1UL << i) * us_per_cycle, hist[i]);
+        }
+    }
+    printf("\n");
+}
+
+static int Bench_Log(uint32_t n)
+{
+    static const char rec[] = "12345,45,2300,101325,12000\n";
+    DISK_StatsTypeDef ds;
+    char back[sizeof(rec)] = {0};
+    UINT bw;
+    int err = 0;
+
+    err |= f_open(&fil, Bench_Path("log.csv"), FA_CREATE_ALWAYS | FA_WRITE);
+    disk_ioctl(0, DISK_RESET_STATS, NULL);
+    SD_EMU_ResetStats();
+    for(uint32_t i = 0; i < n && err == 0; i++)
+    {
+        err |= f_write(&fil, rec, sizeof(rec) - 1, &bw);
+        err |= f_sync(&fil);
+    }
+    Bench_Phase("log", (uint64_t)n * (sizeof(rec) - 1));
+    disk_ioctl(0, DISK_GET_STATS, &ds);
+    printf("       device writes %u (%u sectors), reads %u\n",
+           ds.writes, ds.write_sectors, ds.reads);
+    Bench_Histogram("write", ds.write_hist);
+    err |= f_close(&fil);
+
+    err |= f_open(&fil, Bench_Path("log.csv"), FA_READ);
+    err |= f_lseek(&fil, (FSIZE_t)(sizeof(rec) - 1) * (n - 1));
+    err |= f_read(&fil, back, sizeof(rec) - 1, &bw);
+    err |= f_close(&fil);
+    if(err != 0 || strcmp(back, rec) != 0)
+    {
+        printf("log: read back failed\n");
+        return 1;
+    }
+    return 0;
+}
+
+static int Bench_CompareU32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Spread of per-call latencies in simulated microseconds */
+static void Bench_Percentiles(const char *name, uint32_t *us, uint32_t count)
+{
+    if(count == 0)
+    {
+        return;
+    }
+    qsort(us, count, sizeof(us[0]), Bench_CompareU32);
+    printf("%-6s calls %u  min %u  p50 %u  p90 %u  p99 %u  max %u us\n", name,
+           count, us[0], us[count / 2], us[count * 9 / 10], us[count * 99 / 100],
+           us[count - 1]);
+}
+
+static int Bench_Bulk(uint32_t n)
+{
+    DISK_StatsTypeDef ds;
+    SD_EMU_StatsTypeDef s0, s1;
+    uint64_t bytes = (uint64_t)n * 512;
+    uint64_t done;
+    uint32_t *lat;
+    uint32_t calls = 0;
+    UINT len;
+    UINT bw;
+    int err = 0;
+
+    lat = malloc(((bytes + BENCH_CHUNK - 1) / BENCH_CHUNK) * sizeof(lat[0]) + 1);
+    if(lat == NULL)
+    {
+        return 1;
+    }
+
+    err |= f_open(&fil, Bench_Path("bulk.bin"), FA_CREATE_ALWAYS | FA_WRITE);
+    disk_ioctl(0, DISK_RESET_STATS, NULL);
+    SD_EMU_ResetStats();
+    for(done = 0; done < bytes && err == 0; done += len)
+    {
+        len = (bytes - done < BENCH_CHUNK) ? (UINT)(bytes - done) : BENCH_CHUNK;
+        for(UINT i = 0; i < len; i += 4)
+        {
+            *(uint32_t *)&chunk[i] = (uint32_t)(done + i);
+        }
+        SD_EMU_GetStats(&s0);
+        err |= f_write(&fil, chunk, len, &bw);
+        SD_EMU_GetStats(&s1);
+        lat[calls++] = (uint32_t)((s1.sim_ns - s0.sim_ns) / 1000);
+    }
+    err |= f_close(&fil);
+    Bench_Phase("write", bytes);
+    disk_ioctl(0, DISK_GET_STATS, &ds);
+    printf("       device writes %u (%u sectors)\n", ds.writes, ds.write_sectors);
+    Bench_Histogram("write", ds.write_hist);
+    Bench_Percentiles("f_write", lat, calls);
+    free(lat);
+
+    err |= f_open(&fil, Bench_Path("bulk.bin"), FA_READ);
+    SD_EMU_ResetStats();
+    for(done = 0; done < bytes && err == 0; done += len)
+    {
+        len = (bytes - done < BENCH_CHUNK) ? (UINT)(bytes - done) : BENCH_CHUNK;
+        err |= f_read(&fil, chunk, len, &bw);
+        for(UINT i = 0; i < len; i += 4)
+        {
+            if(*(uint32_t *)&chunk[i] != (uint32_t)(done + i))
+            {
+                err = 1;
+                break;
+            }
+        }
+    }
+    Bench_Phase("read", bytes);
+    err |= f_close(&fil);
+    if(err != 0)
+    {
+        printf("bulk: read back failed\n");
+        return 1;
+    }
+    return 0;
+}
+
+static void Bench_Usage(void)
+{
+    fprintf(stderr, "usage: emu_bench [-c] [-d] [-g blocks] [-n count] [-p us] [-r] log|bulk\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    BYTE work[_MAX_SS];
+    uint32_t n = 0;
+    int cache = 0;
+    int opt;
+
+    SD_EMU_DefaultConfig(&cfg);
+    while((opt = getopt(argc, argv, "cdg:n:p:r")) != -1)
+    {
+        switch(opt)
+        {
+        case 'c': cache = 1; break;
+        case 'd': hspi.hdmarx = &hdma_rx; hspi.hdmatx = &hdma_tx; break;
+        case 'g': cfg.gc_interval = strtoul(optarg, NULL, 0); break;
+        case 'n': n = strtoul(optarg, NULL, 0); break;
+        case 'p': cfg.preerased_us = strtoul(optarg, NULL, 0); break;
+        case 'r': cfg.reject_acmd23 = 1; break;
+        default:  Bench_Usage();
+        }
+    }
+    if(optind != argc - 1)
+    {
+        Bench_Usage();
+    }
+
+    /* Formatted on a RAM disk, so mkfs does not go through the emulator,
+       then the image becomes the card */
+    if(RAM_DISK_Create(BENCH_SECTORS) != 0 ||
+       FATFS_LinkDriver(&RAM_DISK_Driver, path) != 0 ||
+       f_mkfs(path, FM_FAT32, 0, work, sizeof(work)) != FR_OK ||
+       FATFS_UnLinkDriver(path) != 0)
+    {
+        printf("mkfs failed\n");
+        return 1;
+    }
+    SD_EMU_Attach(RAM_DISK_GetImage(), BENCH_SECTORS, &cfg);
+    hspi.Instance = SPI1;
+    SD_SetSPIHandle(&hspi);
+    if(cache)
+    {
+        CACHE_LinkDriver(&SD_SPI_Driver, path);
+    }
+    else
+    {
+        FATFS_LinkDriver(&SD_SPI_Driver, path);
+    }
+
+    printf("SD_USE_DMA %d (%s)  SD_USE_CRC %d  SD_USE_REG_BURST %d"
+           "  SD_USE_PREERASE %d  SD_USE_WRITE_BEHIND %d  cache %s\n",
+           SD_USE_DMA, hspi.hdmarx ? "linked" : "not linked", SD_USE_CRC,
+           SD_USE_REG_BURST, SD_USE_PREERASE, SD_USE_WRITE_BEHIND,
+           cache ? "on" : "off");
+
+    if(f_mount(&fs, path, 1) != FR_OK)
+    {
+        printf("mount failed\n");
+        return 1;
+    }
+    printf("SCK %lu Hz\n", (unsigned long)SD_GetClock());
+
+    if(strcmp(argv[optind], "log") == 0)
+    {
+        return Bench_Log(n ? n : 2000);
+    }
+    if(strcmp(argv[optind], "bulk") == 0)
+    {
+        return Bench_Bulk(n ? n : 2048);
+    }
+    Bench_Usage();
+    return 2;
+}
@@ -0,0 +1,165 @@
+#define _GNU_SOURCE
+#include "host_diskio.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define DEV_FILE  0
+static volatile DSTATUS Stat = STA_NOINIT;
+
+static int fd = -1;
+static BYTE *map = NULL;            /* Whole image when opened with mmap */
+static DWORD sector_count = 0;
+static HOST_DelayTypeDef delay = {0, 0, 0};
+
+int FILE_DISK_Open(const char *path, DWORD sectors, int use_mmap) {
+    struct stat st;
+
+    FILE_DISK_Close();
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if(fd < 0) return -1;
+    
+    if(fstat(fd, &st) != 0) goto fail;
+    if(sectors != 0 && (off_t)sectors * HOST_SECTOR_SIZE > st.st_size) {
+        if(ftruncate(fd, (off_t)sectors * HOST_SECTOR_SIZE) != 0) goto fail;
+        st.st_size = (off_t)sectors * HOST_SECTOR_SIZE;
+    }
+    sector_count = st.st_size / HOST_SECTOR_SIZE;
+    if(sector_count == 0) goto fail;
+    
+    if(use_mmap) {
+        map = mmap(NULL, (size_t)sector_count * HOST_SECTOR_SIZE,
+                   PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if(map == MAP_FAILED) {
+            map = NULL;
+            goto fail;
+        }
+    }
+    return 0;
+    
+fail:
+    FILE_DISK_Close();
+    return -1;
+}
+
+void FILE_DISK_Close(void) {
+    if(map != NULL) {
+        msync(map, (size_t)sector_count * HOST_SECTOR_SIZE, MS_SYNC);
+        munmap(map, (size_t)sector_count * HOST_SECTOR_SIZE);
+        map = NULL;
+    }
+    if(fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+    sector_count = 0;
+    Stat = STA_NOINIT;
+}
+
+void FILE_DISK_SetDelay(const HOST_DelayTypeDef *d) {
+    delay = *d;
+}
+
+static DSTATUS FILE_DISK_initialize(BYTE pdrv) {
+    if(pdrv != DEV_FILE) return STA_NOINIT;
+    
+    if(fd >= 0) {
+        Stat &= ~STA_NOINIT;
+    }
+    return Stat;
+}
+
+static DSTATUS FILE_DISK_status(BYTE pdrv) {
+    if(pdrv != DEV_FILE) return STA_NOINIT;
+    return Stat;
+}
+
+static DRESULT FILE_DISK_read(BYTE pdrv, BYTE *buff, DWORD sector, UINT count) {
+    size_t len = (size_t)count * HOST_SECTOR_SIZE;
+    off_t off = (off_t)sector * HOST_SECTOR_SIZE;
+
+    if(pdrv != DEV_FILE) return RES_PARERR;
+    if(Stat & STA_NOINIT) return RES_NOTRDY;
+    if(sector >= sector_count || count > sector_count - sector) return RES_PARERR;
+    
+    HOST_DiskDelay(&delay, count);
+    if(map != NULL) {
+        memcpy(buff, map + off, len);
+        return RES_OK;
+    }
+    return (pread(fd, buff, len, off) == (ssize_t)len) ? RES_OK : RES_ERROR;
+}
+
+static DRESULT FILE_DISK_write(BYTE pdrv, const BYTE *buff, DWORD sector, UINT count) {
+    size_t len = (size_t)count * HOST_SECTOR_SIZE;
+    off_t off = (off_t)sector * HOST_SECTOR_SIZE;
+
+    if(pdrv != DEV_FILE) return RES_PARERR;
+    if(Stat & STA_NOINIT) return RES_NOTRDY;
+    if(sector >= sector_count || count > sector_count - sector) return RES_PARERR;
+    
+    HOST_DiskDelay(&delay, count);
+    if(map != NULL) {
+        memcpy(map + off, buff, len);
+        return RES_OK;
+    }
+    return (pwrite(fd, buff, len, off) == (ssize_t)len) ? RES_OK : RES_ERROR;
+}
+
+static DRESULT FILE_DISK_ioctl(BYTE pdrv, BYTE cmd, void *buff) {
+    HOST_DelayTypeDef sync_delay = {delay.sync_us, 0, 0};
+
+    if(pdrv != DEV_FILE) return RES_PARERR;
+    if(Stat & STA_NOINIT) return RES_NOTRDY;
+    
+    switch(cmd) {
+	case CTRL_SYNC:
+		HOST_DiskDelay(&sync_delay, 0);
+		if(map != NULL) {
+			return (msync(map, (size_t)sector_count * HOST_SECTOR_SIZE, MS_SYNC) == 0) ?
+				RES_OK : RES_ERROR;
+		}
+		return (fdatasync(fd) == 0) ? RES_OK : RES_ERROR;
+            
+	case GET_SECTOR_SIZE:
+		*(WORD*)buff = HOST_SECTOR_SIZE;
+		return RES_OK;
+            
+	case GET_SECTOR_COUNT:
+		*(DWORD*)buff = sector_count;
+		return RES_OK;
+            
+	case GET_BLOCK_SIZE:
+		/* Unknown erase block size */
+		*(DWORD*)buff = 1;
+		return RES_OK;
+            
+	case CTRL_TRIM:
+		/* buff: DWORD[2] = { start sector, end sector }; punch a hole so
+		   trimmed ranges read back as zeros, like an erased card */
+		if(map == NULL && fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				(off_t)((DWORD*)buff)[0] * HOST_SECTOR_SIZE,
+				(off_t)(((DWORD*)buff)[1] - ((DWORD*)buff)[0] + 1) * HOST_SECTOR_SIZE) != 0) {
+			return RES_ERROR;
+		}
+		return RES_OK;
+            
+	default:
+		return RES_PARERR;
+    }
+}
+
+const Diskio_drvTypeDef FILE_DISK_Driver = {
+    FILE_DISK_initialize,
+    FILE_DISK_status,
+    FILE_DISK_read,
+#if _USE_WRITE == 1
+    FILE_DISK_write,
+#endif
+#if _USE_IOCTL == 1
+    FILE_DISK_ioctl,
+#endif
+};
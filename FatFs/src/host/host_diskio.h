@@ -0,0 +1,75 @@
+/**
+  ******************************************************************************
+  * @file    host_diskio.h
+  * @brief   Host (Linux) diskio drivers for running FatFs and the logging
+  *          pipeline off target: a disk image file and a RAM disk.
+  ******************************************************************************
+  * @attention
+  *
+  * These files are not part of the firmware build. Compile them together
+  * with ff.c, diskio.c and ff_gen_drv.c on the host and link a driver with
+  * FATFS_LinkDriver() after FILE_DISK_Open() or RAM_DISK_Create().
+  *
+  * Every read, write and CTRL_SYNC sleeps for the configured delay, so a
+  * card's access latency can be approximated when profiling.
+  *
+  ******************************************************************************
+**/
+
+#ifndef __HOST_DISKIO_H
+#define __HOST_DISKIO_H
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+#include "ff_gen_drv.h"
+
+#include <time.h>
+
+#define HOST_SECTOR_SIZE 512
+
+/**
+  * @brief  Simulated cost of each operation, in microseconds
+  */
+typedef struct
+{
+  uint32_t op_us;         /*!< Fixed cost of every read/write call */
+  uint32_t sector_us;     /*!< Additional cost per sector transferred */
+  uint32_t sync_us;       /*!< Cost of CTRL_SYNC */
+
+}HOST_DelayTypeDef;
+
+extern const Diskio_drvTypeDef FILE_DISK_Driver;
+extern const Diskio_drvTypeDef RAM_DISK_Driver;
+
+/* Disk image file. sectors == 0 keeps the size of an existing image,
+   otherwise the image is created or grown to that many sectors. With
+   use_mmap the image is mapped and synced with msync, else pread/pwrite
+   and fdatasync are used. Returns 0 on success. */
+int  FILE_DISK_Open(const char *path, DWORD sectors, int use_mmap);
+void FILE_DISK_Close(void);
+void FILE_DISK_SetDelay(const HOST_DelayTypeDef *delay);
+
+/* Zero filled RAM disk. Returns 0 on success. */
+int  RAM_DISK_Create(DWORD sectors);
+void RAM_DISK_Free(void);
+void RAM_DISK_SetDelay(const HOST_DelayTypeDef *delay);
+BYTE *RAM_DISK_GetImage(void);
+
+static inline void HOST_DiskDelay(const HOST_DelayTypeDef *delay, UINT count)
+{
+    uint64_t us = (uint64_t)delay->op_us + (uint64_t)delay->sector_us * count;
+    struct timespec ts;
+
+    if(us == 0) return;
+    ts.tv_sec = us / 1000000;
+    ts.tv_nsec = (us % 1000000) * 1000;
+    while(nanosleep(&ts, &ts) != 0) { }
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __HOST_DISKIO_H */
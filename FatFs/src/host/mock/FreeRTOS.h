@@ -0,0 +1,21 @@
+/* Host mock of the FreeRTOS types used by the FatFs glue and sd_spi.c. */
+#ifndef __MOCK_FREERTOS_H
+#define __MOCK_FREERTOS_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef uint32_t TickType_t;
+typedef long BaseType_t;
+typedef unsigned long UBaseType_t;
+
+#define pdFALSE ((BaseType_t)0)
+#define pdTRUE  ((BaseType_t)1)
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))   /* 1 kHz tick */
+#define portMAX_DELAY     ((TickType_t)0xFFFFFFFFUL)
+#define portYIELD_FROM_ISR(x) ((void)(x))
+
+#define pvPortMalloc(size) malloc(size)
+#define vPortFree(ptr)     free(ptr)
+
+#endif /* __MOCK_FREERTOS_H */
@@ -0,0 +1,57 @@
+/* Host mock of the mutex calls made by the FatFs _FS_REENTRANT glue, on
+   POSIX mutexes, so host programs can call FatFs from several threads as
+   tasks would. Ticks are milliseconds. */
+#ifndef __MOCK_SEMPHR_H
+#define __MOCK_SEMPHR_H
+
+#include "FreeRTOS.h"
+
+#include <pthread.h>
+#include <time.h>
+
+typedef pthread_mutex_t *SemaphoreHandle_t;
+
+static inline SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    pthread_mutex_t *mutex = malloc(sizeof(*mutex));
+
+    if(mutex != NULL && pthread_mutex_init(mutex, NULL) != 0)
+    {
+        free(mutex);
+        mutex = NULL;
+    }
+    return mutex;
+}
+
+static inline BaseType_t xSemaphoreTake(SemaphoreHandle_t xSemaphore,
+                                        TickType_t xBlockTime)
+{
+    struct timespec ts;
+
+    if(xBlockTime == portMAX_DELAY)
+    {
+        return pthread_mutex_lock(xSemaphore) == 0 ? pdTRUE : pdFALSE;
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += xBlockTime / 1000;
+    ts.tv_nsec += (long)(xBlockTime % 1000) * 1000000;
+    if(ts.tv_nsec >= 1000000000)
+    {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    return pthread_mutex_timedlock(xSemaphore, &ts) == 0 ? pdTRUE : pdFALSE;
+}
+
+static inline BaseType_t xSemaphoreGive(SemaphoreHandle_t xSemaphore)
+{
+    return pthread_mutex_unlock(xSemaphore) == 0 ? pdTRUE : pdFALSE;
+}
+
+static inline void vSemaphoreDelete(SemaphoreHandle_t xSemaphore)
+{
+    pthread_mutex_destroy(xSemaphore);
+    free(xSemaphore);
+}
+
+#endif /* __MOCK_SEMPHR_H */
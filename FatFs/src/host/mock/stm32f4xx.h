@@ -0,0 +1,26 @@
+/* Host mock of the CMSIS device header: only the core registers the FatFs
+   glue touches. DWT->CYCCNT follows the SD emulator's simulated time and
+   SystemCoreClock its cpu_hz. */
+#ifndef __MOCK_STM32F4XX_H
+#define __MOCK_STM32F4XX_H
+
+#include <stdint.h>
+
+#define __IO volatile
+
+typedef struct { __IO uint32_t CTRL, CYCCNT; } DWT_Type;
+typedef struct { __IO uint32_t DHCSR, DCRSR, DCRDR, DEMCR; } CoreDebug_Type;
+
+extern uint32_t SystemCoreClock;
+extern DWT_Type mock_dwt;
+extern CoreDebug_Type mock_core_debug;
+#define DWT       (&mock_dwt)
+#define CoreDebug (&mock_core_debug)
+
+#define CoreDebug_DEMCR_TRCENA_Msk (1UL << 24)
+#define DWT_CTRL_CYCCNTENA_Msk     (1UL << 0)
+
+#define MODIFY_REG(REG, CLEARMASK, SETMASK) \
+    ((REG) = (((REG) & (~(CLEARMASK))) | (SETMASK)))
+
+#endif /* __MOCK_STM32F4XX_H */
@@ -0,0 +1,99 @@
+/* Host mock of the STM32F4 HAL: the SPI1/GPIOB/RCC/DMA subset used by
+   sd_spi.c. The SPI, DMA and timing functions are implemented by sd_emu.c,
+   which also traps accesses to the SPI1 registers. */
+#ifndef __MOCK_STM32F4XX_HAL_H
+#define __MOCK_STM32F4XX_HAL_H
+
+#include "stm32f4xx.h"
+
+#include <stddef.h>
+
+typedef enum { HAL_OK = 0, HAL_ERROR, HAL_BUSY, HAL_TIMEOUT } HAL_StatusTypeDef;
+
+typedef struct { __IO uint32_t MODER, OTYPER, OSPEEDR, PUPDR, IDR, ODR, BSRR, LCKR, AFR[2]; } GPIO_TypeDef;
+typedef struct { __IO uint32_t CR1, CR2, SR, DR, CRCPR, RXCRCR, TXCRCR, I2SCFGR, I2SPR; } SPI_TypeDef;
+
+typedef struct
+{
+    uint32_t Mode, Direction, DataSize, CLKPolarity, CLKPhase, NSS;
+    uint32_t BaudRatePrescaler, FirstBit, TIMode, CRCCalculation, CRCPolynomial;
+} SPI_InitTypeDef;
+
+typedef struct
+{
+    uint32_t Channel, Direction, PeriphInc, MemInc, PeriphDataAlignment;
+    uint32_t MemDataAlignment, Mode, Priority, FIFOMode;
+} DMA_InitTypeDef;
+
+typedef struct __DMA_HandleTypeDef
+{
+    DMA_InitTypeDef Init;
+} DMA_HandleTypeDef;
+
+typedef struct __SPI_HandleTypeDef
+{
+    SPI_TypeDef       *Instance;
+    SPI_InitTypeDef   Init;
+    DMA_HandleTypeDef *hdmatx;
+    DMA_HandleTypeDef *hdmarx;
+    uint32_t          ErrorCode;
+} SPI_HandleTypeDef;
+
+/* SPI1 sits alone in a page of its own, see sd_emu.c */
+extern GPIO_TypeDef       mock_gpiob;
+extern SPI_TypeDef *const mock_spi1;
+#define GPIOB (&mock_gpiob)
+#define SPI1  (mock_spi1)
+
+#define GPIO_PIN_6 ((uint16_t)0x0040)
+
+#define SPI_CR1_BR_Pos  3U
+#define SPI_CR1_BR      (0x7UL << SPI_CR1_BR_Pos)
+#define SPI_CR1_SPE     (1UL << 6)
+#define SPI_CR1_DFF     (1UL << 11)
+#define SPI_CR1_CRCNEXT (1UL << 12)
+#define SPI_CR1_CRCEN   (1UL << 13)
+
+#define SPI_SR_RXNE     (1UL << 0)
+#define SPI_SR_TXE      (1UL << 1)
+#define SPI_SR_CRCERR   (1UL << 4)
+#define SPI_SR_OVR      (1UL << 6)
+#define SPI_SR_BSY      (1UL << 7)
+
+#define SPI_DATASIZE_8BIT  0x00000000UL
+#define SPI_DATASIZE_16BIT SPI_CR1_DFF
+
+#define HAL_SPI_ERROR_NONE 0x00000000UL
+
+#define DMA_PDATAALIGN_HALFWORD (1UL << 11)
+#define DMA_MDATAALIGN_HALFWORD (1UL << 13)
+
+#define SPI_BAUDRATEPRESCALER_2   (0x0UL << SPI_CR1_BR_Pos)
+#define SPI_BAUDRATEPRESCALER_4   (0x1UL << SPI_CR1_BR_Pos)
+#define SPI_BAUDRATEPRESCALER_8   (0x2UL << SPI_CR1_BR_Pos)
+#define SPI_BAUDRATEPRESCALER_16  (0x3UL << SPI_CR1_BR_Pos)
+#define SPI_BAUDRATEPRESCALER_32  (0x4UL << SPI_CR1_BR_Pos)
+#define SPI_BAUDRATEPRESCALER_64  (0x5UL << SPI_CR1_BR_Pos)
+#define SPI_BAUDRATEPRESCALER_128 (0x6UL << SPI_CR1_BR_Pos)
+#define SPI_BAUDRATEPRESCALER_256 (0x7UL << SPI_CR1_BR_Pos)
+
+#define __HAL_SPI_ENABLE(h)  ((h)->Instance->CR1 |= SPI_CR1_SPE)
+#define __HAL_SPI_DISABLE(h) ((h)->Instance->CR1 &= ~SPI_CR1_SPE)
+
+HAL_StatusTypeDef HAL_SPI_TransmitReceive(SPI_HandleTypeDef *hspi, uint8_t *pTxData,
+                                          uint8_t *pRxData, uint16_t Size, uint32_t Timeout);
+HAL_StatusTypeDef HAL_SPI_Transmit(SPI_HandleTypeDef *hspi, uint8_t *pData,
+                                   uint16_t Size, uint32_t Timeout);
+HAL_StatusTypeDef HAL_SPI_TransmitReceive_DMA(SPI_HandleTypeDef *hspi, uint8_t *pTxData,
+                                              uint8_t *pRxData, uint16_t Size);
+HAL_StatusTypeDef HAL_SPI_Transmit_DMA(SPI_HandleTypeDef *hspi, uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef HAL_SPI_Abort(SPI_HandleTypeDef *hspi);
+HAL_StatusTypeDef HAL_DMA_Init(DMA_HandleTypeDef *hdma);
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi);
+void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi);
+void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *hspi);
+uint32_t HAL_RCC_GetPCLK2Freq(void);
+uint32_t HAL_GetTick(void);
+void HAL_Delay(uint32_t Delay);
+
+#endif /* __MOCK_STM32F4XX_HAL_H */
@@ -0,0 +1,35 @@
+/* Host mock of the FreeRTOS task API. Time is the SD emulator's simulated
+   time, so sleeping in vTaskDelay advances it instead of blocking. The
+   emulator runs a single task, and the only notifications it gets come
+   from the emulated DMA completion. Critical sections are real, so host
+   programs on the disk drivers may run FatFs from several threads. */
+#ifndef __MOCK_TASK_H
+#define __MOCK_TASK_H
+
+#include "FreeRTOS.h"
+
+#include <pthread.h>
+
+#define taskSCHEDULER_SUSPENDED   ((BaseType_t)0)
+#define taskSCHEDULER_NOT_STARTED ((BaseType_t)1)
+#define taskSCHEDULER_RUNNING     ((BaseType_t)2)
+
+typedef void *TaskHandle_t;
+
+/* Critical sections exclude each other across threads; they do not nest.
+   The weak definition gives every translation unit the same mutex. */
+pthread_mutex_t mock_critical __attribute__((weak)) = PTHREAD_MUTEX_INITIALIZER;
+#define taskENTER_CRITICAL() pthread_mutex_lock(&mock_critical)
+#define taskEXIT_CRITICAL()  pthread_mutex_unlock(&mock_critical)
+#define taskENTER_CRITICAL_FROM_ISR()  ((UBaseType_t)0)
+#define taskEXIT_CRITICAL_FROM_ISR(x)  ((void)(x))
+
+BaseType_t xTaskGetSchedulerState(void);
+TickType_t xTaskGetTickCount(void);
+void vTaskDelay(const TickType_t xTicksToDelay);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+uint32_t ulTaskNotifyTake(BaseType_t xClearCountOnExit, TickType_t xTicksToWait);
+void vTaskNotifyGiveFromISR(TaskHandle_t xTaskToNotify,
+                            BaseType_t *pxHigherPriorityTaskWoken);
+
+#endif /* __MOCK_TASK_H */
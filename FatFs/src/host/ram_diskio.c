@@ -0,0 +1,120 @@
+#include "host_diskio.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define DEV_RAM  0
+static volatile DSTATUS Stat = STA_NOINIT;
+
+static BYTE *image = NULL;
+static DWORD sector_count = 0;
+static HOST_DelayTypeDef delay = {0, 0, 0};
+
+int RAM_DISK_Create(DWORD sectors) {
+    RAM_DISK_Free();
+    if(sectors == 0) return -1;
+    
+    image = calloc(sectors, HOST_SECTOR_SIZE);
+    if(image == NULL) return -1;
+    sector_count = sectors;
+    return 0;
+}
+
+void RAM_DISK_Free(void) {
+    free(image);
+    image = NULL;
+    sector_count = 0;
+    Stat = STA_NOINIT;
+}
+
+void RAM_DISK_SetDelay(const HOST_DelayTypeDef *d) {
+    delay = *d;
+}
+
+/* Raw image, for inspecting or dumping what FatFs wrote */
+BYTE *RAM_DISK_GetImage(void) {
+    return image;
+}
+
+static DSTATUS RAM_DISK_initialize(BYTE pdrv) {
+    if(pdrv != DEV_RAM) return STA_NOINIT;
+    
+    if(image != NULL) {
+        Stat &= ~STA_NOINIT;
+    }
+    return Stat;
+}
+
+static DSTATUS RAM_DISK_status(BYTE pdrv) {
+    if(pdrv != DEV_RAM) return STA_NOINIT;
+    return Stat;
+}
+
+static DRESULT RAM_DISK_read(BYTE pdrv, BYTE *buff, DWORD sector, UINT count) {
+    if(pdrv != DEV_RAM) return RES_PARERR;
+    if(Stat & STA_NOINIT) return RES_NOTRDY;
+    if(sector >= sector_count || count > sector_count - sector) return RES_PARERR;
+    
+    HOST_DiskDelay(&delay, count);
+    memcpy(buff, image + (size_t)sector * HOST_SECTOR_SIZE, (size_t)count * HOST_SECTOR_SIZE);
+    return RES_OK;
+}
+
+static DRESULT RAM_DISK_write(BYTE pdrv, const BYTE *buff, DWORD sector, UINT count) {
+    if(pdrv != DEV_RAM) return RES_PARERR;
+    if(Stat & STA_NOINIT) return RES_NOTRDY;
+    if(sector >= sector_count || count > sector_count - sector) return RES_PARERR;
+    
+    HOST_DiskDelay(&delay, count);
+    memcpy(image + (size_t)sector * HOST_SECTOR_SIZE, buff, (size_t)count * HOST_SECTOR_SIZE);
+    return RES_OK;
+}
+
+static DRESULT RAM_DISK_ioctl(BYTE pdrv, BYTE cmd, void *buff) {
+    HOST_DelayTypeDef sync_delay = {delay.sync_us, 0, 0};
+
+    if(pdrv != DEV_RAM) return RES_PARERR;
+    if(Stat & STA_NOINIT) return RES_NOTRDY;
+    
+    switch(cmd) {
+	case CTRL_SYNC:
+		HOST_DiskDelay(&sync_delay, 0);
+		return RES_OK;
+            
+	case GET_SECTOR_SIZE:
+		*(WORD*)buff = HOST_SECTOR_SIZE;
+		return RES_OK;
+            
+	case GET_SECTOR_COUNT:
+		*(DWORD*)buff = sector_count;
+		return RES_OK;
+            
+	case GET_BLOCK_SIZE:
+		*(DWORD*)buff = 1;
+		return RES_OK;
+            
+	case CTRL_TRIM:
+		/* buff: DWORD[2] = { start sector, end sector }; read back as zeros */
+		if(((DWORD*)buff)[0] > ((DWORD*)buff)[1] || ((DWORD*)buff)[1] >= sector_count) {
+			return RES_PARERR;
+		}
+		memset(image + (size_t)((DWORD*)buff)[0] * HOST_SECTOR_SIZE, 0,
+		       (size_t)(((DWORD*)buff)[1] - ((DWORD*)buff)[0] + 1) * HOST_SECTOR_SIZE);
+		return RES_OK;
+            
+	default:
+		return RES_PARERR;
+    }
+}
+
+const Diskio_drvTypeDef RAM_DISK_Driver = {
+    RAM_DISK_initialize,
+    RAM_DISK_status,
+    RAM_DISK_read,
+#if _USE_WRITE == 1
+    RAM_DISK_write,
+#endif
+#if _USE_IOCTL == 1
+    RAM_DISK_ioctl,
+#endif
+};
@@ -0,0 +1,1280 @@
+/* REG_ERR, REG_EFL and REG_RIP of the signal context */
+#define _GNU_SOURCE
+
+#include "sd_emu.h"
+#include "stm32f4xx_hal.h"
+
+#include <string.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+/* Register accesses are trapped by protecting the SPI1 page and single
+   stepping the faulting instruction, which needs the x86-64 trap flag.
+   Elsewhere SPI1 is plain memory and only the HAL paths work. */
+#if defined(__linux__) && defined(__x86_64__)
+#define EMU_TRAP 1
+#include <signal.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#else
+#define EMU_TRAP 0
+#endif
+
+/* Mock peripherals named by the mock CMSIS/HAL headers */
+uint32_t       SystemCoreClock;
+GPIO_TypeDef   mock_gpiob;
+DWT_Type       mock_dwt;
+CoreDebug_Type mock_core_debug;
+
+/* SPI1 as the driver sees it. Nothing else shares its page, so the page
+   can be protected without trapping unrelated data. */
+static union
+{
+    SPI_TypeDef regs;
+    uint8_t     page[4096];
+} spi1_window __attribute__((aligned(4096)));
+
+SPI_TypeDef *const mock_spi1 = &spi1_window.regs;
+
+#define EMU_BLOCK   512
+#define EMU_NONE    0xFFFFFFFFUL
+
+/* R1 bits */
+#define R1_IDLE     0x01
+#define R1_ILLEGAL  0x04
+#define R1_CRC      0x08
+#define R1_PARAM    0x40
+
+static SD_EMU_ConfigTypeDef cfg;
+static SD_EMU_StatsTypeDef stats;
+static uint64_t now;                /* Simulated time in ns */
+static uint64_t stats_start;        /* now at the last stats reset */
+
+static uint8_t *image = NULL;
+static uint32_t sector_count = 0;
+
+/* Card state */
+static uint8_t idle = 1;
+static uint8_t app = 0;
+static uint64_t ready_at = 0;       /* ACMD41 leaves idle from here on */
+static uint64_t busy_until = 0;
+static uint32_t gc_count = 0;
+static uint32_t preerased = 0;      /* ACMD23: blocks of the next CMD25 */
+static uint32_t erase_start = 0;
+static uint32_t erase_end = 0;
+
+/* Command frame being received */
+static uint8_t cmd_buf[6];
+static uint8_t cmd_len = 0;
+
+/* Response bytes queued ahead of anything else */
+static uint8_t out_buf[16];
+static uint8_t out_len = 0;
+static uint8_t out_pos = 0;
+
+/* Data block being sent: a sector or a register */
+static uint8_t  rd_active = 0;
+static uint8_t  rd_multi = 0;
+static uint32_t rd_sector = 0;
+static const uint8_t *rd_src = NULL;
+static uint32_t rd_len = 0;
+static uint32_t rd_pos = EMU_NONE;  /* EMU_NONE: before the token */
+static uint64_t rd_ready = 0;
+static uint16_t rd_crc = 0;
+static uint8_t  reg_buf[64];
+
+/* Data block being received */
+static uint8_t  wr_mode = 0;        /* 0 none, 1 CMD24, 2 CMD25 */
+static uint32_t wr_sector = 0;
+static uint32_t wr_pos = EMU_NONE;  /* EMU_NONE: waiting for a token */
+static uint8_t  wr_buf[EMU_BLOCK + 2];
+
+static uint8_t cs_low = 0;
+static uint8_t crc_on = 0;          /* CMD59: check every command and block */
+
+/* SPI1 register state and the shifter behind DR */
+static SPI_TypeDef spi;
+static uint8_t  tx_full = 0;        /* TXE clear: a frame waits to shift */
+static uint16_t tx_frame = 0;
+static uint8_t  shifting = 0;
+static uint16_t shift_frame = 0;
+static uint64_t shift_end = 0;
+static uint8_t  rx_full = 0;        /* RXNE */
+static uint16_t rx_frame = 0;
+static uint8_t  overrun = 0;
+static uint8_t  crcerr = 0;         /* CRCERR, cleared by writing 0 to SR */
+static uint8_t  sr_polled = 0;      /* The last access read SR */
+static uint32_t sr_last = 0;
+
+/* Set by the emulated DMA completion, taken by ulTaskNotifyTake */
+static uint32_t notify_count = 0;
+
+static uint16_t Emu_CRC16(const uint8_t *buff, uint32_t len)
+{
+    uint16_t crc = 0;
+    while(len--)
+    {
+        crc ^= (uint16_t)*buff++ << 8;
+        for(int i = 0; i < 8; i++)
+        {
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+static uint8_t Emu_CRC7(const uint8_t *buff, uint32_t len)
+{
+    uint8_t crc = 0;
+    while(len--)
+    {
+        uint8_t b = *buff++;
+        for(int i = 0; i < 8; i++)
+        {
+            uint8_t bit = ((crc >> 6) ^ (b >> 7)) & 1;
+            crc = (uint8_t)((crc << 1) & 0x7F);
+            if(bit) crc ^= 0x09;
+            b <<= 1;
+        }
+    }
+    return crc;
+}
+
+static void Emu_Advance(uint64_t ns)
+{
+    now += ns;
+    stats.sim_ns = now - stats_start;
+    mock_dwt.CYCCNT = (uint32_t)((now * (cfg.cpu_hz / 1000000)) / 1000);
+}
+
+/* Queues a response after Ncr bytes of 0xFF */
+static void Emu_Respond(const uint8_t *resp, uint8_t len)
+{
+    out_len = 0;
+    out_pos = 0;
+    for(uint8_t i = 0; i < cfg.ncr_bytes; i++)
+    {
+        out_buf[out_len++] = 0xFF;
+    }
+    memcpy(&out_buf[out_len], resp, len);
+    out_len += len;
+}
+
+static void Emu_R1(uint8_t r1)
+{
+    Emu_Respond(&r1, 1);
+}
+
+/* Starts sending a data block once the access time has passed */
+static void Emu_StartRead(const uint8_t *src, uint32_t len)
+{
+    rd_active = 1;
+    rd_src = src;
+    rd_len = len;
+    rd_pos = EMU_NONE;
+    rd_ready = now + (uint64_t)cfg.read_access_us * 1000;
+    rd_crc = Emu_CRC16(src, len);
+}
+
+static void Emu_BuildCSD(void)
+{
+    uint32_t c_size = sector_count / 1024 - 1;
+
+    memset(reg_buf, 0, 16);
+    reg_buf[0] = 0x40;                  /* CSD v2.0 */
+    reg_buf[1] = 0x0E;                  /* TAAC */
+    reg_buf[3] = 0x32;                  /* TRAN_SPEED 25 MHz */
+    reg_buf[4] = 0x5B;                  /* CCC */
+    reg_buf[5] = 0x59;                  /* CCC, READ_BL_LEN 9 */
+    reg_buf[7] = (c_size >> 16) & 0x3F;
+    reg_buf[8] = (c_size >> 8) & 0xFF;
+    reg_buf[9] = c_size & 0xFF;
+    reg_buf[10] = 0x7F;                 /* ERASE_BLK_EN, SECTOR_SIZE */
+    reg_buf[11] = 0x80;
+    reg_buf[12] = 0x0A;                 /* WRITE_BL_LEN 9 */
+    reg_buf[13] = 0x40;
+    reg_buf[15] = 0x01;
+}
+
+static void Emu_BuildCID(void)
+{
+    static const uint8_t cid[16] = { 0x00, 'E', 'M', 'S', 'D', 'E', 'M', 'U',
+                                     0x10, 0x00, 0x00, 0x00, 0x01, 0x01, 0x9A,
+                                     0x01 };
+    memcpy(reg_buf, cid, 16);
+}
+
+static void Emu_BuildStatus(void)
+{
+    memset(reg_buf, 0, 64);
+    reg_buf[8] = 0x02;                  /* SPEED_CLASS 4 */
+    reg_buf[10] = 0x90;                 /* AU_SIZE 4 MiB */
+}
+
+static uint8_t Emu_InRange(uint32_t sector)
+{
+    return (image != NULL && sector < sector_count);
+}
+
+/* Acts on a complete command frame */
+static void Emu_Command(uint8_t cmd, uint32_t arg)
+{
+    uint8_t r1 = idle ? R1_IDLE : 0x00;
+    uint8_t is_app = app;
+    uint8_t resp[5];
+
+    stats.commands++;
+    app = 0;
+
+    if(is_app)
+    {
+        switch(cmd)
+        {
+        case 41:
+            if(now >= ready_at)
+            {
+                idle = 0;
+            }
+            Emu_R1(idle ? R1_IDLE : 0x00);
+            return;
+        case 13:
+            resp[0] = r1;
+            resp[1] = 0x00;
+            Emu_Respond(resp, 2);
+            Emu_BuildStatus();
+            Emu_StartRead(reg_buf, 64);
+            return;
+        case 23:
+            if(cfg.reject_acmd23)
+            {
+                Emu_R1(r1 | R1_ILLEGAL);
+                return;
+            }
+            preerased = arg & 0x7FFFFF;
+            Emu_R1(r1);
+            return;
+        default:
+            break;
+        }
+    }
+
+    if(idle && cmd != 0 && cmd != 8 && cmd != 55 && cmd != 58 && cmd != 59)
+    {
+        Emu_R1(r1 | R1_ILLEGAL);
+        return;
+    }
+
+    switch(cmd)
+    {
+    case 0:
+        idle = 1;
+        rd_active = 0;
+        wr_mode = 0;
+        crc_on = 0;
+        ready_at = now + (uint64_t)cfg.init_ms * 1000000;
+        Emu_R1(R1_IDLE);
+        break;
+
+    case 8:
+        resp[0] = r1;
+        resp[1] = 0x00;
+        resp[2] = 0x00;
+        resp[3] = (arg >> 8) & 0x0F;
+        resp[4] = arg & 0xFF;
+        Emu_Respond(resp, 5);
+        break;
+
+    case 9:
+        Emu_R1(r1);
+        Emu_BuildCSD();
+        Emu_StartRead(reg_buf, 16);
+        break;
+
+    case 10:
+        Emu_R1(r1);
+        Emu_BuildCID();
+        Emu_StartRead(reg_buf, 16);
+        break;
+
+    case 12:
+        rd_active = 0;
+        Emu_R1(r1);
+        break;
+
+    case 13:
+        resp[0] = r1;
+        resp[1] = 0x00;
+        Emu_Respond(resp, 2);
+        break;
+
+    case 17:
+    case 18:
+        if(!Emu_InRange(arg))
+        {
+            Emu_R1(r1 | R1_PARAM);
+            break;
+        }
+        Emu_R1(r1);
+        rd_multi = (cmd == 18);
+        rd_sector = arg;
+        Emu_StartRead(image + (size_t)arg * EMU_BLOCK, EMU_BLOCK);
+        break;
+
+    case 24:
+    case 25:
+        if(!Emu_InRange(arg))
+        {
+            Emu_R1(r1 | R1_PARAM);
+            break;
+        }
+        Emu_R1(r1);
+        wr_mode = (cmd == 24) ? 1 : 2;
+        wr_sector = arg;
+        wr_pos = EMU_NONE;
+        if(cmd == 24)
+        {
+            preerased = 0;
+        }
+        break;
+
+    case 32:
+        erase_start = arg;
+        Emu_R1(r1);
+        break;
+
+    case 33:
+        erase_end = arg;
+        Emu_R1(r1);
+        break;
+
+    case 38:
+        if(erase_end < erase_start || !Emu_InRange(erase_end))
+        {
+            Emu_R1(r1 | R1_PARAM);
+            break;
+        }
+        /* DATA_STAT_AFTER_ERASE = 0: erased blocks read back as zeros */
+        memset(image + (size_t)erase_start * EMU_BLOCK, 0,
+               (size_t)(erase_end - erase_start + 1) * EMU_BLOCK);
+        Emu_R1(r1);
+        busy_until = now + (uint64_t)(erase_end - erase_start + 1) * cfg.erase_us * 1000;
+        break;
+
+    case 55:
+        app = 1;
+        Emu_R1(r1);
+        break;
+
+    case 58:
+        /* Power up done and CCS (block addressing) once out of idle */
+        resp[0] = r1;
+        resp[1] = idle ? 0x00 : 0xC0;
+        resp[2] = 0xFF;
+        resp[3] = 0x80;
+        resp[4] = 0x00;
+        Emu_Respond(resp, 5);
+        break;
+
+    case 59:
+        crc_on = arg & 1;
+        Emu_R1(r1);
+        break;
+
+    default:
+        Emu_R1(r1 | R1_ILLEGAL);
+        break;
+    }
+}
+
+/* Takes one byte of a data block from the host */
+static void Emu_WriteByte(uint8_t mosi)
+{
+    uint64_t busy;
+
+    if(wr_pos == EMU_NONE)
+    {
+        if(mosi == 0xFE || mosi == 0xFC)
+        {
+            wr_pos = 0;
+        }
+        else if(mosi == 0xFD && wr_mode == 2)
+        {
+            /* Stop token: the final programming already ran per block */
+            wr_mode = 0;
+            preerased = 0;
+            busy_until = now + 1000;
+        }
+        return;
+    }
+
+    wr_buf[wr_pos++] = mosi;
+    if(wr_pos < sizeof(wr_buf))
+    {
+        return;
+    }
+
+    wr_pos = EMU_NONE;
+    if(crc_on && Emu_CRC16(wr_buf, EMU_BLOCK) !=
+       (uint16_t)((wr_buf[EMU_BLOCK] << 8) | wr_buf[EMU_BLOCK + 1]))
+    {
+        /* Data rejected for a CRC error; CMD25 waits for the next token */
+        stats.crc_errors++;
+        out_buf[0] = 0xEB;
+        out_len = 1;
+        out_pos = 0;
+        if(wr_mode == 1)
+        {
+            wr_mode = 0;
+        }
+        return;
+    }
+
+    memcpy(image + (size_t)wr_sector * EMU_BLOCK, wr_buf, EMU_BLOCK);
+    stats.blocks_written++;
+
+    /* Blocks the card was told of with ACMD23 go into pre-erased space */
+    if(wr_mode == 2 && preerased != 0)
+    {
+        preerased--;
+        busy = (uint64_t)cfg.preerased_us * 1000;
+    }
+    else
+    {
+        busy = (uint64_t)cfg.program_us * 1000;
+    }
+    if(cfg.gc_interval != 0 && ++gc_count >= cfg.gc_interval)
+    {
+        gc_count = 0;
+        stats.gc_stalls++;
+        busy += (uint64_t)cfg.gc_stall_us * 1000;
+    }
+    busy_until = now + busy;
+
+    /* Data accepted */
+    out_buf[0] = 0xE5;
+    out_len = 1;
+    out_pos = 0;
+
+    if(wr_mode == 1 || !Emu_InRange(++wr_sector))
+    {
+        wr_mode = 0;
+    }
+}
+
+/* Returns the next byte of a data block, 0xFF until the token is due */
+static uint8_t Emu_ReadByte(void)
+{
+    uint8_t b;
+
+    if(rd_pos == EMU_NONE)
+    {
+        if(now < rd_ready)
+        {
+            return 0xFF;
+        }
+        rd_pos = 0;
+        return 0xFE;
+    }
+
+    if(rd_pos < rd_len)
+    {
+        b = rd_src[rd_pos];
+    }
+    else
+    {
+        b = (rd_pos == rd_len) ? (uint8_t)(rd_crc >> 8) : (uint8_t)rd_crc;
+    }
+    rd_pos++;
+
+    if(rd_pos == rd_len + 2)
+    {
+        stats.blocks_read++;
+        if(rd_multi && rd_src != reg_buf && Emu_InRange(rd_sector + 1))
+        {
+            rd_sector++;
+            Emu_StartRead(image + (size_t)rd_sector * EMU_BLOCK, EMU_BLOCK);
+        }
+        else
+        {
+            rd_active = 0;
+        }
+    }
+    return b;
+}
+
+/* Exchanges one byte with the card: mosi in, the card's MISO out. Takes no
+   time; the callers account for the SCK periods. */
+static uint8_t Emu_Exchange(uint8_t mosi)
+{
+    uint8_t miso = 0xFF;
+    uint8_t cmd;
+
+    stats.bytes_clocked++;
+
+    if(!cs_low)
+    {
+        return 0xFF;
+    }
+
+    if(out_pos < out_len)
+    {
+        miso = out_buf[out_pos++];
+    }
+    else if(now < busy_until)
+    {
+        stats.busy_bytes++;
+        return 0x00;
+    }
+    else if(rd_active)
+    {
+        miso = Emu_ReadByte();
+    }
+
+    if(wr_mode != 0 && out_pos >= out_len)
+    {
+        Emu_WriteByte(mosi);
+        return miso;
+    }
+
+    /* Command frames are recognised at any byte outside a write, which
+       includes CMD12 arriving in the middle of a CMD18 data block */
+    if(cmd_len == 0 && (mosi & 0xC0) != 0x40)
+    {
+        return miso;
+    }
+    cmd_buf[cmd_len++] = mosi;
+    if(cmd_len == 6)
+    {
+        cmd_len = 0;
+        cmd = cmd_buf[0] & 0x3F;
+        /* CMD0 and CMD8 are checked even with CRC off */
+        if((crc_on || cmd == 0 || cmd == 8) &&
+           cmd_buf[5] != (uint8_t)((Emu_CRC7(cmd_buf, 5) << 1) | 0x01))
+        {
+            stats.crc_errors++;
+            app = 0;
+            Emu_R1((idle ? R1_IDLE : 0x00) | R1_CRC);
+            return miso;
+        }
+        Emu_Command(cmd, ((uint32_t)cmd_buf[1] << 24) |
+                    ((uint32_t)cmd_buf[2] << 16) | ((uint32_t)cmd_buf[3] << 8) |
+                    cmd_buf[4]);
+    }
+    return miso;
+}
+
+/* Bits per frame as set by CR1 DFF */
+static uint8_t Emu_FrameBits(void)
+{
+    return (spi.CR1 & SPI_CR1_DFF) ? 16 : 8;
+}
+
+/* Time to shift one frame at the prescaler in CR1 */
+static uint64_t Emu_FrameNs(void)
+{
+    uint32_t sck = cfg.pclk_hz >> (((spi.CR1 & SPI_CR1_BR) >> SPI_CR1_BR_Pos) + 1);
+    return (uint64_t)Emu_FrameBits() * 1000000000ULL / sck;
+}
+
+/* One step of the SPI CRC unit: the register is as wide as the frame and
+   takes the polynomial from CRCPR */
+static uint32_t Emu_CRCStep(uint32_t crc, uint16_t frame, uint8_t bits)
+{
+    uint32_t top = 1UL << (bits - 1);
+
+    crc ^= frame;
+    for(uint8_t i = 0; i < bits; i++)
+    {
+        crc = (crc & top) ? ((crc << 1) ^ spi.CRCPR) : (crc << 1);
+    }
+    return crc & ((top << 1) - 1);
+}
+
+/* Shifts one frame, MSB first, through the card and the CRC unit. Takes
+   no time. */
+static uint16_t Emu_Frame(uint16_t mosi)
+{
+    uint8_t bits = Emu_FrameBits();
+    uint16_t miso;
+
+    if(bits == 16)
+    {
+        miso = (uint16_t)(Emu_Exchange((uint8_t)(mosi >> 8)) << 8);
+        miso |= Emu_Exchange((uint8_t)mosi);
+    }
+    else
+    {
+        miso = Emu_Exchange((uint8_t)mosi);
+    }
+    if(spi.CR1 & SPI_CR1_CRCEN)
+    {
+        spi.TXCRCR = Emu_CRCStep(spi.TXCRCR, mosi, bits);
+        spi.RXCRCR = Emu_CRCStep(spi.RXCRCR, miso, bits);
+    }
+    return miso;
+}
+
+/* Shifts one frame in the time it takes on the wire */
+static uint16_t Emu_Clock(uint16_t mosi)
+{
+    Emu_Advance(Emu_FrameNs());
+    return Emu_Frame(mosi);
+}
+
+/* Follows CS (PB6) from the last value the driver wrote to BSRR */
+static void Emu_UpdateCS(void)
+{
+    uint8_t low = cs_low;
+
+    if(GPIOB->BSRR & ((uint32_t)GPIO_PIN_6 << 16))
+    {
+        low = 1;
+    }
+    else if(GPIOB->BSRR & GPIO_PIN_6)
+    {
+        low = 0;
+    }
+    if(cs_low && !low)
+    {
+        /* Deselecting drops a partial frame and any unread response */
+        cmd_len = 0;
+        out_len = 0;
+        out_pos = 0;
+    }
+    cs_low = low;
+}
+
+/* Register model -------------------------------------------------------------*/
+
+/* Lets time pass for one register access, completing every frame that
+   finishes meanwhile. A finished frame moves to DR unless the previous
+   one is still unread (overrun), and the next frame in the TX buffer
+   starts right behind it. */
+static void Emu_RegTick(void)
+{
+    uint64_t until = now + cfg.reg_access_ns;
+    uint16_t miso;
+
+    stats.reg_accesses++;
+    Emu_UpdateCS();
+    while(shifting && shift_end <= until)
+    {
+        if(shift_end > now)
+        {
+            Emu_Advance(shift_end - now);
+        }
+        miso = Emu_Frame(shift_frame);
+        if(rx_full)
+        {
+            overrun = 1;
+            stats.overruns++;
+        }
+        else
+        {
+            rx_frame = miso;
+            rx_full = 1;
+        }
+        shifting = 0;
+        if(tx_full)
+        {
+            shift_frame = tx_frame;
+            shift_end += Emu_FrameNs();
+            shifting = 1;
+            tx_full = 0;
+        }
+    }
+    Emu_Advance(until - now);
+}
+
+static uint32_t Emu_SR(void)
+{
+    uint32_t sr = 0;
+
+    if(rx_full) sr |= SPI_SR_RXNE;
+    if(!tx_full) sr |= SPI_SR_TXE;
+    if(overrun) sr |= SPI_SR_OVR;
+    if(crcerr) sr |= SPI_SR_CRCERR;
+    if(shifting || tx_full) sr |= SPI_SR_BSY;
+    return sr;
+}
+
+/* A frame written to DR shifts at once if the shifter is idle, otherwise
+   it waits in the TX buffer */
+static void Emu_WriteDR(uint16_t frame)
+{
+    if(!shifting)
+    {
+        shift_frame = frame;
+        shift_end = now + Emu_FrameNs();
+        shifting = 1;
+    }
+    else
+    {
+        tx_frame = frame;
+        tx_full = 1;
+    }
+}
+
+static void Emu_WriteCR1(uint32_t cr1)
+{
+    /* Setting CRCEN clears both CRC registers */
+    if((cr1 & SPI_CR1_CRCEN) && !(spi.CR1 & SPI_CR1_CRCEN))
+    {
+        spi.RXCRCR = 0;
+        spi.TXCRCR = 0;
+    }
+    spi.CR1 = cr1;
+}
+
+#if EMU_TRAP
+static SPI_TypeDef view;            /* The registers as the driver sees them */
+static volatile uint32_t trap_offset;
+static volatile uint8_t trap_write;
+
+#define EMU_OFFSET(reg) offsetof(SPI_TypeDef, reg)
+
+/* Before the access: run the shifter up to now and show the registers as
+   they are at this moment */
+static void Emu_RegBefore(uint32_t offset, uint8_t write)
+{
+    uint32_t sr;
+
+    Emu_RegTick();
+    sr = Emu_SR();
+    if(!write && offset == EMU_OFFSET(SR))
+    {
+        /* Two SR reads in a row that see the same value are a wait loop.
+           Rather than trap every iteration, run the polls here until the
+           shifter changes the flags. */
+        while(sr_polled && sr == sr_last && shifting)
+        {
+            Emu_RegTick();
+            sr = Emu_SR();
+        }
+        sr_polled = 1;
+        sr_last = sr;
+    }
+    else
+    {
+        sr_polled = 0;
+    }
+    view.CR1 = spi.CR1;
+    view.CR2 = spi.CR2;
+    view.SR = sr;
+    view.DR = rx_frame;
+    view.CRCPR = spi.CRCPR;
+    view.RXCRCR = spi.RXCRCR;
+    view.TXCRCR = spi.TXCRCR;
+}
+
+/* After the access: take what was written, or the side effect of reading
+   DR */
+static void Emu_RegAfter(uint32_t offset, uint8_t write)
+{
+    if(offset >= EMU_OFFSET(DR) && offset < EMU_OFFSET(CRCPR))
+    {
+        if(write)
+        {
+            Emu_WriteDR((uint16_t)(view.DR & ((Emu_FrameBits() == 16) ? 0xFFFF : 0xFF)));
+        }
+        else
+        {
+            rx_full = 0;
+            overrun = 0;
+        }
+    }
+    else if(offset < EMU_OFFSET(CR2))
+    {
+        Emu_WriteCR1(view.CR1);
+    }
+    else if(offset < EMU_OFFSET(SR))
+    {
+        spi.CR2 = view.CR2;
+    }
+    else if(offset < EMU_OFFSET(DR))
+    {
+        if(write && (view.SR & SPI_SR_CRCERR) == 0)
+        {
+            crcerr = 0;
+        }
+    }
+    else if(offset >= EMU_OFFSET(CRCPR) && offset < EMU_OFFSET(RXCRCR))
+    {
+        spi.CRCPR = view.CRCPR;
+    }
+}
+
+/* General register n of the ModRM/REX encoding in the signal context */
+static greg_t *Emu_Greg(ucontext_t *uc, uint8_t n)
+{
+    static const uint8_t map[16] = {
+        REG_RAX, REG_RCX, REG_RDX, REG_RBX, REG_RSP, REG_RBP, REG_RSI, REG_RDI,
+        REG_R8,  REG_R9,  REG_R10, REG_R11, REG_R12, REG_R13, REG_R14, REG_R15
+    };
+    return &uc->uc_mcontext.gregs[map[n & 15]];
+}
+
+/* Carries out the plain moves compilers use for volatile registers
+   (mov, movzx between a register and memory) without stepping them.
+   Returns 0 for anything else, which is then single stepped. */
+static uint8_t Emu_Emulate(ucontext_t *uc, uint32_t offset, uint8_t write)
+{
+    const uint8_t *ip = (const uint8_t *)uc->uc_mcontext.gregs[REG_RIP];
+    const uint8_t *p = ip;
+    uint8_t size = 4;
+    uint8_t rex = 0;
+    uint8_t store;
+    uint8_t zext = 0;
+    uint8_t modrm;
+    uint8_t reg;
+    greg_t *r;
+    uint64_t value = 0;
+
+    if(*p == 0x66)
+    {
+        size = 2;
+        p++;
+    }
+    if((*p & 0xF0) == 0x40)
+    {
+        rex = *p++;
+    }
+    if(rex & 0x08)
+    {
+        size = 8;
+    }
+    switch(*p++)
+    {
+    case 0x88: store = 1; size = 1; break;
+    case 0x89: store = 1; break;
+    case 0x8A: store = 0; size = 1; break;
+    case 0x8B: store = 0; break;
+    case 0x0F:
+        if(*p != 0xB6 && *p != 0xB7) return 0;
+        size = (*p++ == 0xB6) ? 1 : 2;
+        store = 0;
+        zext = 1;
+        break;
+    default:
+        return 0;
+    }
+    if(store != write || offset + size > sizeof(view))
+    {
+        return 0;
+    }
+    /* Only the length of the memory operand matters, the address is the
+       fault address */
+    modrm = *p++;
+    reg = (uint8_t)(((modrm >> 3) & 7) | ((rex & 0x04) << 1));
+    switch(modrm >> 6)
+    {
+    case 0:
+        if((modrm & 7) == 4)
+        {
+            /* SIB, with a disp32 instead of base 5 */
+            p += ((*p & 7) == 5) ? 5 : 1;
+        }
+        else if((modrm & 7) == 5)
+        {
+            p += 4;
+        }
+        break;
+    case 1: p += ((modrm & 7) == 4) ? 2 : 1; break;
+    case 2: p += ((modrm & 7) == 4) ? 5 : 4; break;
+    default: return 0;
+    }
+    /* Without REX, byte registers 4..7 are AH..BH */
+    if(size == 1 && rex == 0 && reg >= 4 && !zext)
+    {
+        return 0;
+    }
+
+    r = Emu_Greg(uc, reg);
+    Emu_RegBefore(offset, write);
+    if(write)
+    {
+        value = (uint64_t)*r;
+        memcpy((uint8_t *)&view + offset, &value, size);
+        Emu_RegAfter(offset, write);
+    }
+    else
+    {
+        memcpy(&value, (uint8_t *)&view + offset, size);
+        Emu_RegAfter(offset, write);
+        if(zext || size >= 4)
+        {
+            /* 32 bit destinations clear the upper half */
+            *r = (greg_t)value;
+        }
+        else
+        {
+            uint64_t mask = (size == 1) ? 0xFF : 0xFFFF;
+            *r = (greg_t)(((uint64_t)*r & ~mask) | value);
+        }
+    }
+    uc->uc_mcontext.gregs[REG_RIP] += p - ip;
+    return 1;
+}
+
+static void Emu_TrapFault(int sig, siginfo_t *si, void *context)
+{
+    ucontext_t *uc = context;
+    uintptr_t addr = (uintptr_t)si->si_addr;
+    uintptr_t base = (uintptr_t)&spi1_window;
+
+    (void)sig;
+    if(addr < base || addr >= base + sizeof(spi1_window))
+    {
+        /* A real crash: let it happen on the retry */
+        signal(SIGSEGV, SIG_DFL);
+        return;
+    }
+    trap_offset = (uint32_t)(addr - base);
+    trap_write = (uc->uc_mcontext.gregs[REG_ERR] & 0x2) != 0;
+    if(trap_offset < sizeof(view) && Emu_Emulate(uc, trap_offset, trap_write))
+    {
+        return;
+    }
+
+    /* Any other instruction runs for real on an unprotected window */
+    Emu_RegBefore(trap_offset, trap_write);
+    mprotect(&spi1_window, sizeof(spi1_window), PROT_READ | PROT_WRITE);
+    spi1_window.regs = view;
+    /* Trap flag: come back once the access has executed */
+    uc->uc_mcontext.gregs[REG_EFL] |= 0x100;
+}
+
+static void Emu_TrapStep(int sig, siginfo_t *si, void *context)
+{
+    ucontext_t *uc = context;
+
+    (void)sig;
+    (void)si;
+    uc->uc_mcontext.gregs[REG_EFL] &= ~0x100;
+    view = spi1_window.regs;
+    mprotect(&spi1_window, sizeof(spi1_window), PROT_NONE);
+    Emu_RegAfter(trap_offset, trap_write);
+}
+
+static void Emu_TrapInit(void)
+{
+    struct sigaction sa;
+
+    memset(&view, 0, sizeof(view));
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_flags = SA_SIGINFO;
+    sa.sa_sigaction = Emu_TrapFault;
+    sigaction(SIGSEGV, &sa, NULL);
+    sa.sa_sigaction = Emu_TrapStep;
+    sigaction(SIGTRAP, &sa, NULL);
+    mprotect(&spi1_window, sizeof(spi1_window), PROT_NONE);
+}
+#endif
+
+/* Runs at each HAL call. Without traps the driver's register writes land
+   in the window and are picked up here. */
+static void Emu_SyncRegs(void)
+{
+    sr_polled = 0;
+#if !EMU_TRAP
+    Emu_WriteCR1(spi1_window.regs.CR1);
+    spi.CRCPR = spi1_window.regs.CRCPR;
+    spi1_window.regs.RXCRCR = spi.RXCRCR;
+    spi1_window.regs.TXCRCR = spi.TXCRCR;
+#endif
+}
+
+void SD_EMU_DefaultConfig(SD_EMU_ConfigTypeDef *c)
+{
+    c->pclk_hz = 8000000;
+    c->cpu_hz = 8000000;
+    c->hal_call_ns = 10000;
+    c->reg_access_ns = 250;
+    c->dma_irq_ns = 30000;
+    c->ncr_bytes = 2;
+    c->init_ms = 50;
+    c->read_access_us = 300;
+    c->program_us = 700;
+    c->preerased_us = 350;
+    c->reject_acmd23 = 0;
+    c->gc_interval = 2048;
+    c->gc_stall_us = 150000;
+    c->erase_us = 2;
+}
+
+/* Inserts a card backed by image (sectors * 512 bytes, owned by the
+   caller). sectors should be a multiple of 1024 to be exactly
+   representable in the CSD. */
+void SD_EMU_Attach(uint8_t *img, uint32_t sectors, const SD_EMU_ConfigTypeDef *c)
+{
+    image = img;
+    sector_count = sectors;
+    cfg = *c;
+    SystemCoreClock = cfg.cpu_hz;
+    if(cfg.ncr_bytes < 1) cfg.ncr_bytes = 1;
+    if(cfg.ncr_bytes > 8) cfg.ncr_bytes = 8;
+
+    idle = 1;
+    app = 0;
+    crc_on = 0;
+    busy_until = 0;
+    gc_count = 0;
+    preerased = 0;
+    cmd_len = 0;
+    out_len = 0;
+    out_pos = 0;
+    rd_active = 0;
+    wr_mode = 0;
+    cs_low = 0;
+    /* CMD0 has to come first */
+    ready_at = (uint64_t)-1;
+
+    memset(&spi, 0, sizeof(spi));
+    tx_full = 0;
+    shifting = 0;
+    rx_full = 0;
+    overrun = 0;
+    crcerr = 0;
+    notify_count = 0;
+#if EMU_TRAP
+    Emu_TrapInit();
+#endif
+}
+
+void SD_EMU_GetStats(SD_EMU_StatsTypeDef *s)
+{
+    *s = stats;
+}
+
+void SD_EMU_ResetStats(void)
+{
+    memset(&stats, 0, sizeof(stats));
+    stats_start = now;
+}
+
+/* Mock HAL -----------------------------------------------------------------*/
+
+/* Polled transfers keep the CPU busy for every frame. Size counts frames,
+   which are halfwords with DFF set, as in the HAL. */
+HAL_StatusTypeDef HAL_SPI_TransmitReceive(SPI_HandleTypeDef *hspi, uint8_t *pTxData,
+                                          uint8_t *pRxData, uint16_t Size, uint32_t Timeout)
+{
+    (void)hspi;
+    (void)Timeout;
+    stats.hal_calls++;
+    Emu_SyncRegs();
+    Emu_Advance(cfg.hal_call_ns);
+    Emu_UpdateCS();
+
+    for(uint16_t i = 0; i < Size; i++)
+    {
+        /* pTxData may alias pRxData: take each frame before replacing it */
+        if(Emu_FrameBits() == 16)
+        {
+            ((uint16_t *)pRxData)[i] = Emu_Clock(((uint16_t *)pTxData)[i]);
+        }
+        else
+        {
+            pRxData[i] = (uint8_t)Emu_Clock(pTxData[i]);
+        }
+    }
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_Transmit(SPI_HandleTypeDef *hspi, uint8_t *pData,
+                                   uint16_t Size, uint32_t Timeout)
+{
+    (void)hspi;
+    (void)Timeout;
+    stats.hal_calls++;
+    Emu_SyncRegs();
+    Emu_Advance(cfg.hal_call_ns);
+    Emu_UpdateCS();
+
+    for(uint16_t i = 0; i < Size; i++)
+    {
+        (void)Emu_Clock((Emu_FrameBits() == 16) ? ((uint16_t *)pData)[i] : pData[i]);
+    }
+    return HAL_OK;
+}
+
+/* With CRCEN set, the SPI sends TXCRCR as one more frame once the DMA count
+   runs out, compares the frame it receives meanwhile with RXCRCR and sets
+   CRCERR on a mismatch. Under an RX stream that frame waits in DR; under a
+   transmit-only transfer the HAL clears it with the overrun. */
+static void Emu_DMACRC(uint8_t rx)
+{
+    uint32_t tx_crc = spi.TXCRCR;
+    uint32_t rx_crc = spi.RXCRCR;
+    uint16_t miso = Emu_Clock((uint16_t)tx_crc);
+
+    /* The CRC frame itself is not accumulated */
+    spi.TXCRCR = tx_crc;
+    spi.RXCRCR = rx_crc;
+    if(miso != rx_crc)
+    {
+        crcerr = 1;
+    }
+    if(rx)
+    {
+        rx_frame = miso;
+        rx_full = 1;
+    }
+}
+
+/* The DMA streams move the whole transfer while the CPU is free, then the
+   completion interrupt runs the HAL callback, which notifies the waiting
+   task before the start call even returns. */
+static HAL_StatusTypeDef Emu_DMA(SPI_HandleTypeDef *hspi, uint8_t *pTxData,
+                                 uint8_t *pRxData, uint16_t Size)
+{
+    uint64_t start;
+    uint16_t frame;
+
+    if(hspi->hdmatx == NULL || (pRxData != NULL && hspi->hdmarx == NULL))
+    {
+        return HAL_ERROR;
+    }
+    stats.hal_calls++;
+    Emu_SyncRegs();
+    Emu_Advance(cfg.hal_call_ns);
+    Emu_UpdateCS();
+
+    start = now;
+    for(uint16_t i = 0; i < Size; i++)
+    {
+        if(Emu_FrameBits() == 16)
+        {
+            frame = Emu_Clock(((uint16_t *)pTxData)[i]);
+            if(pRxData != NULL) ((uint16_t *)pRxData)[i] = frame;
+        }
+        else
+        {
+            frame = Emu_Clock(pTxData[i]);
+            if(pRxData != NULL) pRxData[i] = (uint8_t)frame;
+        }
+    }
+    if(spi.CR1 & SPI_CR1_CRCEN)
+    {
+        Emu_DMACRC(pRxData != NULL);
+    }
+    stats.dma_ns += now - start;
+    stats.dma_transfers++;
+
+    Emu_Advance(cfg.dma_irq_ns);
+    hspi->ErrorCode = HAL_SPI_ERROR_NONE;
+    if(pRxData != NULL)
+    {
+        HAL_SPI_TxRxCpltCallback(hspi);
+    }
+    else
+    {
+        HAL_SPI_TxCpltCallback(hspi);
+    }
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_TransmitReceive_DMA(SPI_HandleTypeDef *hspi, uint8_t *pTxData,
+                                              uint8_t *pRxData, uint16_t Size)
+{
+    return Emu_DMA(hspi, pTxData, pRxData, Size);
+}
+
+HAL_StatusTypeDef HAL_SPI_Transmit_DMA(SPI_HandleTypeDef *hspi, uint8_t *pData, uint16_t Size)
+{
+    return Emu_DMA(hspi, pData, NULL, Size);
+}
+
+HAL_StatusTypeDef HAL_SPI_Abort(SPI_HandleTypeDef *hspi)
+{
+    (void)hspi;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_DMA_Init(DMA_HandleTypeDef *hdma)
+{
+    (void)hdma;
+    return HAL_OK;
+}
+
+/* Weak like the HAL's own, for builds of sd_spi.c without SD_USE_DMA */
+__attribute__((weak)) void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    (void)hspi;
+}
+
+__attribute__((weak)) void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    (void)hspi;
+}
+
+__attribute__((weak)) void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *hspi)
+{
+    (void)hspi;
+}
+
+uint32_t HAL_RCC_GetPCLK2Freq(void)
+{
+    return cfg.pclk_hz;
+}
+
+uint32_t HAL_GetTick(void)
+{
+    return (uint32_t)(now / 1000000);
+}
+
+void HAL_Delay(uint32_t Delay)
+{
+    stats.sleep_ns += (uint64_t)Delay * 1000000;
+    Emu_Advance((uint64_t)Delay * 1000000);
+}
+
+/* Mock FreeRTOS: the driver runs as if in a task with the scheduler up */
+
+BaseType_t xTaskGetSchedulerState(void)
+{
+    return taskSCHEDULER_RUNNING;
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    return (TickType_t)(now / 1000000);
+}
+
+void vTaskDelay(const TickType_t xTicksToDelay)
+{
+    stats.sleep_ns += (uint64_t)xTicksToDelay * 1000000;
+    Emu_Advance((uint64_t)xTicksToDelay * 1000000);
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    static int task;
+    return &task;
+}
+
+/* A take without a pending notification sleeps out its timeout */
+uint32_t ulTaskNotifyTake(BaseType_t xClearCountOnExit, TickType_t xTicksToWait)
+{
+    uint32_t count = notify_count;
+
+    if(count == 0)
+    {
+        vTaskDelay(xTicksToWait);
+        return 0;
+    }
+    notify_count = xClearCountOnExit ? 0 : count - 1;
+    return count;
+}
+
+void vTaskNotifyGiveFromISR(TaskHandle_t xTaskToNotify,
+                            BaseType_t *pxHigherPriorityTaskWoken)
+{
+    (void)xTaskToNotify;
+    notify_count++;
+    if(pxHigherPriorityTaskWoken != NULL)
+    {
+        *pxHigherPriorityTaskWoken = pdTRUE;
+    }
+}
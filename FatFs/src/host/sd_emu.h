@@ -0,0 +1,111 @@
+/**
+  ******************************************************************************
+  * @file    sd_emu.h
+  * @brief   Host-side SD card emulator speaking SPI mode behind a mock HAL.
+  ******************************************************************************
+  * @attention
+  *
+  * sd_emu.c implements the SPI and DMA calls of the HAL, the SPI1
+  * registers and the few timing calls sd_spi.c makes (HAL_Delay,
+  * HAL_GetTick, vTaskDelay, xTaskGetTickCount, task notifications) against
+  * an emulated card, so the unmodified driver can run on Linux. Build
+  * sd_spi.c with the headers in host/mock on the include path and
+  *
+  *     -DSD_USE_SPIBUS=0
+  *
+  * SPI1 sits alone in a page that is kept protected. Each access by the
+  * driver faults and the emulator updates the registers. Plain mov and
+  * movzx accesses are then carried out by the fault handler; anything else
+  * is single stepped on the unprotected page. This gives the
+  * register-level paths (SD_USE_REG_BURST, SD_USE_CRC) a real TXE/RXNE/BSY
+  * pipeline, DFF and a CRC unit, at the cost of a signal per access.
+  * The trap needs x86-64 Linux; elsewhere only the HAL paths run:
+  *
+  *     -DSD_USE_CRC=0 -DSD_USE_REG_BURST=0
+  *
+  * The card checks command CRC7 and data CRC16 once CMD59 turns CRC on,
+  * and CMD0/CMD8 always. DMA is used once the SPI handle has hdmatx and
+  * hdmarx set. As on the STM32F4, a DMA transfer with CRCEN set ends with a
+  * CRC frame sent from TXCRCR; the frame received meanwhile is left in DR
+  * and checked against RXCRCR, setting CRCERR in SR on a mismatch.
+  *
+  * Time is simulated:
+  * - Every frame costs its SCK periods at the prescaler in SPI1->CR1.
+  * - Every HAL call costs hal_call_ns of CPU time and every register
+  *   access reg_access_ns.
+  * - A DMA transfer runs with the CPU free (dma_ns) and ends with an
+  *   interrupt costing dma_irq_ns.
+  * - A written block keeps the card busy for program_us, or preerased_us
+  *   when ACMD23 announced it. How much a real card gains from the hint
+  *   varies; preerased_us is an assumption, not a measurement.
+  * - Sleeping advances the clock instead of blocking (sleep_ns).
+  * The CPU is busy for sim_ns - sleep_ns - dma_ns. DWT->CYCCNT follows the
+  * simulated clock, so the diskio statistics histograms show simulated
+  * latencies.
+  *
+  ******************************************************************************
+**/
+
+#ifndef __SD_EMU_H
+#define __SD_EMU_H
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+#include <stdint.h>
+
+/**
+  * @brief  Clocks and card timing
+  */
+typedef struct
+{
+    uint32_t pclk_hz;            /*!< PCLK2 feeding the SPI1 prescaler        */
+    uint32_t cpu_hz;             /*!< Core clock counted by DWT->CYCCNT       */
+    uint32_t hal_call_ns;        /*!< CPU time of one HAL_SPI_* call          */
+    uint32_t reg_access_ns;      /*!< CPU time of one SPI1 register access    */
+    uint32_t dma_irq_ns;         /*!< DMA completion interrupt and task switch */
+    uint8_t  ncr_bytes;          /*!< 0xFF bytes before a response (1..8)     */
+    uint32_t init_ms;            /*!< CMD0 until ACMD41 reports ready         */
+    uint32_t read_access_us;     /*!< Command or previous block to data token */
+    uint32_t program_us;         /*!< Busy time after each written block      */
+    uint32_t preerased_us;       /*!< The same for blocks announced by ACMD23 */
+    uint8_t  reject_acmd23;      /*!< ACMD23 is an illegal command            */
+    uint32_t gc_interval;        /*!< Blocks written between GC stalls, 0 off */
+    uint32_t gc_stall_us;        /*!< Extra busy time of a GC stall           */
+    uint32_t erase_us;           /*!< Busy time per erased block              */
+
+} SD_EMU_ConfigTypeDef;
+
+/**
+  * @brief  What the driver cost, in bus and simulated time
+  */
+typedef struct
+{
+    uint64_t bytes_clocked;      /*!< Bytes shifted over SPI, CS high or low  */
+    uint64_t busy_bytes;         /*!< Bytes clocked while the card was busy   */
+    uint64_t sim_ns;             /*!< Simulated time since the last reset     */
+    uint64_t sleep_ns;           /*!< Part of sim_ns spent sleeping           */
+    uint64_t dma_ns;             /*!< Part of sim_ns spent waiting on DMA     */
+    uint32_t hal_calls;          /*!< HAL_SPI_* calls                         */
+    uint32_t dma_transfers;      /*!< DMA transfers started                   */
+    uint32_t reg_accesses;       /*!< SPI1 register reads and writes          */
+    uint32_t overruns;           /*!< Frames lost because DR was not read     */
+    uint32_t crc_errors;         /*!< Commands and blocks failing the CRC     */
+    uint32_t commands;           /*!< Command frames received                 */
+    uint32_t blocks_read;        /*!< Data blocks sent to the host            */
+    uint32_t blocks_written;     /*!< Data blocks programmed                  */
+    uint32_t gc_stalls;          /*!< Writes that hit a GC stall              */
+
+} SD_EMU_StatsTypeDef;
+
+void SD_EMU_DefaultConfig(SD_EMU_ConfigTypeDef *cfg);
+void SD_EMU_Attach(uint8_t *image, uint32_t sectors, const SD_EMU_ConfigTypeDef *cfg);
+void SD_EMU_GetStats(SD_EMU_StatsTypeDef *stats);
+void SD_EMU_ResetStats(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SD_EMU_H */
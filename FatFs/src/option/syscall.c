@@ -25,6 +25,14 @@
 
 
 #if _FS_REENTRANT
+/* One FreeRTOS mutex per volume. The holder inherits the priority of any
+/  task waiting for the volume. The mutex is created on the first mount and
+/  kept across f_mount() calls, so a task blocked on a volume that is being
+/  unmounted (card pulled) wakes to an error instead of waiting on a deleted
+/  object.
+*/
+static _SYNC_t volume_mutex[_VOLUMES];
+
 /*------------------------------------------------------------------------*/
 /* Create a Synchronization Object                                        */
 /*------------------------------------------------------------------------*/
@@ -39,10 +47,11 @@ int ff_cre_syncobj (	/* 1:Function succeeded
 	_SYNC_t *sobj		/* Pointer to return the created sync object */
 )
 {
-    int ret;
-	*sobj = xSemaphoreCreateMutex();
-	ret = (*sobj != NULL);
-    return ret;
+	if (volume_mutex[vol] == NULL) {
+		volume_mutex[vol] = xSemaphoreCreateMutex();
+	}
+	*sobj = volume_mutex[vol];
+	return (*sobj != NULL);
 }
 
 
@@ -53,6 +62,7 @@ int ff_cre_syncobj (	/* 1:Function succeeded
 /* This function is called in f_mount() function to delete a synchronization
 /  object that created with ff_cre_syncobj() function. When a 0 is returned,
 /  the f_mount() function fails with FR_INT_ERR.
+/  The volume mutex outlives the mount, see above.
 */
 
 int ff_del_syncobj (	/* 1:Function succeeded
@@ -60,7 +70,7 @@ int ff_del_syncobj (	/* 1:Function succeeded
 	_SYNC_t sobj		/* Sync object tied to the logical drive to be deleted */
 )
 {
-	vSemaphoreDelete(sobj);
+	(void)sobj;
 	return 1;
 }
 
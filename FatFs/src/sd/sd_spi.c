@@ -1,50 +1,340 @@
 #include "sd_spi.h"
 #include "stm32f4xx_hal.h"
 
+#include <string.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#if SD_USE_SPIBUS
+#include "spibus.h"
+#endif
+
 /* SD Commands */
 #define CMD0    0   /* GO_IDLE_STATE */
+#define CMD6    6   /* SWITCH_FUNC */
 #define CMD8    8   /* SEND_IF_COND */
+#define CMD9    9   /* SEND_CSD */
+#define CMD10   10  /* SEND_CID */
+#define CMD12   12  /* STOP_TRANSMISSION */
+#define CMD13   13  /* SEND_STATUS */
 #define CMD17   17  /* READ_SINGLE_BLOCK */
+#define CMD18   18  /* READ_MULTIPLE_BLOCK */
 #define CMD24   24  /* WRITE_BLOCK */
+#define CMD25   25  /* WRITE_MULTIPLE_BLOCK */
+#define CMD32   32  /* ERASE_WR_BLK_START */
+#define CMD33   33  /* ERASE_WR_BLK_END */
+#define CMD38   38  /* ERASE */
 #define CMD55   55  /* APP_CMD */
 #define CMD58   58  /* READ_OCR */
+#define CMD59   59  /* CRC_ON_OFF */
+#define ACMD13  13  /* SD_STATUS */
+#define ACMD23  23  /* SET_WR_BLK_ERASE_COUNT */
 #define ACMD41  41  /* SD_SEND_OP_COND */
 
+/* Longest a 512 byte DMA transfer may take before it is aborted */
+#define SD_DMA_TIMEOUT_MS 100
+/* Longest the card may stay busy programming (SDXC upper limit) */
+#define SD_WRITE_TIMEOUT_MS 500
+/* Ceiling on the erase busy timeout. The per-AU estimate for a large range
+   can run to hours; a card still busy after a day is taken as hung. */
+#define SD_ERASE_TIMEOUT_MAX_MS (24UL * 60 * 60 * 1000)
+/* Longest the card may take to send a read data token */
+#define SD_READ_TIMEOUT_MS 100
+/* Longest ACMD41 may report the card idle after power-up */
+#define SD_INIT_TIMEOUT_MS 1000
+/* Longest a wait spins before it starts sleeping, in microseconds. Short
+   next to a programming phase, so the card's busy time goes to other
+   tasks. */
+#ifndef SD_SPIN_US
+#define SD_SPIN_US 20
+#endif
+
 static SPI_HandleTypeDef *g_hspi = NULL;
 
+#if SD_USE_SPIBUS
+/* The card on the shared bus: bulk traffic, SPI mode 0, prescaler set by
+   the clock step */
+static SPIBUS_ClientTypeDef sd_client = {0};
+/* The driver clocks SPI1 itself, so it reports its traffic to the bus
+   manager */
+#define SD_COUNT_BYTES(n) SPIBUS_AddBytes(&sd_client, (n))
+#else
+#define SD_COUNT_BYTES(n)
+#endif
+
+/* SPI1 prescalers, fastest first. The index is the current clock step. */
+static const uint32_t sd_prescalers[] = {
+    SPI_BAUDRATEPRESCALER_2,   SPI_BAUDRATEPRESCALER_4,
+    SPI_BAUDRATEPRESCALER_8,   SPI_BAUDRATEPRESCALER_16,
+    SPI_BAUDRATEPRESCALER_32,  SPI_BAUDRATEPRESCALER_64,
+    SPI_BAUDRATEPRESCALER_128, SPI_BAUDRATEPRESCALER_256
+};
+#define SD_SLOWEST_STEP ((sizeof(sd_prescalers) / sizeof(sd_prescalers[0])) - 1)
+
+static uint8_t sd_clock_step = SD_SLOWEST_STEP;
+
+/* SD_SPIN_US in DWT cycles, set by SD_Init */
+static uint32_t sd_spin_cycles = 0;
+
+static SD_CardInfoTypeDef sd_info = {0};
+
+#if SD_USE_CRC
+/* CRC7 (x^7 + x^3 + 1) of every byte value, for command frames */
+static const uint8_t sd_crc7_table[256] = {
+    0x00, 0x09, 0x12, 0x1B, 0x24, 0x2D, 0x36, 0x3F,
+    0x48, 0x41, 0x5A, 0x53, 0x6C, 0x65, 0x7E, 0x77,
+    0x19, 0x10, 0x0B, 0x02, 0x3D, 0x34, 0x2F, 0x26,
+    0x51, 0x58, 0x43, 0x4A, 0x75, 0x7C, 0x67, 0x6E,
+    0x32, 0x3B, 0x20, 0x29, 0x16, 0x1F, 0x04, 0x0D,
+    0x7A, 0x73, 0x68, 0x61, 0x5E, 0x57, 0x4C, 0x45,
+    0x2B, 0x22, 0x39, 0x30, 0x0F, 0x06, 0x1D, 0x14,
+    0x63, 0x6A, 0x71, 0x78, 0x47, 0x4E, 0x55, 0x5C,
+    0x64, 0x6D, 0x76, 0x7F, 0x40, 0x49, 0x52, 0x5B,
+    0x2C, 0x25, 0x3E, 0x37, 0x08, 0x01, 0x1A, 0x13,
+    0x7D, 0x74, 0x6F, 0x66, 0x59, 0x50, 0x4B, 0x42,
+    0x35, 0x3C, 0x27, 0x2E, 0x11, 0x18, 0x03, 0x0A,
+    0x56, 0x5F, 0x44, 0x4D, 0x72, 0x7B, 0x60, 0x69,
+    0x1E, 0x17, 0x0C, 0x05, 0x3A, 0x33, 0x28, 0x21,
+    0x4F, 0x46, 0x5D, 0x54, 0x6B, 0x62, 0x79, 0x70,
+    0x07, 0x0E, 0x15, 0x1C, 0x23, 0x2A, 0x31, 0x38,
+    0x41, 0x48, 0x53, 0x5A, 0x65, 0x6C, 0x77, 0x7E,
+    0x09, 0x00, 0x1B, 0x12, 0x2D, 0x24, 0x3F, 0x36,
+    0x58, 0x51, 0x4A, 0x43, 0x7C, 0x75, 0x6E, 0x67,
+    0x10, 0x19, 0x02, 0x0B, 0x34, 0x3D, 0x26, 0x2F,
+    0x73, 0x7A, 0x61, 0x68, 0x57, 0x5E, 0x45, 0x4C,
+    0x3B, 0x32, 0x29, 0x20, 0x1F, 0x16, 0x0D, 0x04,
+    0x6A, 0x63, 0x78, 0x71, 0x4E, 0x47, 0x5C, 0x55,
+    0x22, 0x2B, 0x30, 0x39, 0x06, 0x0F, 0x14, 0x1D,
+    0x25, 0x2C, 0x37, 0x3E, 0x01, 0x08, 0x13, 0x1A,
+    0x6D, 0x64, 0x7F, 0x76, 0x49, 0x40, 0x5B, 0x52,
+    0x3C, 0x35, 0x2E, 0x27, 0x18, 0x11, 0x0A, 0x03,
+    0x74, 0x7D, 0x66, 0x6F, 0x50, 0x59, 0x42, 0x4B,
+    0x17, 0x1E, 0x05, 0x0C, 0x33, 0x3A, 0x21, 0x28,
+    0x5F, 0x56, 0x4D, 0x44, 0x7B, 0x72, 0x69, 0x60,
+    0x0E, 0x07, 0x1C, 0x15, 0x2A, 0x23, 0x38, 0x31,
+    0x46, 0x4F, 0x54, 0x5D, 0x62, 0x6B, 0x70, 0x79
+};
+
+/* CRC16-CCITT, as used by SD data blocks, for the SPI CRC unit */
+#define SD_CRC16_POLY 0x1021
+
+#if SD_USE_DMA
+/* CRC16-CCITT of every byte value, for DMA blocks. With CRCEN set the SPI
+   clocks a CRC frame of its own after a DMA transfer, so DMA blocks run
+   with the CRC unit off and their CRC is worked out in software. */
+static const uint16_t sd_crc16_table[256] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+    0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+    0x1231, 0x0210, 0x3273, 0x2252, 0x52B5, 0x4294, 0x72F7, 0x62D6,
+    0x9339, 0x8318, 0xB37B, 0xA35A, 0xD3BD, 0xC39C, 0xF3FF, 0xE3DE,
+    0x2462, 0x3443, 0x0420, 0x1401, 0x64E6, 0x74C7, 0x44A4, 0x5485,
+    0xA56A, 0xB54B, 0x8528, 0x9509, 0xE5EE, 0xF5CF, 0xC5AC, 0xD58D,
+    0x3653, 0x2672, 0x1611, 0x0630, 0x76D7, 0x66F6, 0x5695, 0x46B4,
+    0xB75B, 0xA77A, 0x9719, 0x8738, 0xF7DF, 0xE7FE, 0xD79D, 0xC7BC,
+    0x48C4, 0x58E5, 0x6886, 0x78A7, 0x0840, 0x1861, 0x2802, 0x3823,
+    0xC9CC, 0xD9ED, 0xE98E, 0xF9AF, 0x8948, 0x9969, 0xA90A, 0xB92B,
+    0x5AF5, 0x4AD4, 0x7AB7, 0x6A96, 0x1A71, 0x0A50, 0x3A33, 0x2A12,
+    0xDBFD, 0xCBDC, 0xFBBF, 0xEB9E, 0x9B79, 0x8B58, 0xBB3B, 0xAB1A,
+    0x6CA6, 0x7C87, 0x4CE4, 0x5CC5, 0x2C22, 0x3C03, 0x0C60, 0x1C41,
+    0xEDAE, 0xFD8F, 0xCDEC, 0xDDCD, 0xAD2A, 0xBD0B, 0x8D68, 0x9D49,
+    0x7E97, 0x6EB6, 0x5ED5, 0x4EF4, 0x3E13, 0x2E32, 0x1E51, 0x0E70,
+    0xFF9F, 0xEFBE, 0xDFDD, 0xCFFC, 0xBF1B, 0xAF3A, 0x9F59, 0x8F78,
+    0x9188, 0x81A9, 0xB1CA, 0xA1EB, 0xD10C, 0xC12D, 0xF14E, 0xE16F,
+    0x1080, 0x00A1, 0x30C2, 0x20E3, 0x5004, 0x4025, 0x7046, 0x6067,
+    0x83B9, 0x9398, 0xA3FB, 0xB3DA, 0xC33D, 0xD31C, 0xE37F, 0xF35E,
+    0x02B1, 0x1290, 0x22F3, 0x32D2, 0x4235, 0x5214, 0x6277, 0x7256,
+    0xB5EA, 0xA5CB, 0x95A8, 0x8589, 0xF56E, 0xE54F, 0xD52C, 0xC50D,
+    0x34E2, 0x24C3, 0x14A0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+    0xA7DB, 0xB7FA, 0x8799, 0x97B8, 0xE75F, 0xF77E, 0xC71D, 0xD73C,
+    0x26D3, 0x36F2, 0x0691, 0x16B0, 0x6657, 0x7676, 0x4615, 0x5634,
+    0xD94C, 0xC96D, 0xF90E, 0xE92F, 0x99C8, 0x89E9, 0xB98A, 0xA9AB,
+    0x5844, 0x4865, 0x7806, 0x6827, 0x18C0, 0x08E1, 0x3882, 0x28A3,
+    0xCB7D, 0xDB5C, 0xEB3F, 0xFB1E, 0x8BF9, 0x9BD8, 0xABBB, 0xBB9A,
+    0x4A75, 0x5A54, 0x6A37, 0x7A16, 0x0AF1, 0x1AD0, 0x2AB3, 0x3A92,
+    0xFD2E, 0xED0F, 0xDD6C, 0xCD4D, 0xBDAA, 0xAD8B, 0x9DE8, 0x8DC9,
+    0x7C26, 0x6C07, 0x5C64, 0x4C45, 0x3CA2, 0x2C83, 0x1CE0, 0x0CC1,
+    0xEF1F, 0xFF3E, 0xCF5D, 0xDF7C, 0xAF9B, 0xBFBA, 0x8FD9, 0x9FF8,
+    0x6E17, 0x7E36, 0x4E55, 0x5E74, 0x2E93, 0x3EB2, 0x0ED1, 0x1EF0
+};
+#endif
+#endif
+
+/* Set when a write or erase returned before the card finished programming,
+   with the longest the card may take to do so */
+static uint8_t sd_write_pending = 0;
+static uint32_t sd_busy_timeout_ms = SD_WRITE_TIMEOUT_MS;
+
+#if SD_USE_PREERASE
+/* Cleared once the card rejects CMD55 or ACMD23 as illegal, so later
+   multi-block writes skip the hint */
+static uint8_t sd_preerase = 1;
+#endif
+
+#if SD_USE_DMA
+/* Task blocked on the current DMA transfer, notified from the callbacks */
+static TaskHandle_t volatile xDMATask = NULL;
+#endif
+
+/* CS driven through BSRR so each edge is a single store */
 static void SD_CS_Low(void)
 {
-    HAL_GPIO_WritePin(GPIOB, GPIO_PIN_6, GPIO_PIN_RESET);
+#if SD_USE_SPIBUS
+    SPIBUS_Select(&sd_client);
+#else
+    SD_CS_PORT->BSRR = (uint32_t)SD_CS_PIN << 16;
+#endif
 }
 
 static void SD_CS_High(void)
 {
-    HAL_GPIO_WritePin(GPIOB, GPIO_PIN_6, GPIO_PIN_SET);
+#if SD_USE_SPIBUS
+    SPIBUS_Deselect(&sd_client);
+#else
+    SD_CS_PORT->BSRR = SD_CS_PIN;
+#endif
 }
 
 static uint8_t SD_SendByte(uint8_t byte)
 {
     uint8_t rx;
+    SD_COUNT_BYTES(1);
     HAL_SPI_TransmitReceive(g_hspi, &byte, &rx, 1, 100);
     return rx;
 }
 
+/* Sleeps about a tick with the card deselected. Once the scheduler runs
+   the task blocks, and on the shared bus SPI1 is handed to other clients
+   meanwhile. */
+static void SD_Sleep(void)
+{
+    if(xTaskGetSchedulerState() != taskSCHEDULER_RUNNING)
+	{
+        HAL_Delay(1);
+        return;
+    }
+#if SD_USE_SPIBUS
+    SPIBUS_Release(&sd_client);
+    vTaskDelay(1);
+    SPIBUS_Acquire(&sd_client, portMAX_DELAY);
+#else
+    vTaskDelay(1);
+#endif
+}
+
+/* Clocks 0xFF until the card sends something other than idle (0x00 while
+   it programs, 0xFF before a data token) and returns that byte, or idle
+   after timeout_ms. Polls spin for the first SD_SPIN_US, timed with the DWT
+   cycle counter, which covers a response or a short busy phase; after
+   that, once the scheduler runs, the task sleeps a tick between polls. A busy card may be deselected meanwhile, one about to
+   send a data token may not. CS is left asserted. */
+static uint8_t SD_WaitWhile(uint8_t idle, uint32_t timeout_ms)
+{
+    uint32_t start = HAL_GetTick();
+    uint32_t spin_start = DWT->CYCCNT;
+    uint8_t r;
+
+    while((r = SD_SendByte(0xFF)) == idle)
+	{
+        if((HAL_GetTick() - start) > timeout_ms)
+		{
+            break;
+        }
+        if((DWT->CYCCNT - spin_start) < sd_spin_cycles ||
+           xTaskGetSchedulerState() != taskSCHEDULER_RUNNING)
+		{
+            continue;
+        }
+        if(idle == 0x00)
+		{
+            /* The card keeps programming with CS high and signals busy
+               again once reselected */
+            SD_CS_High();
+            SD_SendByte(0xFF);
+            SD_Sleep();
+            SD_CS_Low();
+        }
+        else
+		{
+            vTaskDelay(1);
+        }
+    }
+    return r;
+}
+
+/* Waits for the card to release MISO (busy = 0x00). Returns 0 once the
+   card is ready, 1 on timeout. CS is left asserted. */
+static uint8_t SD_WaitReady(void)
+{
+    return (SD_WaitWhile(0x00, SD_WRITE_TIMEOUT_MS) == 0x00);
+}
+
+/* Waits out the programming phase of a write or erase that returned early.
+   Returns 0 once the card is ready, 1 on timeout. CS is left asserted. */
+static uint8_t SD_WaitWriteDone(void)
+{
+    sd_write_pending = 0;
+    SD_CS_Low();
+    return (SD_WaitWhile(0x00, sd_busy_timeout_ms) == 0x00);
+}
+
+#if SD_USE_CRC
+static uint8_t SD_CRC7(const uint8_t *buff, uint32_t len)
+{
+    uint8_t crc = 0;
+    while(len--)
+	{
+        crc = sd_crc7_table[(uint8_t)(crc << 1) ^ *buff++];
+    }
+    return crc;
+}
+
+#if SD_USE_DMA
+static uint16_t SD_CRC16(const uint8_t *buff, uint32_t len)
+{
+    uint16_t crc = 0;
+    while(len--)
+	{
+        crc = (uint16_t)((crc << 8) ^ sd_crc16_table[(crc >> 8) ^ *buff++]);
+    }
+    return crc;
+}
+#endif
+#endif
+
 static uint8_t SD_SendCommand(uint8_t cmd, uint32_t arg)
 {
     uint8_t response;
-    uint8_t crc = 0x01;
+    uint8_t frame[6];
     
-    if(cmd == CMD0) crc = 0x95;
-    else if(cmd == CMD8) crc = 0x87;
+    frame[0] = 0x40 | cmd;
+    frame[1] = (arg >> 24) & 0xFF;
+    frame[2] = (arg >> 16) & 0xFF;
+    frame[3] = (arg >> 8) & 0xFF;
+    frame[4] = arg & 0xFF;
+#if SD_USE_CRC
+    frame[5] = (SD_CRC7(frame, 5) << 1) | 0x01;
+#else
+    frame[5] = 0x01;
+    if(cmd == CMD0) frame[5] = 0x95;
+    else if(cmd == CMD8) frame[5] = 0x87;
+#endif
 	
+    /* The card cannot take a command while still programming */
+    if(sd_write_pending && SD_WaitWriteDone() != 0)
+	{
+        return 0xFF;
+    }
+    
     SD_CS_Low();
     
-    SD_SendByte(0x40 | cmd);
-    SD_SendByte((arg >> 24) & 0xFF);
-    SD_SendByte((arg >> 16) & 0xFF);
-    SD_SendByte((arg >> 8) & 0xFF);
-    SD_SendByte(arg & 0xFF);
-    SD_SendByte(crc);
+    for(int i = 0; i < 6; i++)
+	{
+        SD_SendByte(frame[i]);
+    }
+    
+    /* CMD12 is followed by a stuff byte before its response */
+    if(cmd == CMD12) SD_SendByte(0xFF);
     
     /* Wait for response */
     for(int i = 0; i < 10; i++)
@@ -56,6 +346,563 @@ static uint8_t SD_SendCommand(uint8_t cmd, uint32_t arg)
     return response;
 }
 
+#if SD_USE_DMA
+/* DMA is only used once the scheduler runs and main.c linked both streams to
+   the SPI handle. Before that the polled path is used. */
+static uint8_t SD_DMAAvailable(void)
+{
+    return (g_hspi->hdmarx != NULL) && (g_hspi->hdmatx != NULL) &&
+        (xTaskGetSchedulerState() == taskSCHEDULER_RUNNING);
+}
+
+/* Blocks the calling task until the DMA callbacks signal completion. */
+static uint8_t SD_WaitDMA(void)
+{
+    if(ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(SD_DMA_TIMEOUT_MS)) == 0)
+	{
+        HAL_SPI_Abort(g_hspi);
+        xDMATask = NULL;
+        return 1;
+    }
+    return (g_hspi->ErrorCode != HAL_SPI_ERROR_NONE);
+}
+
+static void SD_NotifyFromISR(SPI_HandleTypeDef *hspi)
+{
+    BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+
+    if(hspi != g_hspi || xDMATask == NULL) return;
+
+    vTaskNotifyGiveFromISR(xDMATask, &xHigherPriorityTaskWoken);
+    xDMATask = NULL;
+    portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
+}
+
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    SD_NotifyFromISR(hspi);
+}
+
+void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    SD_NotifyFromISR(hspi);
+}
+
+void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *hspi)
+{
+    SD_NotifyFromISR(hspi);
+}
+#endif
+
+#if SD_USE_REG_BURST
+/* Pipelined bursts keep the next frame queued behind the one shifting, so
+   each received frame must be collected within one frame time. Interrupts
+   up to configMAX_SYSCALL_INTERRUPT_PRIORITY are masked for at most
+   SD_BURST_CHUNK bytes at a time to rule out an overrun; the pipeline is
+   drained before they are unmasked. Below SD_BURST_PIPELINE_HZ (64 us per
+   chunk at most) frames go one at a time with interrupts enabled instead:
+   nothing can overrun and the gap is small next to the frame time. */
+#define SD_BURST_CHUNK        16
+#define SD_BURST_PIPELINE_HZ  2000000
+
+/* Frames per masked run at the current clock, 1 for lock-step */
+static uint32_t SD_BurstChunk(void)
+{
+    uint32_t sck = HAL_RCC_GetPCLK2Freq() >> (sd_clock_step + 1);
+    return (sck < SD_BURST_PIPELINE_HZ) ? 1 : SD_BURST_CHUNK;
+}
+#endif
+
+#if !SD_USE_CRC && SD_USE_REG_BURST
+/* Clocks len bytes through SPI1 by driving DR/TXE/RXNE directly, loading
+   the next byte as soon as TXE is set so the shifter never idles within a
+   chunk. tx == NULL sends 0xFF and rx == NULL discards the received
+   bytes. */
+static void SD_Burst(const uint8_t *tx, uint8_t *rx, uint32_t len)
+{
+    SPI_TypeDef *spi = g_hspi->Instance;
+    __IO uint8_t *dr = (__IO uint8_t *)&spi->DR;
+    uint32_t chunk = SD_BurstChunk();
+    UBaseType_t uxSavedMask = 0;
+    uint32_t end;
+    uint8_t b;
+
+    if((spi->CR1 & SPI_CR1_SPE) == 0)
+	{
+        __HAL_SPI_ENABLE(g_hspi);
+    }
+    /* Drop anything left over from a previous transfer */
+    while(spi->SR & SPI_SR_RXNE)
+	{
+        (void)*dr;
+    }
+
+    for(uint32_t pos = 0; pos < len; pos = end)
+	{
+        end = (len - pos > chunk) ? pos + chunk : len;
+        if(chunk > 1)
+		{
+            uxSavedMask = taskENTER_CRITICAL_FROM_ISR();
+        }
+
+        *dr = (tx != NULL) ? tx[pos] : 0xFF;
+        for(uint32_t i = pos + 1; i < end; i++)
+		{
+            while((spi->SR & SPI_SR_TXE) == 0) { }
+            *dr = (tx != NULL) ? tx[i] : 0xFF;
+
+            while((spi->SR & SPI_SR_RXNE) == 0) { }
+            b = *dr;
+            if(rx != NULL) rx[i - 1] = b;
+        }
+        while((spi->SR & SPI_SR_RXNE) == 0) { }
+        b = *dr;
+        if(rx != NULL) rx[end - 1] = b;
+
+        if(chunk > 1)
+		{
+            taskEXIT_CRITICAL_FROM_ISR(uxSavedMask);
+        }
+    }
+
+    while(spi->SR & SPI_SR_BSY) { }
+}
+
+#endif
+
+#if SD_USE_CRC
+/* Switches SPI1 between 8-bit frames for commands and tokens and 16-bit
+   frames with the CRC unit running for a data block. Enabling CRCEN clears
+   the CRC registers, so each block starts from a zero CRC. */
+static void SD_DataFrames16(uint8_t enable)
+{
+    __HAL_SPI_DISABLE(g_hspi);
+    if(enable)
+	{
+        g_hspi->Instance->CR1 |= SPI_CR1_DFF | SPI_CR1_CRCEN;
+        g_hspi->Init.DataSize = SPI_DATASIZE_16BIT;
+    }
+    else
+	{
+        g_hspi->Instance->CR1 &= ~(SPI_CR1_DFF | SPI_CR1_CRCEN);
+        g_hspi->Init.DataSize = SPI_DATASIZE_8BIT;
+    }
+    __HAL_SPI_ENABLE(g_hspi);
+}
+
+/* SD_Burst for 16-bit frames. Bytes are packed MSB first, so the bit order
+   on the wire is the same as for byte frames. len must be even. */
+static void SD_Burst16(const uint8_t *tx, uint8_t *rx, uint32_t len)
+{
+    SPI_TypeDef *spi = g_hspi->Instance;
+    __IO uint16_t *dr = (__IO uint16_t *)&spi->DR;
+    uint32_t frames = len / 2;
+    uint32_t chunk = (SD_BurstChunk() + 1) / 2;
+    UBaseType_t uxSavedMask = 0;
+    uint32_t end;
+    uint16_t h;
+
+    while(spi->SR & SPI_SR_RXNE)
+	{
+        (void)*dr;
+    }
+
+    for(uint32_t pos = 0; pos < frames; pos = end)
+	{
+        end = (frames - pos > chunk) ? pos + chunk : frames;
+        if(chunk > 1)
+		{
+            uxSavedMask = taskENTER_CRITICAL_FROM_ISR();
+        }
+
+        *dr = (tx != NULL) ? ((tx[2 * pos] << 8) | tx[2 * pos + 1]) : 0xFFFF;
+        for(uint32_t i = pos + 1; i < end; i++)
+		{
+            while((spi->SR & SPI_SR_TXE) == 0) { }
+            *dr = (tx != NULL) ? ((tx[2 * i] << 8) | tx[2 * i + 1]) : 0xFFFF;
+
+            while((spi->SR & SPI_SR_RXNE) == 0) { }
+            h = *dr;
+            if(rx != NULL)
+			{
+                rx[2 * i - 2] = h >> 8;
+                rx[2 * i - 1] = h & 0xFF;
+            }
+        }
+        while((spi->SR & SPI_SR_RXNE) == 0) { }
+        h = *dr;
+        if(rx != NULL)
+		{
+            rx[2 * end - 2] = h >> 8;
+            rx[2 * end - 1] = h & 0xFF;
+        }
+
+        if(chunk > 1)
+		{
+            taskEXIT_CRITICAL_FROM_ISR(uxSavedMask);
+        }
+    }
+
+    while(spi->SR & SPI_SR_BSY) { }
+}
+#endif
+
+#if SD_USE_DMA || !SD_USE_CRC
+/* Clocks the CRC16 that follows a data block in from the card */
+static uint16_t SD_RxCRC(void)
+{
+    uint16_t crc = (uint16_t)(SD_SendByte(0xFF) << 8);
+    return crc | SD_SendByte(0xFF);
+}
+#endif
+
+/* Clocks a len byte block and the CRC16 behind it in from the card. Returns
+   1 on a transfer error or, in CRC mode, on a CRC16 mismatch. Polled blocks
+   are checked by the SPI CRC unit, DMA blocks in software. */
+static uint8_t SD_RxBlock(uint8_t *buff, uint32_t len)
+{
+#if SD_USE_CRC
+    uint16_t crc;
+    uint8_t rx_crc[2];
+#endif
+
+    SD_COUNT_BYTES(len);
+#if SD_USE_DMA
+    if(SD_DMAAvailable())
+	{
+        /* The buffer doubles as the 0xFF transmit source: each byte is
+           clocked out before its received value is written back */
+        memset(buff, 0xFF, len);
+        xDMATask = xTaskGetCurrentTaskHandle();
+        if(HAL_SPI_TransmitReceive_DMA(g_hspi, buff, buff, len) != HAL_OK)
+		{
+            xDMATask = NULL;
+            return 1;
+        }
+        if(SD_WaitDMA() != 0)
+		{
+            return 1;
+        }
+#if SD_USE_CRC
+        return (SD_RxCRC() != SD_CRC16(buff, len));
+#else
+        (void)SD_RxCRC();
+        return 0;
+#endif
+    }
+#endif
+#if SD_USE_CRC
+    SD_COUNT_BYTES(2);
+    SD_DataFrames16(1);
+    SD_Burst16(NULL, buff, len);
+    crc = (uint16_t)g_hspi->Instance->RXCRCR;
+    SD_Burst16(NULL, rx_crc, 2);
+    SD_DataFrames16(0);
+    return (crc != ((rx_crc[0] << 8) | rx_crc[1]));
+#else
+#if SD_USE_REG_BURST
+    SD_Burst(NULL, buff, len);
+#else
+    memset(buff, 0xFF, len);
+    if(HAL_SPI_TransmitReceive(g_hspi, buff, buff, len, SD_DMA_TIMEOUT_MS) != HAL_OK)
+	{
+        return 1;
+    }
+#endif
+    (void)SD_RxCRC();
+    return 0;
+#endif
+}
+
+/* Clocks a 512 byte block and its CRC16 out to the card. The CRC is a
+   dummy unless CRC mode is on; the SPI CRC unit produces it for polled
+   blocks, software for DMA blocks. */
+static uint8_t SD_TxBlock(const uint8_t *buff)
+{
+    uint16_t crc = 0xFFFF;
+#if SD_USE_CRC
+    uint8_t tx_crc[2];
+#endif
+
+    SD_COUNT_BYTES(512);
+#if SD_USE_DMA
+    if(SD_DMAAvailable())
+	{
+        /* Transmit only; the HAL clears the RX overrun on completion */
+        xDMATask = xTaskGetCurrentTaskHandle();
+        if(HAL_SPI_Transmit_DMA(g_hspi, (uint8_t *)buff, 512) != HAL_OK)
+		{
+            xDMATask = NULL;
+            return 1;
+        }
+#if SD_USE_CRC
+        /* Worked out while the block goes out */
+        crc = SD_CRC16(buff, 512);
+#endif
+        if(SD_WaitDMA() != 0)
+		{
+            return 1;
+        }
+        SD_SendByte(crc >> 8);
+        SD_SendByte(crc & 0xFF);
+        return 0;
+    }
+#endif
+#if SD_USE_CRC
+    SD_COUNT_BYTES(2);
+    SD_DataFrames16(1);
+    SD_Burst16(buff, NULL, 512);
+    crc = (uint16_t)g_hspi->Instance->TXCRCR;
+    tx_crc[0] = crc >> 8;
+    tx_crc[1] = crc & 0xFF;
+    SD_Burst16(tx_crc, NULL, 2);
+    SD_DataFrames16(0);
+#else
+#if SD_USE_REG_BURST
+    SD_Burst(buff, NULL, 512);
+#else
+    if(HAL_SPI_Transmit(g_hspi, (uint8_t *)buff, 512, SD_DMA_TIMEOUT_MS) != HAL_OK)
+	{
+        return 1;
+    }
+#endif
+    SD_SendByte(crc >> 8);
+    SD_SendByte(crc & 0xFF);
+#endif
+    return 0;
+}
+
+/* Waits for the 0xFE start token and reads a len byte data block plus its
+   CRC. Returns 0 on success, 1 on timeout or, in CRC mode, on a CRC16
+   mismatch. CS is left asserted. */
+static uint8_t SD_ReceiveData(uint8_t *buff, uint32_t len)
+{
+    // Wait for data token (0xFE); an error token ends the wait too
+    if(SD_WaitWhile(0xFF, SD_READ_TIMEOUT_MS) != 0xFE)
+	{
+        return 1;
+    }
+    
+    // Read data and CRC
+    return SD_RxBlock(buff, len);
+}
+
+#if SD_USE_CRC
+/* Loads the CRC16 polynomial into the SPI CRC unit. The HAL CRC option
+   stays disabled: CRC is enabled around polled data blocks only. */
+static void SD_InitCRC(void)
+{
+    __HAL_SPI_DISABLE(g_hspi);
+    g_hspi->Instance->CRCPR = SD_CRC16_POLY;
+    __HAL_SPI_ENABLE(g_hspi);
+}
+#endif
+
+/* Reprograms the SPI1 baud rate divider. Only called between transactions,
+   with CS released. */
+static void SD_SetClockStep(uint8_t step)
+{
+    sd_clock_step = step;
+#if SD_USE_SPIBUS
+    sd_client.prescaler = sd_prescalers[step];
+    SPIBUS_Configure(&sd_client);
+#else
+    g_hspi->Init.BaudRatePrescaler = sd_prescalers[step];
+    
+    __HAL_SPI_DISABLE(g_hspi);
+    MODIFY_REG(g_hspi->Instance->CR1, SPI_CR1_BR, sd_prescalers[step]);
+    __HAL_SPI_ENABLE(g_hspi);
+#endif
+}
+
+/* Reads the OCR register with CMD58. */
+static uint8_t SD_ReadOCR(uint32_t *ocr)
+{
+    uint8_t response = SD_SendCommand(CMD58, 0);
+    
+    *ocr = 0;
+    for(int i = 0; i < 4; i++)
+	{
+        *ocr = (*ocr << 8) | SD_SendByte(0xFF);
+    }
+    SD_CS_High();
+    SD_SendByte(0xFF);
+    
+    return (response != 0x00);
+}
+
+/* Issues CMD6 in check (mode = 0) or switch (mode = 1) mode for the high
+   speed function of group 1 and reads back the 64 byte status block. */
+static uint8_t SD_SwitchHighSpeed(uint8_t mode, uint8_t *status)
+{
+    uint32_t arg = ((uint32_t)mode << 31) | 0x00FFFFF1;
+    
+    if(SD_SendCommand(CMD6, arg) != 0x00)
+	{
+        SD_CS_High();
+        SD_SendByte(0xFF);
+        return 1;
+    }
+    if(SD_ReceiveData(status, 64) != 0)
+	{
+        SD_CS_High();
+        SD_SendByte(0xFF);
+        return 1;
+    }
+    SD_CS_High();
+    SD_SendByte(0xFF);
+    
+    return 0;
+}
+
+/* Runs once the card has left the idle state. Negotiates high speed mode if
+   the card offers it, then raises SPI1 to the fastest prescaler within both
+   the card's limit and SD_SPI_MAX_CLOCK_HZ. Each step is verified by reading
+   the OCR back and comparing it with the value read at init speed; a
+   mismatch drops to the next slower prescaler. */
+static uint8_t SD_RampClock(void)
+{
+    uint8_t status[64];
+    uint32_t ocr_ref;
+    uint32_t ocr;
+    uint32_t card_max = 25000000; /* default speed */
+    uint32_t pclk = HAL_RCC_GetPCLK2Freq();
+    uint8_t step;
+    
+    if(SD_ReadOCR(&ocr_ref) != 0)
+	{
+        return 1;
+    }
+    sd_info.ocr = ocr_ref;
+    
+    /* Bit 401 of the status: group 1 function 1 (high speed) supported.
+       Bits 379:376: function group 1 selected after the switch. */
+    if(SD_SwitchHighSpeed(0, status) == 0 && (status[13] & 0x02))
+	{
+        if(SD_SwitchHighSpeed(1, status) == 0 && (status[16] & 0x0F) == 1)
+		{
+            card_max = 50000000;
+        }
+    }
+    if(card_max > SD_SPI_MAX_CLOCK_HZ)
+	{
+        card_max = SD_SPI_MAX_CLOCK_HZ;
+    }
+    
+    /* SCK = PCLK2 / 2^(step + 1) */
+    for(step = 0; step < SD_SLOWEST_STEP; step++)
+	{
+        if((pclk >> (step + 1)) <= card_max) break;
+    }
+    
+    for( ; step < SD_SLOWEST_STEP; step++)
+	{
+        SD_SetClockStep(step);
+        if(SD_ReadOCR(&ocr) == 0 && ocr == ocr_ref)
+		{
+            return 0;
+        }
+    }
+    SD_SetClockStep(SD_SLOWEST_STEP);
+    
+    return 0;
+}
+
+/* Reads a register that is returned as a data block after an R1 response
+   (CSD, CID) or, for app commands, after an R2 response (SD status). */
+static uint8_t SD_ReadRegister(uint8_t cmd, uint8_t app, uint8_t *buff,
+                               uint32_t len)
+{
+    uint8_t err = 0;
+    
+    if(app)
+	{
+        SD_SendCommand(CMD55, 0);
+        SD_CS_High();
+        SD_SendByte(0xFF);
+    }
+    if(SD_SendCommand(cmd, 0) != 0x00)
+	{
+        err = 1;
+    }
+    else
+	{
+        /* Second byte of the R2 response */
+        if(app) SD_SendByte(0xFF);
+        err = SD_ReceiveData(buff, len);
+    }
+    SD_CS_High();
+    SD_SendByte(0xFF);
+    
+    return err;
+}
+
+/* Reads CSD, CID and SD status and derives the card geometry from them. */
+static uint8_t SD_ReadCardInfo(void)
+{
+    const uint8_t *csd = sd_info.csd;
+    uint32_t c_size;
+    uint8_t au;
+    
+    if(SD_ReadRegister(CMD9, 0, sd_info.csd, 16) != 0 ||
+       SD_ReadRegister(CMD10, 0, sd_info.cid, 16) != 0)
+	{
+        return 1;
+    }
+    
+    if((csd[0] >> 6) == 1)
+	{
+        /* CSD v2.0 (SDHC/SDXC): capacity = (C_SIZE + 1) * 512 KiB */
+        c_size = ((uint32_t)(csd[7] & 0x3F) << 16) |
+            ((uint32_t)csd[8] << 8) | csd[9];
+        sd_info.sector_count = (c_size + 1) << 10;
+    }
+    else
+	{
+        /* CSD v1.0 (SDSC): (C_SIZE + 1) << (C_SIZE_MULT + 2) blocks of
+           2^READ_BL_LEN bytes */
+        uint8_t read_bl_len = csd[5] & 0x0F;
+        uint8_t c_size_mult = ((csd[9] & 0x03) << 1) | (csd[10] >> 7);
+        c_size = ((uint32_t)(csd[6] & 0x03) << 10) |
+            ((uint32_t)csd[7] << 2) | (csd[8] >> 6);
+        sd_info.sector_count =
+            (c_size + 1) << (c_size_mult + 2 + read_bl_len - 9);
+    }
+    
+    /* Erase unit: the AU from the SD status where the card reports one,
+       otherwise the CSD v1.0 SECTOR_SIZE field */
+    sd_info.erase_block = 1;
+    if(SD_ReadRegister(ACMD13, 1, sd_info.sd_status, 64) == 0 &&
+       (au = sd_info.sd_status[10] >> 4) != 0)
+	{
+        /* AU_SIZE 1..9 = 16 KiB << (n - 1); 0xA..0xF = 8, 12, 16, 24, 32
+           and 64 MiB (SDXC) */
+        static const uint32_t au_ext[] = { 16384, 24576, 32768, 49152,
+                                           65536, 131072 };
+        if(au <= 9)
+		{
+            sd_info.erase_block = 32UL << (au - 1);
+        }
+        else
+		{
+            sd_info.erase_block = au_ext[au - 10];
+        }
+    }
+    else if((csd[0] >> 6) == 0)
+	{
+        /* (SECTOR_SIZE + 1) write blocks of 2^WRITE_BL_LEN bytes, scaled
+           to 512 byte sectors */
+        uint8_t write_bl_len = ((csd[12] & 0x03) << 2) | (csd[13] >> 6);
+        sd_info.erase_block = (((csd[10] & 0x3F) << 1) | (csd[11] >> 7)) + 1;
+        if(write_bl_len > 9)
+		{
+            sd_info.erase_block <<= write_bl_len - 9;
+        }
+    }
+    
+    return 0;
+}
+
 uint8_t SD_Init(void)
 {
 	uint8_t response = 0xFF;
@@ -65,6 +912,24 @@ uint8_t SD_Init(void)
 	{
 		for( ; ; ) { }
 	}
+    /* A new or reset card has nothing left to program */
+    sd_write_pending = 0;
+    
+    /* Waits time their spin with the cycle counter */
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+    sd_spin_cycles = (SystemCoreClock / 1000000) * SD_SPIN_US;
+#if SD_USE_PREERASE
+    sd_preerase = 1;
+#endif
+    
+    /* Identification must run at <= 400 kHz */
+    SD_SetClockStep(SD_SLOWEST_STEP);
+    
+#if SD_USE_CRC
+    SD_InitCRC();
+#endif
+    
     /* Power-up sequence */
     SD_CS_High();
     for(int i = 0; i < 10; i++)
@@ -91,9 +956,20 @@ uint8_t SD_Init(void)
     SD_CS_High();
     SD_SendByte(0xFF);
     
+#if SD_USE_CRC
+    /* CMD59: turn on CRC checking of commands and data */
+    response = SD_SendCommand(CMD59, 1);
+    SD_CS_High();
+    SD_SendByte(0xFF);
+    if(response != 0x01)
+	{
+        return 1;
+    }
+#endif
+    
     // ACMD41: Initialize
-    uint16_t timeout = 1000;
-    while(timeout--)
+    uint32_t start = HAL_GetTick();
+    while((HAL_GetTick() - start) < SD_INIT_TIMEOUT_MS)
 	{
         SD_SendCommand(CMD55, 0);
         SD_CS_High();
@@ -103,11 +979,15 @@ uint8_t SD_Init(void)
 		{
             SD_CS_High();
             SD_SendByte(0xFF);
-            return 0;  // Success
+            if(SD_RampClock() != 0)
+			{
+                return 1;
+            }
+            return SD_ReadCardInfo();  // Success
         }
         SD_CS_High();
         SD_SendByte(0xFF);
-        HAL_Delay(1);
+        SD_Sleep();
     }
 
 	return 1; /* Timeout */
@@ -121,27 +1001,95 @@ uint8_t SD_ReadSingleBlock(uint8_t *buff, uint32_t sector)
         return 1;
     }
     
-    // Wait for data token (0xFE)
-    uint16_t timeout = 1000;
-    while(SD_SendByte(0xFF) != 0xFE)
+    if(SD_ReceiveData(buff, 512) != 0)
+	{
+        SD_CS_High();
+        return 1;
+    }
+    
+    SD_CS_High();
+    SD_SendByte(0xFF);
+    
+    return 0;
+}
+
+/* Reads count consecutive blocks starting at sector as a single CMD18
+   transaction, terminated with CMD12. */
+uint8_t SD_ReadMultiBlock(uint8_t *buff, uint32_t sector, uint32_t count)
+{
+    uint8_t err = 0;
+
+    if(SD_SendCommand(CMD18, sector) != 0x00)
+	{
+        SD_CS_High();
+        return 1;
+    }
+
+    while(count--)
 	{
-        if(--timeout == 0)
+        if(SD_ReceiveData(buff, 512) != 0)
 		{
-            SD_CS_High();
-            return 1;
+            err = 1;
+            break;
         }
+        buff += 512;
     }
+
+    /* STOP_TRANSMISSION is R1b: wait out the busy phase as well */
+    if(SD_SendCommand(CMD12, 0) != 0x00)
+	{
+        err = 1;
+    }
+    if(SD_WaitReady() != 0)
+	{
+        err = 1;
+    }
+
+    SD_CS_High();
+    SD_SendByte(0xFF);
+
+    return err;
+}
+
+/* Sends token, one 512 byte data block and its CRC, then reads the data
+   response. Returns 0 if the card accepted the block, 1 otherwise. The busy
+   phase that follows is left to the caller. CS is left asserted. */
+static uint8_t SD_TransmitDataBlock(const uint8_t *buff, uint8_t token)
+{
+    // Send data token
+    SD_SendByte(token);
     
-    // Read 512 bytes
-    for(int i = 0; i < 512; i++)
+    // Write 512 bytes and the CRC (dummy unless CRC mode is on)
+    if(SD_TxBlock(buff) != 0)
 	{
-        buff[i] = SD_SendByte(0xFF);
+        return 1;
     }
     
-    // Read CRC (ignore)
-    SD_SendByte(0xFF);
-    SD_SendByte(0xFF);
+    // Check response
+    uint8_t response = SD_SendByte(0xFF);
+    if((response & 0x1F) != 0x05)
+	{
+        return 1;
+    }
     
+    return 0;
+}
+
+/* Finishes a write once the card accepted the data. In write-behind mode the
+   busy phase is left to the next command or SD_Sync; otherwise it is waited
+   out here. Releases CS. */
+static uint8_t SD_EndWrite(void)
+{
+#if SD_USE_WRITE_BEHIND
+    sd_write_pending = 1;
+    sd_busy_timeout_ms = SD_WRITE_TIMEOUT_MS;
+#else
+    if(SD_WaitReady() != 0)
+	{
+        SD_CS_High();
+        return 1;
+    }
+#endif
     SD_CS_High();
     SD_SendByte(0xFF);
     
@@ -156,46 +1104,233 @@ uint8_t SD_WriteSingleBlock(const uint8_t *buff, uint32_t sector)
         return 1;
     }
     
-    // Send data token
-    SD_SendByte(0xFE);
-    
-    // Write 512 bytes
-    for(int i = 0; i < 512; i++)
+    if(SD_TransmitDataBlock(buff, 0xFE) != 0)
 	{
-        SD_SendByte(buff[i]);
+        SD_CS_High();
+        return 1;
     }
     
-    // Send dummy CRC
-    SD_SendByte(0xFF);
+    return SD_EndWrite();
+}
+
+#if SD_USE_PREERASE
+/* Tells the card how many blocks follow so it can pre-erase them instead of
+   doing read-modify-write. ACMD23 is only sent once CMD55 is accepted. A
+   card that rejects either as illegal is not asked again until SD_Init;
+   other failures skip the hint for this write only. */
+static void SD_PreErase(uint32_t count)
+{
+    uint8_t response;
+
+    response = SD_SendCommand(CMD55, 0);
+    SD_CS_High();
     SD_SendByte(0xFF);
-    
-    // Check response
-    uint8_t response = SD_SendByte(0xFF);
-    if((response & 0x1F) != 0x05)
+    if(response == 0x00 || response == 0x01)
+	{
+        response = SD_SendCommand(ACMD23, count & 0x7FFFFF);
+        SD_CS_High();
+        SD_SendByte(0xFF);
+    }
+    if((response & 0x80) == 0 && (response & 0x04) != 0)
+	{
+        sd_preerase = 0;
+    }
+}
+#endif
+
+/* Writes count consecutive blocks starting at sector as a single CMD25
+   transaction, announced with ACMD23 when SD_USE_PREERASE is set and the
+   card takes it. Each block is preceded by the 0xFC token and the transfer
+   is terminated with the 0xFD stop token. */
+uint8_t SD_WriteMultiBlock(const uint8_t *buff, uint32_t sector, uint32_t count)
+{
+#if SD_USE_PREERASE
+    if(sd_preerase)
+	{
+        SD_PreErase(count);
+    }
+#endif
+
+    if(SD_SendCommand(CMD25, sector) != 0x00)
 	{
         SD_CS_High();
         return 1;
     }
-    
-    // Wait for write to complete
-    uint16_t timeout = 1000;
-    while(SD_SendByte(0xFF) == 0x00)
+
+    while(count--)
 	{
-        if(--timeout == 0)
+        /* At least one byte of gap before the data token */
+        SD_SendByte(0xFF);
+
+        if(SD_TransmitDataBlock(buff, 0xFC) != 0)
+		{
+            /* Data rejected: stop the transfer before releasing the card */
+            SD_SendByte(0xFD);
+            SD_WaitReady();
+            SD_CS_High();
+            return 1;
+        }
+
+        if(SD_WaitReady() != 0)
 		{
             SD_CS_High();
             return 1;
         }
+        buff += 512;
     }
+
+    /* Stop transmission token, then the final programming */
+    SD_SendByte(0xFD);
+    SD_SendByte(0xFF);
+
+    return SD_EndWrite();
+}
+
+/* Erases sectors start..end (inclusive) with CMD32/CMD33/CMD38. The card
+   may take a long time to erase; the busy phase is deferred like a
+   write-behind write and bounded by the erase timeout the card reports in
+   its SD status. */
+uint8_t SD_Erase(uint32_t start, uint32_t end)
+{
+    const uint8_t *st = sd_info.sd_status;
+    uint32_t erase_size = ((uint32_t)st[11] << 8) | st[12];
+    uint32_t erase_timeout = st[13] >> 2;
+    uint32_t erase_offset = st[13] & 0x03;
+    uint32_t n_au;
+    uint64_t timeout_ms;
+    uint8_t response;
+    
+    if(end < start)
+	{
+        return 1;
+    }
+    
+    response = SD_SendCommand(CMD32, start);
+    SD_CS_High();
+    SD_SendByte(0xFF);
+    if(response == 0x00)
+	{
+        response = SD_SendCommand(CMD33, end);
+        SD_CS_High();
+        SD_SendByte(0xFF);
+    }
+    if(response == 0x00)
+	{
+        response = SD_SendCommand(CMD38, 0);
+        SD_CS_High();
+        SD_SendByte(0xFF);
+    }
+    if(response != 0x00)
+	{
+        return 1;
+    }
+    
+    /* ERASE_TIMEOUT seconds per ERASE_SIZE AUs plus ERASE_OFFSET; cards
+       that leave these fields zero get 250 ms per AU. n_au counts sectors
+       when the card reports no erase block, so the product is worked out
+       in 64 bits and capped. */
+    n_au = (end - start) / sd_info.erase_block + 1;
+    if(erase_size != 0 && erase_timeout != 0)
+	{
+        timeout_ms = (((uint64_t)n_au * erase_timeout) / erase_size
+                      + erase_offset + 1) * 1000;
+    }
+    else
+	{
+        timeout_ms = ((uint64_t)n_au + 1) * 250;
+    }
+    sd_busy_timeout_ms = (timeout_ms > SD_ERASE_TIMEOUT_MAX_MS) ?
+                         SD_ERASE_TIMEOUT_MAX_MS : (uint32_t)timeout_ms;
+    sd_write_pending = 1;
+    
+    return 0;
+}
+
+/* Waits for any deferred write or erase to finish programming and checks
+   the card status with CMD13 so programming errors are reported. */
+uint8_t SD_Sync(void)
+{
+    uint8_t r1;
+    uint8_t r2;
     
+    if(!sd_write_pending)
+	{
+        return 0;
+    }
+    r1 = SD_SendCommand(CMD13, 0);
+    r2 = SD_SendByte(0xFF);
     SD_CS_High();
     SD_SendByte(0xFF);
     
+    return (r1 != 0x00 || r2 != 0x00);
+}
+
+/* Drops SPI1 one prescaler step after a transfer error. Returns 1 if the
+   clock is already at its slowest setting. */
+uint8_t SD_StepDownClock(void)
+{
+    if(sd_clock_step >= SD_SLOWEST_STEP)
+	{
+        return 1;
+    }
+    SD_SetClockStep(sd_clock_step + 1);
     return 0;
 }
 
+/* Returns the registers and geometry read during SD_Init. */
+const SD_CardInfoTypeDef *SD_GetCardInfo(void)
+{
+    return &sd_info;
+}
 
+/* Returns the current SCK frequency in Hz. */
+uint32_t SD_GetClock(void)
+{
+    return HAL_RCC_GetPCLK2Freq() >> (sd_clock_step + 1);
+}
+
+/* With SD_USE_SPIBUS the handle must be the one given to SPIBUS_Init; the
+   card is registered as a bus client on the first call. */
 void SD_SetSPIHandle(SPI_HandleTypeDef *hspi)
 {
     g_hspi = hspi;
+#if SD_USE_SPIBUS
+    if(sd_client.grant == NULL)
+	{
+        sd_client.cs_port   = SD_CS_PORT;
+        sd_client.cs_pin    = SD_CS_PIN;
+        sd_client.prescaler = sd_prescalers[sd_clock_step];
+        sd_client.mode      = SPI_POLARITY_LOW | SPI_PHASE_1EDGE;
+        sd_client.priority  = SPIBUS_PRIO_BULK;
+        SPIBUS_Register(&sd_client);
+    }
+#endif
+}
+
+/* Claims SPI1 for one diskio operation; every SD_ call that touches the
+   card runs between SD_Lock and SD_Unlock. Returns 0 once the bus is held.
+   Without the bus manager there is nothing to claim. */
+uint8_t SD_Lock(void)
+{
+#if SD_USE_SPIBUS
+    return SPIBUS_Acquire(&sd_client, portMAX_DELAY);
+#else
+    return 0;
+#endif
+}
+
+void SD_Unlock(void)
+{
+#if SD_USE_SPIBUS
+    SPIBUS_Release(&sd_client);
+#endif
+}
+
+#if SD_USE_SPIBUS
+/* Copies the card's bus accounting: grants, time held and waited, and
+   bytes clocked. */
+void SD_GetBusStats(SPIBUS_StatsTypeDef *out)
+{
+    SPIBUS_GetStats(&sd_client, out);
 }
+#endif
@@ -3,9 +3,98 @@
 #ifndef SD_SPI_H
 #define SD_SPI_H
 
+/* When 1, the 512 byte data phase of each block runs on the SPI1 DMA streams
+   and the calling task blocks on a task notification until it completes.
+   When 0, or while no DMA stream is linked, blocks go through the polled
+   register-level burst engine instead. Throughput is the same either way,
+   as SCK is the limit; DMA frees the CPU for the data phase (about half of
+   a bulk write and two thirds of a bulk read on "emu_bench -d bulk"). */
+#ifndef SD_USE_DMA
+#define SD_USE_DMA 1
+#endif
+
+/* When 1, multi-block writes are preceded by ACMD23 with the block count so
+   the card can pre-erase the run. A card that rejects the command is not
+   sent it again until the next SD_Init. */
+#ifndef SD_USE_PREERASE
+#define SD_USE_PREERASE 1
+#endif
+
+/* When 1, writes return as soon as the card accepts the data. The busy phase
+   is waited out, yielding to the scheduler, before the next command or in
+   SD_Sync. */
+#ifndef SD_USE_WRITE_BEHIND
+#define SD_USE_WRITE_BEHIND 1
+#endif
+
+/* When 1, CMD59 turns on CRC checking. Commands carry a table-driven CRC7
+   and data blocks a CRC16, produced and checked by the SPI1 CRC unit for
+   polled blocks and by a table-driven CRC16 for DMA blocks. */
+#ifndef SD_USE_CRC
+#define SD_USE_CRC 1
+#endif
+
+/* When 1, polled data blocks are clocked by driving the SPI1 registers
+   directly. When 0 they go through HAL_SPI_TransmitReceive/HAL_SPI_Transmit.
+   CRC mode relies on the register path. */
+#ifndef SD_USE_REG_BURST
+#define SD_USE_REG_BURST 1
+#endif
+
+#if SD_USE_CRC && !SD_USE_REG_BURST
+#error "SD_USE_CRC requires SD_USE_REG_BURST"
+#endif
+
+/* When 1, the card is a client of the shared SPI1 bus manager (spibus.c):
+   each diskio call holds the bus between SD_Lock and SD_Unlock and the
+   bus is handed to other devices while the card programs. When 0 the
+   driver owns SPI1 outright, as in host builds against the card emulator. */
+#ifndef SD_USE_SPIBUS
+#define SD_USE_SPIBUS 1
+#endif
+
+#if SD_USE_SPIBUS
+#include "spibus.h"
+#endif
+
+/* Card chip select */
+#ifndef SD_CS_PORT
+#define SD_CS_PORT GPIOB
+#define SD_CS_PIN  GPIO_PIN_6
+#endif
+
+/* Upper bound on SCK set by the board wiring. SD_Init never selects a
+   prescaler above this, whatever the card supports. */
+#ifndef SD_SPI_MAX_CLOCK_HZ
+#define SD_SPI_MAX_CLOCK_HZ 25000000
+#endif
+
+/* Card registers and geometry, read once by SD_Init */
+typedef struct
+{
+    uint8_t  csd[16];
+    uint8_t  cid[16];
+    uint8_t  sd_status[64];
+    uint32_t ocr;
+    uint32_t sector_count;  /* Capacity in 512 byte sectors */
+    uint32_t erase_block;   /* Allocation unit (erase block) in sectors */
+} SD_CardInfoTypeDef;
+
 uint8_t SD_Init(void);
 uint8_t SD_ReadSingleBlock(uint8_t *buff, uint32_t sector);
+uint8_t SD_ReadMultiBlock(uint8_t *buff, uint32_t sector, uint32_t count);
 uint8_t SD_WriteSingleBlock(const uint8_t *buff, uint32_t sector);
+uint8_t SD_WriteMultiBlock(const uint8_t *buff, uint32_t sector, uint32_t count);
+uint8_t SD_Erase(uint32_t start, uint32_t end);
+uint8_t SD_Sync(void);
+uint8_t  SD_StepDownClock(void);
+uint32_t SD_GetClock(void);
+const SD_CardInfoTypeDef *SD_GetCardInfo(void);
 void    SD_SetSPIHandle(SPI_HandleTypeDef *hspi);
+uint8_t SD_Lock(void);
+void    SD_Unlock(void);
+#if SD_USE_SPIBUS
+void    SD_GetBusStats(SPIBUS_StatsTypeDef *out);
+#endif
 
 #endif
@@ -1,66 +1,151 @@
 #include "ff_gen_drv.h"
 #include "diskio.h"
+#include "sd_spi.h"
+
+#include <string.h>
 
 #define DEV_SD  0
 static volatile DSTATUS Stat = STA_NOINIT;
 
-extern uint8_t SD_Init(void);
-extern uint8_t SD_ReadSingleBlock(uint8_t *buff, uint32_t sector);
-extern uint8_t SD_WriteSingleBlock(const uint8_t *buff, uint32_t sector);
-
 DSTATUS SD_SPI_initialize(BYTE pdrv) {
+    uint8_t err;
+    
     if(pdrv != DEV_SD) return STA_NOINIT;
+    /* Whatever was initialised before, the card is not usable until
+       SD_Init succeeds again */
+    Stat |= STA_NOINIT;
+    if(SD_Lock() != 0) return STA_NOINIT;
     
-    if(SD_Init() == 0) {
+    err = SD_Init();
+    SD_Unlock();
+    if(err == 0) {
         Stat &= ~STA_NOINIT;
         return 0;
     }
     return STA_NOINIT;
 }
 
+/* Called when the card detect switch reports the card gone. Transfers
+   fail with RES_NOTRDY from then on instead of timing out on the bus,
+   until the next successful SD_SPI_initialize. */
+void SD_SPI_CardRemoved(void) {
+    Stat |= STA_NOINIT;
+}
+
 DSTATUS SD_SPI_status(BYTE pdrv) {
     if(pdrv != DEV_SD) return STA_NOINIT;
     return Stat;
 }
 
+static uint8_t SD_ReadSectors(BYTE *buff, DWORD sector, UINT count) {
+    if(count == 1) {
+        return SD_ReadSingleBlock(buff, sector);
+    }
+    /* Stream multi-sector runs as one CMD18 transaction */
+    return SD_ReadMultiBlock(buff, sector, count);
+}
+
+static uint8_t SD_WriteSectors(const BYTE *buff, DWORD sector, UINT count) {
+    if(count == 1) {
+        return SD_WriteSingleBlock(buff, sector);
+    }
+    /* Stream multi-sector runs as one CMD25 transaction */
+    return SD_WriteMultiBlock(buff, sector, count);
+}
+
+/* A failed transfer is retried once, one SPI clock step slower. Errors
+   caused by the clock being too fast for the wiring settle the clock at
+   the fastest rate that works. Each call holds SPI1 throughout, retry
+   included. */
 DRESULT SD_SPI_read(BYTE pdrv, BYTE *buff, DWORD sector, UINT count) {
+    DRESULT res = RES_OK;
+    
     if(pdrv != DEV_SD) return RES_PARERR;
     if(Stat & STA_NOINIT) return RES_NOTRDY;
+    if(SD_Lock() != 0) return RES_NOTRDY;
     
-    for(UINT i = 0; i < count; i++) {
-        if(SD_ReadSingleBlock(buff + (i * 512), sector + i) != 0) {
-            return RES_ERROR;
+    if(SD_ReadSectors(buff, sector, count) != 0) {
+        if(SD_StepDownClock() != 0 ||
+           SD_ReadSectors(buff, sector, count) != 0) {
+            res = RES_ERROR;
         }
     }
-    return RES_OK;
+    SD_Unlock();
+    return res;
 }
 
 DRESULT SD_SPI_write(BYTE pdrv, const BYTE *buff, DWORD sector, UINT count) {
+    DRESULT res = RES_OK;
+    
     if(pdrv != DEV_SD) return RES_PARERR;
     if(Stat & STA_NOINIT) return RES_NOTRDY;
+    if(SD_Lock() != 0) return RES_NOTRDY;
     
-    for(UINT i = 0; i < count; i++) {
-        if(SD_WriteSingleBlock(buff + (i * 512), sector + i) != 0) {
-            return RES_ERROR;
+    if(SD_WriteSectors(buff, sector, count) != 0) {
+        if(SD_StepDownClock() != 0 ||
+           SD_WriteSectors(buff, sector, count) != 0) {
+            res = RES_ERROR;
         }
     }
-    return RES_OK;
+    SD_Unlock();
+    return res;
 }
 
 DRESULT SD_SPI_ioctl(BYTE pdrv, BYTE cmd, void *buff) {
+    DRESULT res;
+    
     if(pdrv != DEV_SD) return RES_PARERR;
     if(Stat & STA_NOINIT) return RES_NOTRDY;
     
     switch(cmd) {
 	case CTRL_SYNC:
-		return RES_OK;
+		/* Flush a deferred write-behind busy phase */
+		if(SD_Lock() != 0) return RES_NOTRDY;
+		res = (SD_Sync() == 0) ? RES_OK : RES_ERROR;
+		SD_Unlock();
+		return res;
             
 	case GET_SECTOR_SIZE:
 		*(WORD*)buff = 512;
 		return RES_OK;
             
+	case CTRL_TRIM:
+		/* buff: DWORD[2] = { start sector, end sector } */
+		if(SD_Lock() != 0) return RES_NOTRDY;
+		res = (SD_Erase(((DWORD*)buff)[0], ((DWORD*)buff)[1]) == 0) ?
+			RES_OK : RES_ERROR;
+		SD_Unlock();
+		return res;
+            
+	case GET_SECTOR_COUNT:
+		*(DWORD*)buff = SD_GetCardInfo()->sector_count;
+		return RES_OK;
+            
 	case GET_BLOCK_SIZE:
-		*(DWORD*)buff = 1;
+		/* f_mkfs takes 1..32768 sectors; the 64 MiB SDXC AU is larger */
+		*(DWORD*)buff = SD_GetCardInfo()->erase_block;
+		if(*(DWORD*)buff == 0) *(DWORD*)buff = 1;
+		if(*(DWORD*)buff > 32768) *(DWORD*)buff = 32768;
+		return RES_OK;
+            
+	case MMC_GET_CSD:
+		memcpy(buff, SD_GetCardInfo()->csd, 16);
+		return RES_OK;
+            
+	case MMC_GET_CID:
+		memcpy(buff, SD_GetCardInfo()->cid, 16);
+		return RES_OK;
+            
+	case MMC_GET_OCR:
+		memcpy(buff, &SD_GetCardInfo()->ocr, 4);
+		return RES_OK;
+            
+	case MMC_GET_SDSTAT:
+		memcpy(buff, SD_GetCardInfo()->sd_status, 64);
+		return RES_OK;
+            
+	case MMC_GET_CLOCK:
+		*(DWORD*)buff = SD_GetClock();
 		return RES_OK;
             
 	default:
@@ -69,7 +69,15 @@
 #define configUSE_MALLOC_FAILED_HOOK	1
 #define configUSE_APPLICATION_TASK_TAG	0
 #define configUSE_COUNTING_SEMAPHORES	1
-#define configGENERATE_RUN_TIME_STATS	0
+#define configGENERATE_RUN_TIME_STATS	1
+
+/* Run time stats count DWT cycles, set up and read by main.c. The counter
+wraps every 2^32 cycles (about nine minutes at the 8 MHz HCLK), so only
+differences over shorter windows are meaningful; see cpustats.c. */
+extern void vMainConfigureRunTimeCounter( void );
+extern uint32_t ulMainGetRunTimeCounter( void );
+#define portCONFIGURE_TIMER_FOR_RUN_TIME_STATS()	vMainConfigureRunTimeCounter()
+#define portGET_RUN_TIME_COUNTER_VALUE()			ulMainGetRunTimeCounter()
 
 /* Co-routine definitions. */
 #define configUSE_CO_ROUTINES 		0
@@ -90,6 +98,8 @@ to exclude the API function. */
 #define INCLUDE_vTaskSuspend			1
 #define INCLUDE_vTaskDelayUntil			1
 #define INCLUDE_vTaskDelay				1
+#define INCLUDE_xTaskGetSchedulerState	1
+#define INCLUDE_xTaskGetCurrentTaskHandle	1
 
 /* Cortex-M specific definitions. */
 #ifdef __NVIC_PRIO_BITS
@@ -9,4 +9,52 @@
    data to. It is best practice to give this file a .csv extension. */
 #define configSD_FILE_NAME "data.csv"
 
+/* Bytes of CSV text vSDCardWriteTask keeps in RAM while no card is mounted.
+   The spool is written out in one go when a card is inserted. */
+#define configSD_SPOOL_BYTES 8192
+
+/* Time the card detect contacts get to settle after an edge on PC7, in
+   milliseconds, before the card is mounted or forgotten. */
+#define configSD_DEBOUNCE_MS 250
+
+/* The log file grows in contiguous extents of this many bytes, allocated
+   ahead of the data so appends never allocate clusters or touch the FAT.
+   Whatever was not written by the time the file is closed is released. */
+#define configSD_PREALLOC_BYTES (256 * 1024)
+
+/* DWORDs of the cluster link map kept for the log file, two per fragment
+   of its cluster chain plus one. A log too fragmented for it is written
+   by following the FAT instead. */
+#define configSD_CLMT_ENTRIES 64
+
+/* While the log is written into preallocated extents, each record only
+   flushes its data and the directory entry (size and time) is rewritten
+   at most this often, in milliseconds, and on close. Records the entry
+   does not cover yet are recovered at the next mount. 0 rewrites the entry
+   with every record. */
+#define configSD_DIRENT_SYNC_MS 10000
+
+/* Empty file kept next to the log while its records are flushed without
+   updating the directory entry. Records past the recorded size are only
+   recovered at mount when it exists, so a log written any other way (by
+   older firmware, or after preallocation ran out) is never extended into
+   clusters that were not erased for it. */
+#define configSD_MARK_NAME "datasync.mrk"
+
+/* RAM staging buffer between the BME680 poll task and the SD card writer.
+   It is sized to hold every record that arrives during the worst SD write
+   of the last configSTAGING_WINDOW writes, times configSTAGING_MARGIN, but
+   never less than configSTAGING_MIN_RECORDS records nor more than
+   configSTAGING_MAX_BYTES of heap. */
+#define configSTAGING_MIN_RECORDS 4
+#define configSTAGING_MAX_BYTES 4096
+#define configSTAGING_WINDOW 32
+#define configSTAGING_MARGIN 2
+
+/* vCPUStatsTask samples the run time counters every
+   configCPU_STATS_INTERVAL_MS milliseconds and keeps each task's share of
+   that window. Tasks beyond configCPU_STATS_MAX_TASKS are not reported. */
+#define configCPU_STATS_INTERVAL_MS 10000
+#define configCPU_STATS_MAX_TASKS 8
+
 #endif
@@ -0,0 +1,74 @@
+#ifndef SPIBUS_H
+#define SPIBUS_H
+
+#include "stm32f4xx_hal.h"
+
+#include "FreeRTOS.h"
+#include "semphr.h"
+
+/* Priority classes, most urgent first. Waiting clients are granted the bus
+   by class, then in the order they asked. A transaction already on the bus
+   is never cut short. */
+#define SPIBUS_PRIO_CRITICAL 0  /* Latency-critical sensor reads */
+#define SPIBUS_PRIO_NORMAL   1
+#define SPIBUS_PRIO_BULK     2  /* SD card block transfers */
+#define SPIBUS_PRIO_CLASSES  3
+
+/* SPIBUS_Transfer flag: leave CS asserted so the next transfer to the same
+   device continues the same frame */
+#define SPIBUS_KEEP_CS 0x01
+
+/* Bus time is measured with the Cortex-M DWT cycle counter. Hosted builds
+   can supply their own SPIBUS_CYCLES()/SPIBUS_CYCLES_INIT(). */
+#ifndef SPIBUS_CYCLES
+#define SPIBUS_CYCLES_INIT() do { \
+          CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk; \
+          DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk; \
+        } while (0)
+#define SPIBUS_CYCLES()      (DWT->CYCCNT)
+#endif
+
+/* Per-client accounting, times in CPU cycles */
+typedef struct
+{
+    uint32_t transactions;      /* Times the bus was granted */
+    uint32_t batched;           /* Grants that found the client's settings
+                                   still on the bus */
+    uint32_t bytes;             /* Clocked while holding the bus */
+    uint64_t bus_cycles;        /* Held the bus */
+    uint64_t wait_cycles;       /* Waited for the bus */
+    uint32_t max_wait_cycles;   /* Longest single wait */
+} SPIBUS_StatsTypeDef;
+
+/* One device on the bus. The first five fields are filled in by the
+   client before SPIBUS_Register; the rest belong to the bus manager. */
+typedef struct SPIBUS_Client
+{
+    GPIO_TypeDef *cs_port;
+    uint16_t      cs_pin;
+    uint32_t      prescaler;    /* SPI_BAUDRATEPRESCALER_x */
+    uint32_t      mode;         /* SPI_POLARITY_x | SPI_PHASE_x */
+    uint8_t       priority;     /* SPIBUS_PRIO_x */
+
+    SPIBUS_StatsTypeDef stats;
+    SemaphoreHandle_t grant;    /* Given when the bus is handed over */
+    struct SPIBUS_Client *next; /* Next waiter of the same class */
+    uint32_t      t_request;
+    uint32_t      t_grant;
+    uint8_t       selected;
+} SPIBUS_ClientTypeDef;
+
+void    SPIBUS_Init(SPI_HandleTypeDef *hspi);
+uint8_t SPIBUS_Register(SPIBUS_ClientTypeDef *client);
+uint8_t SPIBUS_Acquire(SPIBUS_ClientTypeDef *client, TickType_t timeout);
+void    SPIBUS_Release(SPIBUS_ClientTypeDef *client);
+void    SPIBUS_Configure(SPIBUS_ClientTypeDef *client);
+void    SPIBUS_Select(SPIBUS_ClientTypeDef *client);
+void    SPIBUS_Deselect(SPIBUS_ClientTypeDef *client);
+uint8_t SPIBUS_Transfer(SPIBUS_ClientTypeDef *client, const uint8_t *tx,
+                        uint8_t *rx, uint16_t len, uint8_t flags);
+void    SPIBUS_AddBytes(SPIBUS_ClientTypeDef *client, uint32_t len);
+void    SPIBUS_GetStats(SPIBUS_ClientTypeDef *client, SPIBUS_StatsTypeDef *out);
+SPI_HandleTypeDef *SPIBUS_GetHandle(void);
+
+#endif /* SPIBUS_H */
@@ -40,12 +40,16 @@
 #include "bme680.h"
 #include "bme680poll.h"
 #include "sdcard.h"
+#include "staging.h"
+#include "spibus.h"
+#include "cpustats.h"
 
 extern void xPortSysTickHandler(void);
 
 /* Task priorities */
 #define mainBME680_POLL_TASK_PRIORITY  ( tskIDLE_PRIORITY + 1UL )
 #define mainSDCARD_WRITE_TASK_PRIORITY ( tskIDLE_PRIORITY + 2UL )
+#define mainCPU_STATS_TASK_PRIORITY    ( tskIDLE_PRIORITY + 1UL )
 /* A block time of zero simply means "don't block". */
 #define mainDONT_BLOCK                             (0UL)
 
@@ -54,8 +58,9 @@ extern void xPortSysTickHandler(void);
 BME680_HandleTypeDef hbme = {0};
 I2C_HandleTypeDef hi2c = {0};
 SPI_HandleTypeDef hspi = {0};
+DMA_HandleTypeDef hdma_spi1_rx = {0};
+DMA_HandleTypeDef hdma_spi1_tx = {0};
 TIM_HandleTypeDef htim6 = {0};
-QueueHandle_t queue = {0};
 /*-------------------------------[ Prototypes ]-------------------------------*/
 
 static void prvSetupHardware(void);
@@ -74,16 +79,16 @@ int main(void)
 	prvSetupBME680();
 	prvSetupSDCard();
 
-    queue = xQueueCreate(10, sizeof(BME680_OutputTypeDef));    
-    if(queue == NULL)
+    if(xStagingInit() != pdPASS)
     {
-        /* Queue creation failed - not enough heap */
+        /* Staging buffer creation failed - not enough heap */
         for(;;) { }
     }
 	
 	/* Start tasks */
 	vStartBME680PollTask(mainBME680_POLL_TASK_PRIORITY);
 	vStartSDCardWriteTask(mainSDCARD_WRITE_TASK_PRIORITY);
+	vStartCPUStatsTask(mainCPU_STATS_TASK_PRIORITY);
 	
     /* Start the scheduler. */
     vTaskStartScheduler();
@@ -172,9 +177,9 @@ static void prvSetupSDCard(void)
 	HAL_GPIO_Init(GPIOB, &GPIO_Init);
 	HAL_GPIO_WritePin(GPIOB, GPIO_PIN_6, GPIO_PIN_SET); // CS idle high
 
-	/* PC7 DET */
+	/* PC7 DET, interrupting on insertion and removal */
 	GPIO_Init.Pin = GPIO_PIN_7;
-	GPIO_Init.Mode = GPIO_MODE_INPUT;
+	GPIO_Init.Mode = GPIO_MODE_IT_RISING_FALLING;
 	GPIO_Init.Pull = GPIO_NOPULL;
 	GPIO_Init.Speed = GPIO_SPEED_FREQ_LOW;
 	HAL_GPIO_Init(GPIOC, &GPIO_Init);
@@ -191,10 +196,10 @@ static void prvSetupSDCard(void)
 	hspi.Init.CLKPolarity       = SPI_POLARITY_LOW; // CPOL = 0
 	hspi.Init.CLKPhase          = SPI_PHASE_1EDGE; // CPHA = 0 → MODE0
 	hspi.Init.NSS               = SPI_NSS_SOFT; // Use software CS (GPIO)
-	hspi.Init.BaudRatePrescaler = SPI_BAUDRATEPRESCALER_256; // slow for init
+	hspi.Init.BaudRatePrescaler = SPI_BAUDRATEPRESCALER_256; // slow for init, SD_Init ramps up
 	hspi.Init.FirstBit          = SPI_FIRSTBIT_MSB;
 	hspi.Init.TIMode            = SPI_TIMODE_DISABLE;
-	hspi.Init.CRCCalculation    = SPI_CRCCALCULATION_DISABLE;
+	hspi.Init.CRCCalculation    = SPI_CRCCALCULATION_DISABLE; // sd_spi.c runs CRC per block
 	hspi.Init.CRCPolynomial     = 7;
 
 	if(HAL_SPI_Init(&hspi) != HAL_OK)
@@ -203,6 +208,54 @@ static void prvSetupSDCard(void)
 		{
 		}
 	}
+
+	/* SPI1 sector transfers: RX on DMA2 Stream0, TX on DMA2 Stream3, both
+	   channel 3 */
+	__HAL_RCC_DMA2_CLK_ENABLE();
+
+	hdma_spi1_rx.Instance                 = DMA2_Stream0;
+	hdma_spi1_rx.Init.Channel             = DMA_CHANNEL_3;
+	hdma_spi1_rx.Init.Direction           = DMA_PERIPH_TO_MEMORY;
+	hdma_spi1_rx.Init.PeriphInc           = DMA_PINC_DISABLE;
+	hdma_spi1_rx.Init.MemInc              = DMA_MINC_ENABLE;
+	hdma_spi1_rx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+	hdma_spi1_rx.Init.MemDataAlignment    = DMA_MDATAALIGN_BYTE;
+	hdma_spi1_rx.Init.Mode                = DMA_NORMAL;
+	hdma_spi1_rx.Init.Priority            = DMA_PRIORITY_HIGH;
+	hdma_spi1_rx.Init.FIFOMode            = DMA_FIFOMODE_DISABLE;
+
+	hdma_spi1_tx.Instance                 = DMA2_Stream3;
+	hdma_spi1_tx.Init                     = hdma_spi1_rx.Init;
+	hdma_spi1_tx.Init.Direction           = DMA_MEMORY_TO_PERIPH;
+	
+	if(HAL_DMA_Init(&hdma_spi1_rx) != HAL_OK ||
+	   HAL_DMA_Init(&hdma_spi1_tx) != HAL_OK)
+	{
+		for( ; ; )
+		{
+		}
+	}
+	__HAL_LINKDMA(&hspi, hdmarx, hdma_spi1_rx);
+	__HAL_LINKDMA(&hspi, hdmatx, hdma_spi1_tx);
+
+	/* SPI1 is shared from here on; devices register as bus clients with
+	   their own CS, clock and priority class */
+	SPIBUS_Init(&hspi);
+
+	/* Completion callbacks notify a task, so these must sit at or below
+	   configLIBRARY_MAX_SYSCALL_INTERRUPT_PRIORITY */
+	HAL_NVIC_SetPriority(DMA2_Stream0_IRQn,
+						 configLIBRARY_MAX_SYSCALL_INTERRUPT_PRIORITY + 1, 0);
+	HAL_NVIC_EnableIRQ(DMA2_Stream0_IRQn);
+	HAL_NVIC_SetPriority(DMA2_Stream3_IRQn,
+						 configLIBRARY_MAX_SYSCALL_INTERRUPT_PRIORITY + 1, 0);
+	HAL_NVIC_EnableIRQ(DMA2_Stream3_IRQn);
+	HAL_NVIC_SetPriority(SPI1_IRQn,
+						 configLIBRARY_MAX_SYSCALL_INTERRUPT_PRIORITY + 1, 0);
+	HAL_NVIC_EnableIRQ(SPI1_IRQn);
+	HAL_NVIC_SetPriority(EXTI9_5_IRQn,
+						 configLIBRARY_MAX_SYSCALL_INTERRUPT_PRIORITY + 1, 0);
+	HAL_NVIC_EnableIRQ(EXTI9_5_IRQn);
 }
 
 void SysTick_Handler(void)
@@ -335,11 +388,67 @@ HAL_StatusTypeDef HAL_InitTick(uint32_t TickPriority)
 	return HAL_OK;
 }
 
+/* Overrides the weak HAL_Delay. Once the scheduler runs the caller blocks
+   instead of spinning on the TIM6 tick; a tick is added, as the HAL does,
+   so the delay is never shorter than asked. Must not be called with the
+   scheduler suspended or from an interrupt. */
+void HAL_Delay(uint32_t Delay)
+{
+    uint32_t tickstart;
+
+    if(xTaskGetSchedulerState() == taskSCHEDULER_RUNNING)
+    {
+        vTaskDelay(pdMS_TO_TICKS(Delay) + 1);
+        return;
+    }
+
+    tickstart = HAL_GetTick();
+    if(Delay < HAL_MAX_DELAY)
+    {
+        Delay++;
+    }
+    while((HAL_GetTick() - tickstart) < Delay)
+    {
+    }
+}
+
+/* Run time stats count DWT cycles (see FreeRTOSConfig.h) */
+void vMainConfigureRunTimeCounter(void)
+{
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+uint32_t ulMainGetRunTimeCounter(void)
+{
+    return DWT->CYCCNT;
+}
+
 void TIM6_DAC_IRQHandler(void)
 {
     HAL_TIM_IRQHandler(&htim6);
 }
 
+void DMA2_Stream0_IRQHandler(void)
+{
+	HAL_DMA_IRQHandler(&hdma_spi1_rx);
+}
+
+void DMA2_Stream3_IRQHandler(void)
+{
+	HAL_DMA_IRQHandler(&hdma_spi1_tx);
+}
+
+void SPI1_IRQHandler(void)
+{
+	HAL_SPI_IRQHandler(&hspi);
+}
+
+void EXTI9_5_IRQHandler(void)
+{
+	HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_7);
+}
+
 void HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef *htim)
 {
     if(htim->Instance == TIM6)
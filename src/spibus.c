@@ -0,0 +1,329 @@
+#include "spibus.h"
+
+#include <string.h>
+
+#include "task.h"
+
+/* Longest a polled SPIBUS_Transfer may take */
+#define SPIBUS_TIMEOUT_MS 100
+
+static SPI_HandleTypeDef *bus_hspi = NULL;
+/* Client holding the bus, NULL when it is free */
+static SPIBUS_ClientTypeDef *bus_owner = NULL;
+/* Client whose clock and mode are programmed into CR1 */
+static SPIBUS_ClientTypeDef *bus_config = NULL;
+/* Waiting clients, one FIFO per priority class */
+static SPIBUS_ClientTypeDef *bus_waiters[SPIBUS_PRIO_CLASSES];
+
+/* Appends a client to the FIFO of its class. Called in a critical section. */
+static void prvEnqueue(SPIBUS_ClientTypeDef *client)
+{
+    SPIBUS_ClientTypeDef **link = &bus_waiters[client->priority];
+
+    while(*link != NULL)
+	{
+        link = &(*link)->next;
+    }
+    client->next = NULL;
+    *link = client;
+}
+
+/* Takes a client that gave up waiting out of its FIFO. Called in a critical
+   section. */
+static void prvDequeue(SPIBUS_ClientTypeDef *client)
+{
+    SPIBUS_ClientTypeDef **link = &bus_waiters[client->priority];
+
+    while(*link != NULL)
+	{
+        if(*link == client)
+		{
+            *link = client->next;
+            return;
+        }
+        link = &(*link)->next;
+    }
+}
+
+/* Pops the longest waiting client of the most urgent class, or NULL if
+   nobody waits. Called in a critical section. */
+static SPIBUS_ClientTypeDef *prvNextWaiter(void)
+{
+    SPIBUS_ClientTypeDef *client;
+
+    for(int i = 0; i < SPIBUS_PRIO_CLASSES; i++)
+	{
+        client = bus_waiters[i];
+        if(client != NULL)
+		{
+            bus_waiters[i] = client->next;
+            return client;
+        }
+    }
+    return NULL;
+}
+
+/* Programs the client's prescaler and mode into SPI1. The previous owner
+   finished with the bus, but its last frame may still be shifting out. */
+static void prvApplyConfig(SPIBUS_ClientTypeDef *client)
+{
+    SPI_TypeDef *spi = bus_hspi->Instance;
+
+    while(spi->SR & SPI_SR_BSY) { }
+
+    bus_hspi->Init.BaudRatePrescaler = client->prescaler;
+    bus_hspi->Init.CLKPolarity = client->mode & SPI_CR1_CPOL;
+    bus_hspi->Init.CLKPhase = client->mode & SPI_CR1_CPHA;
+
+    __HAL_SPI_DISABLE(bus_hspi);
+    MODIFY_REG(spi->CR1, SPI_CR1_BR | SPI_CR1_CPOL | SPI_CR1_CPHA,
+               client->prescaler | client->mode);
+    __HAL_SPI_ENABLE(bus_hspi);
+    bus_config = client;
+}
+
+/* Takes over SPI1. The handle must have been set up by HAL_SPI_Init as an
+   8-bit master with software NSS; clients only change clock and mode. */
+void SPIBUS_Init(SPI_HandleTypeDef *hspi)
+{
+    bus_hspi = hspi;
+    bus_owner = NULL;
+    bus_config = NULL;
+    memset(bus_waiters, 0, sizeof(bus_waiters));
+    SPIBUS_CYCLES_INIT();
+}
+
+/* Adds a device to the bus and releases its CS. Returns 0 on success, 1 if
+   its semaphore could not be allocated. */
+uint8_t SPIBUS_Register(SPIBUS_ClientTypeDef *client)
+{
+    if(client->priority >= SPIBUS_PRIO_CLASSES)
+	{
+        client->priority = SPIBUS_PRIO_CLASSES - 1;
+    }
+    if(client->grant == NULL)
+	{
+        client->grant = xSemaphoreCreateBinary();
+        if(client->grant == NULL)
+		{
+            return 1;
+        }
+    }
+    memset(&client->stats, 0, sizeof(client->stats));
+    client->next = NULL;
+    client->selected = 0;
+    client->cs_port->BSRR = client->cs_pin;
+    return 0;
+}
+
+/* Waits up to timeout ticks for the bus, behind any waiter of the same or a
+   more urgent class. Returns 0 once the client holds the bus with its
+   settings applied, 1 on timeout. Before the scheduler runs there is
+   nobody to wait for, so a busy bus fails at once. */
+uint8_t SPIBUS_Acquire(SPIBUS_ClientTypeDef *client, TickType_t timeout)
+{
+    uint8_t granted = 0;
+    uint32_t wait;
+    TimeOut_t xTimeOut;
+
+    client->t_request = SPIBUS_CYCLES();
+
+    taskENTER_CRITICAL();
+    if(bus_owner == NULL)
+	{
+        bus_owner = client;
+        granted = 1;
+    }
+    else if(xTaskGetSchedulerState() == taskSCHEDULER_RUNNING && timeout > 0)
+	{
+        prvEnqueue(client);
+    }
+    else
+	{
+        taskEXIT_CRITICAL();
+        return 1;
+    }
+    taskEXIT_CRITICAL();
+
+    vTaskSetTimeOutState(&xTimeOut);
+    while(!granted)
+	{
+        if(xSemaphoreTake(client->grant, timeout) == pdTRUE)
+		{
+            /* A give that arrived after an earlier wait timed out is still
+               pending on the semaphore; only ownership counts */
+            taskENTER_CRITICAL();
+            granted = (bus_owner == client);
+            taskEXIT_CRITICAL();
+            if(granted || xTaskCheckForTimeOut(&xTimeOut, &timeout) == pdFALSE)
+			{
+                continue;
+            }
+        }
+        /* The owner may have handed over just as the wait timed out */
+        taskENTER_CRITICAL();
+        granted = (bus_owner == client);
+        if(!granted)
+		{
+            prvDequeue(client);
+        }
+        taskEXIT_CRITICAL();
+        if(!granted)
+		{
+            return 1;
+        }
+        xSemaphoreTake(client->grant, 0);
+    }
+
+    client->t_grant = SPIBUS_CYCLES();
+    wait = client->t_grant - client->t_request;
+
+    /* Back to back transactions of one device skip reprogramming SPI1 */
+    if(bus_config != client)
+	{
+        prvApplyConfig(client);
+    }
+    else
+	{
+        client->stats.batched++;
+    }
+
+    taskENTER_CRITICAL();
+    client->stats.transactions++;
+    client->stats.wait_cycles += wait;
+    if(wait > client->stats.max_wait_cycles)
+	{
+        client->stats.max_wait_cycles = wait;
+    }
+    taskEXIT_CRITICAL();
+    return 0;
+}
+
+/* Ends the client's transaction, releasing its CS if a transfer left it
+   asserted, and hands the bus to the next waiter. */
+void SPIBUS_Release(SPIBUS_ClientTypeDef *client)
+{
+    SPIBUS_ClientTypeDef *next;
+    uint32_t held;
+
+    if(client->selected)
+	{
+        SPIBUS_Deselect(client);
+    }
+    held = SPIBUS_CYCLES() - client->t_grant;
+
+    taskENTER_CRITICAL();
+    client->stats.bus_cycles += held;
+    next = prvNextWaiter();
+    bus_owner = next;
+    taskEXIT_CRITICAL();
+
+    if(next != NULL)
+	{
+        xSemaphoreGive(next->grant);
+    }
+}
+
+/* Applies a change to the client's prescaler or mode: at once if it holds
+   the bus, otherwise on its next grant. */
+void SPIBUS_Configure(SPIBUS_ClientTypeDef *client)
+{
+    if(bus_config == client)
+	{
+        bus_config = NULL;
+    }
+    if(bus_owner == client)
+	{
+        prvApplyConfig(client);
+    }
+}
+
+/* CS is driven through BSRR so each edge is a single store */
+void SPIBUS_Select(SPIBUS_ClientTypeDef *client)
+{
+    client->cs_port->BSRR = (uint32_t)client->cs_pin << 16;
+    client->selected = 1;
+}
+
+void SPIBUS_Deselect(SPIBUS_ClientTypeDef *client)
+{
+    client->cs_port->BSRR = client->cs_pin;
+    client->selected = 0;
+}
+
+/* Polled full-duplex transfer for a client holding the bus. A NULL tx
+   clocks out 0xFF, a NULL rx discards what comes back. CS is asserted if
+   it is not already and released afterwards unless SPIBUS_KEEP_CS is set,
+   so a command and its data phase can go out as one frame. Returns 0 on
+   success, 1 on error. */
+uint8_t SPIBUS_Transfer(SPIBUS_ClientTypeDef *client, const uint8_t *tx,
+                        uint8_t *rx, uint16_t len, uint8_t flags)
+{
+    HAL_StatusTypeDef status;
+
+    if(bus_owner != client)
+	{
+        return 1;
+    }
+    if(!client->selected)
+	{
+        SPIBUS_Select(client);
+    }
+
+    if(tx == NULL && rx == NULL)
+	{
+        /* Clock only, as to let a device finish an operation */
+        uint8_t ff[16];
+        uint16_t n = sizeof(ff);
+
+        memset(ff, 0xFF, sizeof(ff));
+        status = HAL_OK;
+        for(uint16_t done = 0; done < len && status == HAL_OK; done += n)
+		{
+            if(len - done < n) n = len - done;
+            status = HAL_SPI_Transmit(bus_hspi, ff, n, SPIBUS_TIMEOUT_MS);
+        }
+    }
+    else if(rx == NULL)
+	{
+        status = HAL_SPI_Transmit(bus_hspi, (uint8_t *)tx, len, SPIBUS_TIMEOUT_MS);
+    }
+    else if(tx == NULL)
+	{
+        memset(rx, 0xFF, len);
+        status = HAL_SPI_TransmitReceive(bus_hspi, rx, rx, len, SPIBUS_TIMEOUT_MS);
+    }
+    else
+	{
+        status = HAL_SPI_TransmitReceive(bus_hspi, (uint8_t *)tx, rx, len,
+                                         SPIBUS_TIMEOUT_MS);
+    }
+
+    if((flags & SPIBUS_KEEP_CS) == 0 || status != HAL_OK)
+	{
+        SPIBUS_Deselect(client);
+    }
+    client->stats.bytes += len;
+    return (status != HAL_OK);
+}
+
+/* Adds bytes a client holding the bus clocked without SPIBUS_Transfer,
+   such as a driver running SPI1 directly or by DMA. */
+void SPIBUS_AddBytes(SPIBUS_ClientTypeDef *client, uint32_t len)
+{
+    client->stats.bytes += len;
+}
+
+/* Copies a client's counters; the time of a transaction in progress is
+   added when it ends. */
+void SPIBUS_GetStats(SPIBUS_ClientTypeDef *client, SPIBUS_StatsTypeDef *out)
+{
+    taskENTER_CRITICAL();
+    *out = client->stats;
+    taskEXIT_CRITICAL();
+}
+
+SPI_HandleTypeDef *SPIBUS_GetHandle(void)
+{
+    return bus_hspi;
+}
@@ -0,0 +1,33 @@
+#ifndef CPUSTATS_H
+#define CPUSTATS_H
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include "config.h"
+
+/* CPU time one task used in the last sampling window */
+typedef struct
+{
+	char pcName[configMAX_TASK_NAME_LEN];
+	uint32_t ulRunTime;           /* Run time counter ticks in the window */
+	UBaseType_t uxPermille;       /* Share of the window, in 1/1000 */
+} CPUTaskStats_t;
+
+/* The last report, published for a debugger: "print xCPUStats" under
+   "make gdb", or a live watch. ulWindows counts the reports published, so
+   a reader can tell a fresh one; entries are only consistent while it
+   does not change. */
+typedef struct
+{
+	uint32_t ulWindows;           /* Reports published so far */
+	UBaseType_t uxCount;          /* Valid entries in pxTasks */
+	CPUTaskStats_t pxTasks[configCPU_STATS_MAX_TASKS];
+} CPUStatsReport_t;
+
+extern volatile CPUStatsReport_t xCPUStats;
+
+void vStartCPUStatsTask(UBaseType_t uxPriority);
+UBaseType_t uxCPUStatsGet(CPUTaskStats_t *pxStats, UBaseType_t uxMax);
+
+#endif
@@ -1,6 +1,24 @@
 #ifndef SD_CARD_H
 #define SD_CARD_H
 
+#include "spibus.h"
+
+/* Hot-swap, spool and preallocation counters of vSDCardWriteTask */
+typedef struct
+{
+	UBaseType_t uxMounts;           /* Successful mounts, including the first */
+	UBaseType_t uxUnmounts;         /* Card removals (or failed writes) handled */
+	UBaseType_t uxSpooled;          /* Records held in RAM while unmounted */
+	UBaseType_t uxSpoolDropped;     /* Records lost to a full spool */
+	UBaseType_t uxSpoolBytes;       /* Bytes waiting in the spool now */
+	UBaseType_t uxLastDrainBytes;   /* Size of the last spool drain */
+	TickType_t xLastDrainTicks;     /* Duration of the last drain, write and sync */
+	UBaseType_t uxExtents;          /* Contiguous extents preallocated for the log */
+	UBaseType_t uxRecoveredBytes;   /* Log bytes past the recorded size found at mount */
+	SPIBUS_StatsTypeDef xBus;       /* The card's share of SPI1 */
+} SDCardStats_t;
+
 void vStartSDCardWriteTask( UBaseType_t uxPriority );
+void vSDCardGetStats( SDCardStats_t *pxStats );
 
 #endif
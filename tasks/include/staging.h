@@ -0,0 +1,30 @@
+#ifndef STAGING_H
+#define STAGING_H
+
+#include "FreeRTOS.h"
+
+/* Needed for BME680_OutputTypeDef */
+#include "bme680.h"
+
+/* How close the staging buffer came to dropping samples */
+typedef struct
+{
+	UBaseType_t uxCapacity;       /* Records the buffer holds now */
+	UBaseType_t uxCeiling;        /* Most records configSTAGING_MAX_BYTES allows */
+	UBaseType_t uxCount;          /* Records waiting to be written */
+	UBaseType_t uxHighWater;      /* Most records ever waiting */
+	UBaseType_t uxMinHeadroom;    /* Fewest free slots left after a send */
+	UBaseType_t uxDropped;        /* Records lost to a full buffer */
+	UBaseType_t uxResizes;        /* Times the buffer was grown or shrunk */
+	TickType_t xWorstLatency;     /* Longest write in the latency window */
+	TickType_t xInterval;         /* Latest time between two records */
+} StagingStats_t;
+
+BaseType_t xStagingInit(void);
+BaseType_t xStagingSend(const BME680_OutputTypeDef *pxRecord);
+BaseType_t xStagingReceive(BME680_OutputTypeDef *pxRecord, TickType_t xTicksToWait);
+void vStagingWakeFromISR(void);
+void vStagingRecordLatency(TickType_t xLatency);
+void vStagingGetStats(StagingStats_t *pxStats);
+
+#endif
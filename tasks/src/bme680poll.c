@@ -5,7 +5,7 @@
 /* Scheduler include files. */
 #include "FreeRTOS.h"
 #include "task.h"
-#include "queue.h"
+#include "staging.h"
 
 /* BME680 driver include */
 #include "bme680.h"
@@ -15,7 +15,6 @@
 static portTASK_FUNCTION_PROTO( vBME680PollTask, pvParameters );
 
 extern BME680_HandleTypeDef hbme;
-extern QueueHandle_t queue;
 
 /*-----------------------------------------------------------*/
 
@@ -43,12 +42,12 @@ static portTASK_FUNCTION( vBME680PollTask, pvParameters )
 		}
 		/* Time stamp data */
 		hbme.output.time_stamp = xTaskGetTickCount();
-		/* Send data to queue */
-		xStatus = xQueueSend(queue, &hbme.output, 0);
+		/* Stage data for the SD card writer */
+		xStatus = xStagingSend(&hbme.output);
             
 		if(xStatus != pdPASS)
 		{
-			/* Queue is full */
+			/* Buffer is full; counted in StagingStats_t.uxDropped */
 			
 		}
 			
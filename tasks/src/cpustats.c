@@ -0,0 +1,112 @@
+/* Per-task CPU time report.
+
+   vCPUStatsTask samples every task's run time counter each
+   configCPU_STATS_INTERVAL_MS and keeps the difference to the previous
+   sample, so the report covers the last window only and is unaffected by
+   the counter wrapping. The IDLE entry shows how much time the blocking
+   waits in the drivers leave unused. The report is read with
+   uxCPUStatsGet, or from xCPUStats with a debugger. */
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "cpustats.h"
+
+#include "config.h"
+
+#include <string.h>
+
+#define cpustatsSTACK_SIZE (configMINIMAL_STACK_SIZE * 2)
+
+static portTASK_FUNCTION_PROTO(vCPUStatsTask, pvParameters);
+
+/* Previous sample, owned by vCPUStatsTask */
+static TaskStatus_t pxStatus[configCPU_STATS_MAX_TASKS];
+static TaskHandle_t pxPrevHandle[configCPU_STATS_MAX_TASKS];
+static uint32_t pulPrevRunTime[configCPU_STATS_MAX_TASKS];
+static UBaseType_t uxPrevCount = 0;
+static uint32_t ulPrevTotal = 0;
+
+/* Last report, only written inside critical sections */
+volatile CPUStatsReport_t xCPUStats = {0};
+
+void vStartCPUStatsTask(UBaseType_t uxPriority)
+{
+	xTaskCreate(vCPUStatsTask, "CPUStats", cpustatsSTACK_SIZE, NULL,
+				uxPriority, (TaskHandle_t *)NULL);
+}
+
+/* Copies up to uxMax entries of the last report and returns how many there
+   were. Nothing is reported until the first window has passed. */
+UBaseType_t uxCPUStatsGet(CPUTaskStats_t *pxStats, UBaseType_t uxMax)
+{
+	UBaseType_t uxCount;
+
+	taskENTER_CRITICAL();
+	uxCount = (xCPUStats.uxCount < uxMax) ? xCPUStats.uxCount : uxMax;
+	memcpy(pxStats, (const void *)xCPUStats.pxTasks, uxCount * sizeof(CPUTaskStats_t));
+	taskEXIT_CRITICAL();
+	return uxCount;
+}
+
+/* Run time of a task at the previous sample, 0 for a task created since */
+static uint32_t prvPrevRunTime(TaskHandle_t xHandle)
+{
+	for(UBaseType_t i = 0; i < uxPrevCount; i++)
+	{
+		if(pxPrevHandle[i] == xHandle)
+		{
+			return pulPrevRunTime[i];
+		}
+	}
+	return 0;
+}
+
+static void prvSample(void)
+{
+	static CPUTaskStats_t pxNext[configCPU_STATS_MAX_TASKS];
+	uint32_t ulTotal;
+	uint32_t ulWindow;
+	UBaseType_t uxCount;
+
+	uxCount = uxTaskGetSystemState(pxStatus, configCPU_STATS_MAX_TASKS, &ulTotal);
+	ulWindow = ulTotal - ulPrevTotal;
+
+	memset(pxNext, 0, sizeof(pxNext));
+	for(UBaseType_t i = 0; i < uxCount; i++)
+	{
+		strncpy(pxNext[i].pcName, pxStatus[i].pcTaskName, configMAX_TASK_NAME_LEN - 1);
+		pxNext[i].ulRunTime = pxStatus[i].ulRunTimeCounter -
+			prvPrevRunTime(pxStatus[i].xHandle);
+		pxNext[i].uxPermille = (ulWindow == 0) ? 0 :
+			(UBaseType_t)(((uint64_t)pxNext[i].ulRunTime * 1000) / ulWindow);
+	}
+
+	/* The first sample only sets the baseline */
+	if(ulPrevTotal != 0)
+	{
+		taskENTER_CRITICAL();
+		memcpy((void *)xCPUStats.pxTasks, pxNext, sizeof(pxNext));
+		xCPUStats.uxCount = uxCount;
+		xCPUStats.ulWindows++;
+		taskEXIT_CRITICAL();
+	}
+
+	for(UBaseType_t i = 0; i < uxCount; i++)
+	{
+		pxPrevHandle[i] = pxStatus[i].xHandle;
+		pulPrevRunTime[i] = pxStatus[i].ulRunTimeCounter;
+	}
+	uxPrevCount = uxCount;
+	ulPrevTotal = ulTotal;
+}
+
+static portTASK_FUNCTION(vCPUStatsTask, pvParameters)
+{
+	TickType_t xLastWake = xTaskGetTickCount();
+
+	for( ; ; )
+	{
+		prvSample();
+		vTaskDelayUntil(&xLastWake, pdMS_TO_TICKS(configCPU_STATS_INTERVAL_MS));
+	}
+}
@@ -1,7 +1,7 @@
 #include "FreeRTOS.h"
 #include "task.h"
-#include "queue.h"
 #include "sdcard.h"
+#include "staging.h"
 
 #include "config.h"
 
@@ -12,12 +12,16 @@
 
 /* FatFs Includes */
 #include "ff_gen_drv.h"
+#include "ff_cache_drv.h"
+#include "ff_async_drv.h"
 #include "ff.h"
 /* Custom SPI driver under FatFs layer */
 #include "sd_spi.h"
 /* Needed for BME680_OutputTypeDef */
 #include "bme680.h"
 
+#include <string.h>
+
 #define forever for(;;)
 
 /* Pins */
@@ -32,13 +36,49 @@
 /* Globals -------------------------------------------------------------------*/
 extern SPI_HandleTypeDef hspi; /* from main.c */
 extern Diskio_drvTypeDef SD_SPI_Driver;
-extern QueueHandle_t queue;
+extern void SD_SPI_CardRemoved(void);
+
+/* Card state, owned by vSDCardWriteTask */
+static FATFS fs;
+static FIL fil;
+static char SDPath[4];
+static BaseType_t xMounted = pdFALSE;
+static SDCardStats_t xStats = {0};
+
+/* Preallocation of the log: bytes of the file's cluster chain, and its
+   cluster link map for fast seek */
+static FSIZE_t xAllocEnd = 0;
+static DWORD pulClmt[configSD_CLMT_ENTRIES];
+
+/* Last time the log's directory entry was brought up to date */
+static TickType_t xEntrySynced = 0;
+
+/* Records formatted while no card is mounted, drained on the next mount */
+static char pcSpool[configSD_SPOOL_BYTES];
+static UBaseType_t uxSpoolLen = 0;
+
+/* Set by the PC7 EXTI callback */
+static volatile BaseType_t xCardChanged = pdFALSE;
 
 /* Private Prototypes --------------------------------------------------------*/
 static portTASK_FUNCTION_PROTO(vSDCardWriteTask, pvParameters);
 static void Error_Handler(void);
 static uint8_t i32toa(uint32_t num, uint8_t *buf);
+static uint32_t ulFormatRecord(const BME680_OutputTypeDef *data, char *out);
 static int lWriteOutput(BME680_OutputTypeDef *data, FIL *fil);
+static BaseType_t prvMount(void);
+static void prvUnmount(void);
+static void prvDrainSpool(void);
+static void prvSpool(const BME680_OutputTypeDef *data);
+static void prvSpoolConsume(UINT len);
+static void prvCardChanged(void);
+static void prvMapLog(void);
+static void prvReserve(UINT len);
+static FRESULT prvSync(FIL *fil);
+static FRESULT prvRecover(FSIZE_t *pxRecovered);
+static FRESULT prvLastRecord(FSIZE_t xFrom, FSIZE_t *pxEnd);
+static FRESULT prvScrub(FSIZE_t xEnd);
+static FRESULT prvMark(BaseType_t xSet);
 
 static uint32_t str_len(const char *text)
 {
@@ -53,92 +93,318 @@ void vStartSDCardWriteTask(UBaseType_t uxPriority)
 				uxPriority, (TaskHandle_t *)NULL);
 }
 
+void vSDCardGetStats(SDCardStats_t *pxStats)
+{
+	taskENTER_CRITICAL();
+	*pxStats = xStats;
+	pxStats->uxSpoolBytes = uxSpoolLen;
+	taskEXIT_CRITICAL();
+	SD_GetBusStats(&pxStats->xBus);
+}
+
+/* PC7 (DET) changed level, card inserted or pulled. The task sorts out
+   which after debouncing. */
+void HAL_GPIO_EXTI_Callback(uint16_t GPIO_Pin)
+{
+	if(GPIO_Pin == GPIO_PIN_7)
+	{
+		xCardChanged = pdTRUE;
+		vStagingWakeFromISR();
+	}
+}
+
 static portTASK_FUNCTION(vSDCardWriteTask, pvParameters)
 {	
-	FATFS fs;
-	FIL fil;
-	FRESULT fres;
 	FSIZE_t fsize;
-	char SDPath[4];
 	
 	SD_SetSPIHandle(&hspi);
 	
-	if(HAL_GPIO_ReadPin(DET) != GPIO_PIN_SET)
-	{
-		/* SD CARD NOT INSERTED! */
-		Error_Handler();
-	}
-	if(FATFS_LinkDriver(&SD_SPI_Driver, SDPath) != 0)
+	/* The I/O task owns SPI1 from here on; it runs above this task so a
+	   finished transfer is picked up straight away */
+	if(ASYNC_Init(&SD_SPI_Driver, uxTaskPriorityGet(NULL) + 1) != 0)
 	{
 		Error_Handler();
 	}
-    /* Mount the file system */
-    fres = f_mount(&fs, "", 1);  // "" = logical drive 0, 1 = mount now
-    if(fres != FR_OK)
-	{
-        /* Mount failed - check error code */
-        /* FR_DISK_ERR = hardware problem */
-        if(fres == FR_DISK_ERR)
-		{
-			Error_Handler();
-		}
-		/* FR_NO_FILESYSTEM = needs formatting */
-		/* may be exFAT file system */
-		else if(fres == FR_NO_FILESYSTEM)
-		{
-			BYTE work[_MAX_SS];  /* Work area for formatting */
-			fres = f_mkfs("", FM_FAT32, 0, work, sizeof(work));    
-			if(fres != FR_OK)
-			{
-				Error_Handler();
-			}
-		
-			/* Try mounting again */
-			fres = f_mount(&fs, "", 1);
-			if(fres != FR_OK)
-			{
-				Error_Handler();
-			}
-		}
-		/* other errors */
-		else
-		{
-			Error_Handler();
-		}
-    }
-	/* Successfully mounted! */
-        
-	/* Create/open a file for writing, with write pointer set to EOF position */
-	if(f_open(&fil, configSD_FILE_NAME, FA_OPEN_APPEND | FA_WRITE) != FR_OK)
+	
+	/* Without a card, records are spooled until one is inserted */
+	if(HAL_GPIO_ReadPin(DET) == GPIO_PIN_SET)
 	{
-		/* Not sure what would be wrong */
-		Error_Handler();
+		xMounted = prvMount();
 	}
 	
 	BME680_OutputTypeDef bme680Data;
     BaseType_t xStatus;
+    TickType_t xStart;
 	
     forever
 	{
-		/* Wait on queue for bme680 output data */
-		xStatus = xQueueReceive(queue, &bme680Data, portMAX_DELAY);
+		/* Wait for staged bme680 output data, or a card detect edge */
+		xStatus = xStagingReceive(&bme680Data, portMAX_DELAY);
+		if(xCardChanged)
+		{
+			prvCardChanged();
+		}
         if(xStatus != pdPASS)
         {
-			Error_Handler();
+			continue;
+		}
+		if(!xMounted)
+		{
+			prvSpool(&bme680Data);
+			continue;
 		}
 		/* Write data to SD Card */
+		fsize = f_size(&fil);
+		xStart = xTaskGetTickCount();
 		if(lWriteOutput(&bme680Data, &fil) != 0)
 		{
-			Error_Handler();
+			/* Most likely pulled mid-write, before the EXTI was handled.
+			   Keep the record and remount if the card is still there. */
+			prvUnmount();
+			prvSpool(&bme680Data);
+			xCardChanged = pdTRUE;
+			continue;
 		}
+		/* Let the staging buffer size itself to the card's latency */
+		vStagingRecordLatency(xTaskGetTickCount() - xStart);
+		/* Report the payload so diskio can compute write amplification */
+		DWORD appended = f_size(&fil) - fsize;
+		disk_ioctl(SDPath[0] - '0', DISK_ADD_LOGICAL, &appended);
 		/// need some way to exit this loop (button?)
     }
 
+	prvUnmount();
+	
+	vTaskDelete(NULL);
+}
+
+/* Links the driver stack, mounts (formatting a blank card) and opens the
+   log file for appending. Returns pdPASS with the file open. */
+static BaseType_t prvMount(void)
+{
+	FRESULT fres;
+	FSIZE_t recovered = 0;
+	
+	/* A fresh link makes FatFs initialise the card again */
+	if(CACHE_LinkDriver(&ASYNC_Driver, SDPath) != 0)
+	{
+		return pdFAIL;
+	}
+    /* Mount the file system */
+    fres = f_mount(&fs, SDPath, 1);  // 1 = mount now
+	/* FR_NO_FILESYSTEM = needs formatting */
+	/* may be exFAT file system */
+	if(fres == FR_NO_FILESYSTEM)
+	{
+		BYTE work[_MAX_SS];  /* Work area for formatting */
+		fres = f_mkfs(SDPath, FM_FAT32, 0, work, sizeof(work));    
+		if(fres == FR_OK)
+		{
+			/* Try mounting again */
+			fres = f_mount(&fs, SDPath, 1);
+		}
+	}
+	/* Create/open a file for writing, with write pointer set to EOF
+	   position. Recovery reads the records it finds back. */
+	if(fres == FR_OK)
+	{
+		fres = f_open(&fil, configSD_FILE_NAME,
+					  FA_OPEN_APPEND | FA_WRITE | FA_READ);
+	}
+	if(fres == FR_OK)
+	{
+		fres = prvRecover(&recovered);
+	}
+	if(fres == FR_OK)
+	{
+		fres = f_lseek(&fil, f_size(&fil));
+	}
+	/* Release any extent a previous session preallocated but never wrote,
+	   as left behind when the card was pulled, and store the size */
+	if(fres == FR_OK)
+	{
+		fres = f_truncate(&fil);
+	}
+	if(fres == FR_OK)
+	{
+		fres = f_sync(&fil);
+	}
+	/* From here on records may go out with f_datasync */
+	if(fres == FR_OK)
+	{
+		fres = prvMark(pdTRUE);
+	}
+	if(fres != FR_OK)
+	{
+		/* FR_DISK_ERR = hardware problem; wait for the next insertion */
+		f_mount(NULL, SDPath, 0);
+		FATFS_UnLinkDriver(SDPath);
+		return pdFAIL;
+	}
+	
+	/* f_truncate left the chain ending in the cluster holding EOF */
+	xAllocEnd = f_size(&fil);
+	if(xAllocEnd % ((DWORD)fs.csize * _MAX_SS) != 0)
+	{
+		xAllocEnd += (DWORD)fs.csize * _MAX_SS - xAllocEnd % ((DWORD)fs.csize * _MAX_SS);
+	}
+	prvMapLog();
+	
+	xEntrySynced = xTaskGetTickCount();
+	xStats.uxRecoveredBytes += recovered;
+	xStats.uxMounts++;
+	prvDrainSpool();
+	return pdPASS;
+}
+
+/* Forgets the card. With the card already gone the close fails; whatever
+   was not synced is lost, which is at most the record being written. */
+static void prvUnmount(void)
+{
+	if(!xMounted)
+	{
+		return;
+	}
+	/* Trim the unwritten part of the extent off the file */
+	fil.cltbl = NULL;
+	f_truncate(&fil);
 	f_close(&fil);
 	/* First param NULL unmounts current filesystem */
-	fres = f_mount(NULL, "", 1);
+	f_mount(NULL, SDPath, 0);
+	FATFS_UnLinkDriver(SDPath);
+	xMounted = pdFALSE;
+	xStats.uxUnmounts++;
+}
+
+/* Writes the spool with a single f_write so FatFs hands whole sectors to
+   the driver as multi-block writes, and times it. */
+static void prvDrainSpool(void)
+{
+	UINT bytesWritten;
+	TickType_t xStart;
 	
-	vTaskDelete(NULL);
+	if(uxSpoolLen == 0)
+	{
+		return;
+	}
+	xStart = xTaskGetTickCount();
+	prvReserve(uxSpoolLen);
+	if(f_write(&fil, pcSpool, uxSpoolLen, &bytesWritten) != FR_OK ||
+	   bytesWritten != uxSpoolLen || f_sync(&fil) != FR_OK)
+	{
+		/* Keep the rest of the spool for the next mount. What f_write took
+		   may already be on the card, where recovery finds it, so it is
+		   not written a second time. */
+		prvSpoolConsume(bytesWritten);
+		return;
+	}
+	xStats.xLastDrainTicks = xTaskGetTickCount() - xStart;
+	xStats.uxLastDrainBytes = uxSpoolLen;
+	/* Records queued up behind the drain as they do behind a slow write */
+	vStagingRecordLatency(xStats.xLastDrainTicks);
+	
+	taskENTER_CRITICAL();
+	uxSpoolLen = 0;
+	taskEXIT_CRITICAL();
+}
+
+/* Appends a record to the spool, or counts it as lost if it is full. */
+static void prvSpool(const BME680_OutputTypeDef *data)
+{
+	char line[64];
+	uint32_t len = ulFormatRecord(data, line);
+	
+	if(uxSpoolLen + len > sizeof(pcSpool))
+	{
+		xStats.uxSpoolDropped++;
+		return;
+	}
+	memcpy(&pcSpool[uxSpoolLen], line, len);
+	taskENTER_CRITICAL();
+	uxSpoolLen += len;
+	taskEXIT_CRITICAL();
+	xStats.uxSpooled++;
+}
+
+/* Drops the records among the first len bytes of the spool. A record that
+   was cut short stays whole: recovery drops the fragment on the card, and
+   the record is written again. */
+static void prvSpoolConsume(UINT len)
+{
+	while(len != 0 && pcSpool[len - 1] != '\n')
+	{
+		len--;
+	}
+	memmove(pcSpool, &pcSpool[len], uxSpoolLen - len);
+	taskENTER_CRITICAL();
+	uxSpoolLen -= len;
+	taskEXIT_CRITICAL();
+}
+
+/* Handles a DET edge once the contacts have settled: mounts a newly
+   inserted card, draining the spool into it, or forgets a removed one. */
+static void prvCardChanged(void)
+{
+	xCardChanged = pdFALSE;
+	vTaskDelay(pdMS_TO_TICKS(configSD_DEBOUNCE_MS));
+	
+	if(HAL_GPIO_ReadPin(DET) == GPIO_PIN_SET)
+	{
+		if(!xMounted)
+		{
+			xMounted = prvMount();
+		}
+	}
+	else
+	{
+		/* Fail the close fast rather than waiting out bus timeouts */
+		SD_SPI_CardRemoved();
+		prvUnmount();
+	}
+}
+
+/* Builds the cluster link map of the log, so f_write steps through the
+   preallocated clusters without reading the FAT. */
+static void prvMapLog(void)
+{
+	pulClmt[0] = configSD_CLMT_ENTRIES;
+	fil.cltbl = pulClmt;
+	if(f_lseek(&fil, CREATE_LINKMAP) != FR_OK)
+	{
+		/* Too fragmented for the table */
+		fil.cltbl = NULL;
+	}
+}
+
+/* Makes sure the next len bytes of the log go to clusters the file already
+   owns, preallocating another contiguous extent behind its chain when they
+   would not. If the card has no contiguous space left, preallocation stops
+   for this mount and f_write allocates cluster by cluster. */
+static void prvReserve(UINT len)
+{
+	const DWORD ulCluster = (DWORD)fs.csize * _MAX_SS;
+	
+	if(f_tell(&fil) + len <= xAllocEnd)
+	{
+		return;
+	}
+	/* The link map does not cover the new extent; f_expand reads the end
+	   of the chain from it, then it is rebuilt */
+	if(f_expand(&fil, configSD_PREALLOC_BYTES, 2) != FR_OK)
+	{
+		fil.cltbl = NULL;
+		xAllocEnd = (FSIZE_t)-1;
+		/* Every record updates the entry from now on. Once it covers
+		   them all, nothing past the size is ever to be recovered. */
+		if(f_sync(&fil) == FR_OK)
+		{
+			prvMark(pdFALSE);
+		}
+		return;
+	}
+	xAllocEnd += ((configSD_PREALLOC_BYTES + ulCluster - 1) / ulCluster) * ulCluster;
+	xStats.uxExtents++;
+	prvMapLog();
 }
 
 static void Error_Handler(void)
@@ -182,56 +448,212 @@ static uint8_t i32toa(uint32_t num, uint8_t *buf)
 	return len;
 }
 
-/* Writes "time, hum, temp, press, gas_r\n" to SD Card in CSV format */
+/* Formats "time, hum, temp, press, gas_r\n" as CSV into out (at least 56
+   bytes) and returns its length */
+static uint32_t ulFormatRecord(const BME680_OutputTypeDef *data, char *out)
+{
+	const uint32_t fields[5] = {
+		(data->time_stamp) / 1000, /* seconds instead of milliseconds */
+		data->humidity,
+		data->temperature,
+		data->pressure,
+		data->gas_resistance
+	};
+	uint8_t buf[12]; /* MAX_INT32 is 10 characters long */
+	uint32_t pos = 0;
+	uint8_t len;
+
+	for(int i = 0; i < 5; i++)
+	{
+		memset(buf, 0, sizeof(buf));
+		len = i32toa(fields[i], buf);
+		memcpy(&out[pos], buf, len);
+		pos += len;
+		out[pos++] = (i < 4) ? ',' : '\n';
+	}
+	return pos;
+}
+
+/* Writes one CSV record to SD Card and makes it durable */
 static int lWriteOutput(BME680_OutputTypeDef *data, FIL *fil)
 {
 	UINT bytesWritten;
-	uint8_t buf[12] = {0}; /* MAX_INT32 is 10 characters long */
-	uint8_t len;
+	char line[64];
+	uint32_t len;
 	FRESULT fres;
 
-	/* divide time_stamp by 1000 to get seconds instead of milliseconds */
-	len = i32toa((data->time_stamp) / 1000, buf);
-	buf[len] = ',';
-	fres = f_write(fil, buf, len+1, &bytesWritten);
-	if(fres != FR_OK)
+	len = ulFormatRecord(data, line);
+	prvReserve(len);
+	fres = f_write(fil, line, len, &bytesWritten);
+	if(fres != FR_OK || bytesWritten != len)
 	{
 		return -1;
 	}
-	len = i32toa(data->humidity, buf);
-	buf[len] = ',';
-	fres = f_write(fil, buf, len+1, &bytesWritten);
+	
+	fres = prvSync(fil);
 	if(fres != FR_OK)
 	{
 		return -1;
 	}
-	len = i32toa(data->temperature, buf);
-	buf[len] = ',';
-	fres = f_write(fil, buf, len+1, &bytesWritten);
-	if(fres != FR_OK)
+
+	return 0;
+}
+
+/* Makes the record just written durable. Inside the preallocated extents
+   only the data is flushed, which f_recover can find again after a power
+   loss, and the directory entry is updated every configSD_DIRENT_SYNC_MS.
+   Clusters allocated by f_write are not erased, so without preallocation
+   every record updates the entry. */
+static FRESULT prvSync(FIL *fil)
+{
+	TickType_t xNow = xTaskGetTickCount();
+	
+	if(xAllocEnd != (FSIZE_t)-1 &&
+	   xNow - xEntrySynced < pdMS_TO_TICKS(configSD_DIRENT_SYNC_MS))
 	{
-		return -1;
+		return f_datasync(fil);
 	}
-	len = i32toa(data->pressure, buf);
-	buf[len] = ',';
-	fres = f_write(fil, buf, len+1, &bytesWritten);
-	if(fres != FR_OK)
+	xEntrySynced = xNow;
+	return f_sync(fil);
+}
+
+/* Takes back the records synced after the last directory update, which lie
+   past the recorded size. Only a log marked as written with f_datasync can
+   have any; otherwise whatever follows the size was never erased for the
+   log and is left alone. What f_recover finds is cut back to the last
+   complete, well-formed record. Unless all of it was taken, the rest of
+   the last cluster is zeroed so later records cannot be followed by stale
+   data. */
+static FRESULT prvRecover(FSIZE_t *pxRecovered)
+{
+	FILINFO xInfo;
+	FSIZE_t xSize = f_size(&fil);
+	FSIZE_t xEnd = xSize;
+	FRESULT fres;
+	
+	*pxRecovered = 0;
+	if(f_stat(configSD_MARK_NAME, &xInfo) == FR_OK)
 	{
-		return -1;
+		fres = f_recover(&fil, pxRecovered);
+		if(fres == FR_OK && *pxRecovered != 0)
+		{
+			fres = prvLastRecord(xSize, &xEnd);
+		}
+		if(fres != FR_OK)
+		{
+			return fres;
+		}
+		if(xEnd == xSize + *pxRecovered)
+		{
+			return FR_OK;
+		}
+		*pxRecovered = xEnd - xSize;
 	}
-	len = i32toa(data->gas_resistance, buf);
-	buf[len] = '\n';
-	fres = f_write(fil, buf, len+1, &bytesWritten);
-	if(fres != FR_OK)
+	return prvScrub(xEnd);
+}
+
+/* Reads the log from xFrom, a record boundary, to its end and returns in
+   pxEnd where the last complete record ends. A record is five fields of
+   1 to 10 digits separated by commas and ended by a newline, as written
+   by ulFormatRecord; anything else ends the scan. */
+static FRESULT prvLastRecord(FSIZE_t xFrom, FSIZE_t *pxEnd)
+{
+	char buf[64];
+	UINT uxRead;
+	UINT uxFields = 0;
+	UINT uxDigits = 0;
+	FSIZE_t xPos = xFrom;
+	FRESULT fres;
+	
+	*pxEnd = xFrom;
+	fres = f_lseek(&fil, xFrom);
+	while(fres == FR_OK)
 	{
-		return -1;
+		fres = f_read(&fil, buf, sizeof(buf), &uxRead);
+		if(fres != FR_OK || uxRead == 0)
+		{
+			break;
+		}
+		for(UINT i = 0; i < uxRead; i++, xPos++)
+		{
+			if(buf[i] >= '0' && buf[i] <= '9' && uxDigits < 10)
+			{
+				uxDigits++;
+			}
+			else if(buf[i] == ',' && uxDigits != 0 && uxFields < 4)
+			{
+				uxFields++;
+				uxDigits = 0;
+			}
+			else if(buf[i] == '\n' && uxDigits != 0 && uxFields == 4)
+			{
+				uxFields = 0;
+				uxDigits = 0;
+				*pxEnd = xPos + 1;
+			}
+			else
+			{
+				return FR_OK;
+			}
+		}
 	}
+	return fres;
+}
+
+/* Makes xEnd the size of the log and zeroes the rest of the cluster it
+   ends in. f_recover stops at the first zero, so at the next mount it
+   cannot run on into whatever that cluster held before. */
+static FRESULT prvScrub(FSIZE_t xEnd)
+{
+	static const char zeros[64];
+	const DWORD ulCluster = (DWORD)fs.csize * _MAX_SS;
+	FSIZE_t xLeft = (ulCluster - xEnd % ulCluster) % ulCluster;
+	UINT uxWritten;
+	UINT uxLen;
+	FRESULT fres;
 	
-	fres = f_sync(fil);
-	if(fres != FR_OK)
+	fres = f_lseek(&fil, xEnd);
+	if(fres == FR_OK)
 	{
-		return -1;
+		fres = f_truncate(&fil);
+	}
+	while(fres == FR_OK && xLeft != 0)
+	{
+		uxLen = (xLeft < sizeof(zeros)) ? (UINT)xLeft : sizeof(zeros);
+		fres = f_write(&fil, zeros, uxLen, &uxWritten);
+		xLeft -= uxLen;
+	}
+	if(fres == FR_OK)
+	{
+		fres = f_lseek(&fil, xEnd);
+	}
+	if(fres == FR_OK)
+	{
+		fres = f_truncate(&fil);
 	}
+	return fres;
+}
 
-	return 0;
+/* Creates or removes the datasync marker next to the log. */
+static FRESULT prvMark(BaseType_t xSet)
+{
+	FILINFO xInfo;
+	FIL xMark;
+	FRESULT fres;
+	
+	fres = f_stat(configSD_MARK_NAME, &xInfo);
+	if(xSet && fres == FR_NO_FILE)
+	{
+		fres = f_open(&xMark, configSD_MARK_NAME, FA_CREATE_NEW | FA_WRITE);
+		if(fres == FR_OK)
+		{
+			fres = f_close(&xMark);
+		}
+		return fres;
+	}
+	if(!xSet && fres == FR_OK)
+	{
+		return f_unlink(configSD_MARK_NAME);
+	}
+	return (fres == FR_NO_FILE) ? FR_OK : fres;
 }
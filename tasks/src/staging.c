@@ -0,0 +1,221 @@
+/* RAM staging buffer between vBME680PollTask and vSDCardWriteTask.
+
+   A ring of records whose size follows the SD card: the writer reports how
+   long each record took to reach the card, and the buffer is sized to hold
+   every record that arrives during the worst write of the recent window,
+   times a safety margin, within configSTAGING_MAX_BYTES. A garbage
+   collection pause of the card grows the buffer the first time it shows
+   up; once it has left the window the buffer shrinks back. */
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "semphr.h"
+#include "staging.h"
+
+#include "config.h"
+
+#include <string.h>
+
+#define stagingCEILING (configSTAGING_MAX_BYTES / sizeof(BME680_OutputTypeDef))
+
+/* Ring state, only touched inside critical sections */
+static BME680_OutputTypeDef *pxRing = NULL;
+static UBaseType_t uxCapacity = 0;
+static UBaseType_t uxHead = 0;     /* Next slot to write */
+static UBaseType_t uxCount = 0;
+
+static SemaphoreHandle_t xDataReady = NULL;
+static TickType_t xLastSend = 0;
+static StagingStats_t xStats = {0};
+
+/* Latency window, owned by the writer task */
+static TickType_t xWindow[configSTAGING_WINDOW];
+static UBaseType_t uxWindowNext = 0;
+
+/* Moves the ring into a new allocation of uxNew records. Fails, leaving the
+   buffer as it is, if the heap is short or the waiting records would not
+   fit. */
+static BaseType_t prvResize(UBaseType_t uxNew)
+{
+	BME680_OutputTypeDef *pxNew;
+	BME680_OutputTypeDef *pxOld;
+	UBaseType_t uxTail;
+	UBaseType_t uxFirst;
+
+	pxNew = pvPortMalloc(uxNew * sizeof(BME680_OutputTypeDef));
+	if(pxNew == NULL)
+	{
+		return pdFAIL;
+	}
+
+	taskENTER_CRITICAL();
+	if(uxCount > uxNew)
+	{
+		taskEXIT_CRITICAL();
+		vPortFree(pxNew);
+		return pdFAIL;
+	}
+	/* Unwrap the waiting records to the start of the new ring */
+	uxTail = (uxHead + uxCapacity - uxCount) % (uxCapacity ? uxCapacity : 1);
+	uxFirst = uxCapacity - uxTail;
+	if(uxFirst > uxCount)
+	{
+		uxFirst = uxCount;
+	}
+	if(uxCount != 0)
+	{
+		memcpy(pxNew, &pxRing[uxTail], uxFirst * sizeof(BME680_OutputTypeDef));
+		memcpy(&pxNew[uxFirst], pxRing, (uxCount - uxFirst) * sizeof(BME680_OutputTypeDef));
+	}
+	pxOld = pxRing;
+	pxRing = pxNew;
+	uxCapacity = uxNew;
+	uxHead = uxCount % uxNew;
+	xStats.uxResizes++;
+	taskEXIT_CRITICAL();
+
+	vPortFree(pxOld);
+	return pdPASS;
+}
+
+BaseType_t xStagingInit(void)
+{
+	xDataReady = xSemaphoreCreateBinary();
+	if(xDataReady == NULL)
+	{
+		return pdFAIL;
+	}
+	xStats.uxCeiling = stagingCEILING;
+	xStats.uxMinHeadroom = configSTAGING_MIN_RECORDS;
+	return prvResize(configSTAGING_MIN_RECORDS);
+}
+
+/* Never blocks: a full buffer drops the record and counts it. */
+BaseType_t xStagingSend(const BME680_OutputTypeDef *pxRecord)
+{
+	TickType_t xNow = xTaskGetTickCount();
+	BaseType_t xResult = pdFAIL;
+
+	taskENTER_CRITICAL();
+	if(xLastSend != 0)
+	{
+		xStats.xInterval = xNow - xLastSend;
+	}
+	xLastSend = xNow;
+
+	if(uxCount < uxCapacity)
+	{
+		pxRing[uxHead] = *pxRecord;
+		uxHead = (uxHead + 1) % uxCapacity;
+		uxCount++;
+		if(uxCount > xStats.uxHighWater)
+		{
+			xStats.uxHighWater = uxCount;
+		}
+		if(uxCapacity - uxCount < xStats.uxMinHeadroom)
+		{
+			xStats.uxMinHeadroom = uxCapacity - uxCount;
+		}
+		xResult = pdPASS;
+	}
+	else
+	{
+		xStats.uxMinHeadroom = 0;
+		xStats.uxDropped++;
+	}
+	taskEXIT_CRITICAL();
+
+	if(xResult == pdPASS)
+	{
+		xSemaphoreGive(xDataReady);
+	}
+	return xResult;
+}
+
+/* Returns pdFAIL on timeout, or when woken by vStagingWakeFromISR() with
+   nothing to receive. */
+BaseType_t xStagingReceive(BME680_OutputTypeDef *pxRecord, TickType_t xTicksToWait)
+{
+	for( ; ; )
+	{
+		taskENTER_CRITICAL();
+		if(uxCount != 0)
+		{
+			*pxRecord = pxRing[(uxHead + uxCapacity - uxCount) % uxCapacity];
+			uxCount--;
+			taskEXIT_CRITICAL();
+			return pdPASS;
+		}
+		taskEXIT_CRITICAL();
+
+		if(xTicksToWait == 0 || xSemaphoreTake(xDataReady, xTicksToWait) != pdPASS)
+		{
+			return pdFAIL;
+		}
+		/* Woken; anything sent meanwhile is taken on the next pass */
+		xTicksToWait = 0;
+	}
+}
+
+/* Wakes a task blocked in xStagingReceive() so it can attend to an event
+   other than new data. */
+void vStagingWakeFromISR(void)
+{
+	BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+
+	xSemaphoreGiveFromISR(xDataReady, &xHigherPriorityTaskWoken);
+	portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
+}
+
+/* Called by the writer after each record reached the card. Resizes the
+   ring to cover the worst latency of the last configSTAGING_WINDOW writes:
+   growing at once, shrinking only when the need has fallen below half the
+   current size. Until two records have been sent the arrival interval is
+   unknown, and the ring keeps its size. */
+void vStagingRecordLatency(TickType_t xLatency)
+{
+	TickType_t xWorst = 0;
+	TickType_t xInterval;
+	UBaseType_t uxTarget;
+
+	xWindow[uxWindowNext] = xLatency;
+	uxWindowNext = (uxWindowNext + 1) % configSTAGING_WINDOW;
+	for(UBaseType_t i = 0; i < configSTAGING_WINDOW; i++)
+	{
+		if(xWindow[i] > xWorst)
+		{
+			xWorst = xWindow[i];
+		}
+	}
+	xStats.xWorstLatency = xWorst;
+
+	xInterval = xStats.xInterval;
+	if(xInterval == 0)
+	{
+		return;
+	}
+	/* Records arriving during the worst write, plus the one in hand */
+	uxTarget = ((xWorst + xInterval - 1) / xInterval + 1) * configSTAGING_MARGIN;
+	if(uxTarget < configSTAGING_MIN_RECORDS)
+	{
+		uxTarget = configSTAGING_MIN_RECORDS;
+	}
+	if(uxTarget > stagingCEILING)
+	{
+		uxTarget = stagingCEILING;
+	}
+
+	if(uxTarget > uxCapacity || uxTarget * 2 < uxCapacity)
+	{
+		prvResize(uxTarget);
+	}
+}
+
+void vStagingGetStats(StagingStats_t *pxStats)
+{
+	taskENTER_CRITICAL();
+	*pxStats = xStats;
+	pxStats->uxCapacity = uxCapacity;
+	pxStats->uxCount = uxCount;
+	taskEXIT_CRITICAL();
+}